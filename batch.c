@@ -0,0 +1,253 @@
+/*
+
+   maxxc - maximise cross country flights
+   Copyright (C) 2008  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "maxxc.h"
+
+typedef struct {
+    int nfilenames;
+    int filenames_capacity;
+    char **filenames;
+} batch_t;
+
+    static void
+batch_push_filename(batch_t *batch, const char *filename, int len)
+{
+    if (batch->nfilenames == batch->filenames_capacity) {
+        int filenames_capacity = batch->filenames_capacity ? 2 * batch->filenames_capacity : 256;
+        char **filenames = mem_realloc(batch->filenames, filenames_capacity * sizeof(char *));
+        if (!filenames)
+            DIE("realloc", errno);
+        batch->filenames = filenames;
+        batch->filenames_capacity = filenames_capacity;
+    }
+    char *s = alloc(len + 1);
+    memcpy(s, filename, len);
+    batch->filenames[batch->nfilenames++] = s;
+}
+
+    static int
+batch_compare_filenames(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+    static void
+batch_read_directory(batch_t *batch, const char *dirname)
+{
+    DIR *dir = opendir(dirname);
+    if (!dir)
+        error("opendir: %s: %s", dirname, strerror(errno));
+    struct dirent *dirent;
+    while ((dirent = readdir(dir))) {
+        const char *ext = strrchr(dirent->d_name, '.');
+        if (!ext || (strcasecmp(ext, ".igc") && strcasecmp(ext, ".mxt")))
+            continue;
+        char *filename = 0;
+        int len = asprintf(&filename, "%s/%s", dirname, dirent->d_name);
+        if (len < 0)
+            DIE("asprintf", errno);
+        batch_push_filename(batch, filename, len);
+        free(filename);
+    }
+    closedir(dir);
+    qsort(batch->filenames, batch->nfilenames, sizeof(char *), batch_compare_filenames);
+}
+
+    static void
+batch_read_list(batch_t *batch, FILE *file)
+{
+    char *line = 0;
+    size_t line_capacity = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_capacity, file)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            --len;
+        if (len)
+            batch_push_filename(batch, line, len);
+    }
+    free(line);
+}
+
+    static char *
+batch_output_filename(const char *output_dirname, const char *input_filename, const char *format)
+{
+    const char *basename = strrchr(input_filename, '/');
+    basename = basename ? basename + 1 : input_filename;
+    const char *ext = strrchr(basename, '.');
+    int stem_end = ext ? ext - input_filename : (int) strlen(input_filename);
+    char *output_filename = 0;
+    int len;
+    if (output_dirname)
+        len = asprintf(&output_filename, "%s/%.*s.%s", output_dirname, (int) (stem_end - (basename - input_filename)), basename, format);
+    else
+        len = asprintf(&output_filename, "%.*s.%s", stem_end, input_filename, format);
+    if (len < 0)
+        DIE("asprintf", errno);
+    return output_filename;
+}
+
+    static int
+batch_compare_output_filenames(const void *a, const void *b)
+{
+    char * const *output_filename1 = *(char * const * const *) a, * const *output_filename2 = *(char * const * const *) b;
+    int result = strcmp(*output_filename1, *output_filename2);
+    return result ? result : output_filename1 < output_filename2 ? -1 : output_filename1 > output_filename2;
+}
+
+/* Returns the output filename of every input, or a null pointer for inputs
+ * whose output would overwrite that of an earlier input with the same stem,
+ * such as foo.igc and foo.mxt or two foo.igc from different directories
+ * written to the same -o directory. */
+    static char **
+batch_output_filenames(const batch_t *batch, const char *output_dirname, const char *format)
+{
+    char **output_filenames = alloc((batch->nfilenames ? batch->nfilenames : 1) * sizeof(char *));
+    char ***sorted = alloc((batch->nfilenames ? batch->nfilenames : 1) * sizeof(char **));
+    for (int i = 0; i < batch->nfilenames; ++i) {
+        output_filenames[i] = batch_output_filename(output_dirname, batch->filenames[i], format);
+        sorted[i] = output_filenames + i;
+    }
+    qsort(sorted, batch->nfilenames, sizeof(char **), batch_compare_output_filenames);
+    for (int i = 1; i < batch->nfilenames; ++i) {
+        int first = sorted[i - 1] - output_filenames;
+        if (strcmp(output_filenames[first], *sorted[i]))
+            continue;
+        int j = sorted[i] - output_filenames;
+        fprintf(stderr, "%s: %s: output %s would overwrite that of %s\n", program_name, batch->filenames[j], output_filenames[j], batch->filenames[first]);
+        sorted[i] = sorted[i - 1];
+        free(output_filenames[j]);
+        output_filenames[j] = 0;
+    }
+    mem_free(sorted);
+    return output_filenames;
+}
+
+    static int
+batch_run_one(const char *input_filename, const char *output_filename, const char *league, int complexity, const declaration_t *declaration, const char *format, int embed_igc, int embed_trk, double deadline, int stats, cache_t *cache, track_t *track, result_t *result)
+{
+    const char *filename = strrchr(input_filename, '/');
+    filename = filename ? filename + 1 : input_filename;
+    if (maxxc_track_open(track, filename, input_filename, embed_igc) != MAXXC_OK) {
+        fprintf(stderr, "%s: %s\n", program_name, maxxc_error_message());
+        return 0;
+    }
+
+    result_reset(result);
+    cache_key_t key;
+    if (cache)
+        cache_key(&key, track, league, complexity, declaration);
+    if (!cache || !cache_lookup(cache, &key, result)) {
+        track_set_deadline(track, deadline);
+        if (maxxc_optimize(track, league, complexity, declaration, result) != MAXXC_OK) {
+            fprintf(stderr, "%s: %s: %s\n", program_name, input_filename, maxxc_error_message());
+            return 0;
+        }
+#ifdef MAXXC_STATS
+        if (stats)
+            track_write_stats(track, stderr);
+#endif
+        if (cache && !track->stopped)
+            cache_store(cache, &key, result, 0);
+    }
+
+    FILE *output = fopen(output_filename, "w");
+    if (!output) {
+        fprintf(stderr, "%s: fopen: %s: %s\n", program_name, output_filename, strerror(errno));
+        return 0;
+    }
+    int flags = (embed_igc ? MAXXC_EMBED_IGC : 0) | (embed_trk ? MAXXC_EMBED_TRK : 0);
+    int ok = maxxc_result_write_file(result, track, format, flags, output) == MAXXC_OK;
+    if (!ok)
+        fprintf(stderr, "%s: %s: %s\n", program_name, output_filename, maxxc_error_message());
+    if (fclose(output) && ok) {
+        fprintf(stderr, "%s: fclose: %s: %s\n", program_name, output_filename, strerror(errno));
+        ok = 0;
+    }
+    return ok;
+}
+
+    int
+batch_run(const char *list, const char *output_dirname, const char *league, int complexity, const declaration_t *declaration, const char *format, int embed_igc, int embed_trk, int pyramid, double deadline, int stats, cache_t *cache)
+{
+    batch_t batch;
+    memset(&batch, 0, sizeof batch);
+    struct stat st;
+    if (!strcmp(list, "-")) {
+        batch_read_list(&batch, stdin);
+    } else if (stat(list, &st) == 0 && S_ISDIR(st.st_mode)) {
+        batch_read_directory(&batch, list);
+    } else {
+        FILE *file = fopen(list, "r");
+        if (!file)
+            error("fopen: %s: %s", list, strerror(errno));
+        batch_read_list(&batch, file);
+        fclose(file);
+    }
+
+    char **output_filenames = batch_output_filenames(&batch, output_dirname, format);
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    int nflights = 0;
+    /* Flights are scheduled across threads one file at a time.  The parallel
+     * regions inside the optimizer are nested and so run on a single thread,
+     * and each thread reuses its track and result buffers between files. */
+#pragma omp parallel reduction(+:nflights)
+    {
+        track_t *track = track_new();
+        track->pyramid = pyramid;
+        result_t *result = result_new();
+#pragma omp for schedule(dynamic, 1)
+        for (int i = 0; i < batch.nfilenames; ++i)
+            if (output_filenames[i])
+                nflights += batch_run_one(batch.filenames[i], output_filenames[i], league, complexity, declaration, format, embed_igc, embed_trk, deadline, stats, cache, track, result);
+        result_delete(result);
+        track_delete(track);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    fprintf(stderr, "%s: %d flights in %.3f s (%.2f flights/s)\n", program_name, nflights, elapsed, elapsed > 0.0 ? nflights / elapsed : 0.0);
+
+    int nfailures = batch.nfilenames - nflights;
+#ifdef MAXXC_STATS
+    if (stats) {
+        struct rusage rusage;
+        getrusage(RUSAGE_SELF, &rusage);
+        fprintf(stderr, "{\"flights\": %d, \"failures\": %d, \"wall\": %.6f, \"flights_per_second\": %.3f, \"max_rss_kb\": %ld}\n",
+                nflights, nfailures, elapsed, elapsed > 0.0 ? nflights / elapsed : 0.0, rusage.ru_maxrss);
+    }
+#endif
+    for (int i = 0; i < batch.nfilenames; ++i) {
+        mem_free(batch.filenames[i]);
+        free(output_filenames[i]);
+    }
+    mem_free(batch.filenames);
+    mem_free(output_filenames);
+    return nfailures;
+}
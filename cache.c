@@ -0,0 +1,451 @@
+/*
+
+   maxxc - maximise cross country flights
+   Copyright (C) 2008  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "maxxc.h"
+
+/* Bump whenever a change to the optimizer can change its results, so that
+ * results cached by older versions are never used. */
+#define CACHE_VERSION 3
+#define CACHE_MAGIC 0x4358584d
+#define CACHE_NULL_STRING 0xffff
+
+/* Evicting down to this fraction of the maximum size leaves room for a
+ * number of new entries before the directory has to be scanned again. */
+#define CACHE_LOW_WATER 0.9
+
+struct cache {
+    pthread_mutex_t mutex;
+    char *dirname;
+    long max_size;
+    long size;
+    int nstrings;
+    int strings_capacity;
+    char **strings;
+};
+
+typedef struct {
+    const char *p;
+    const char *end;
+    int ok;
+} cache_reader_t;
+
+typedef struct {
+    const char *name;
+    time_t mtime;
+    long size;
+} cache_entry_t;
+
+#define CACHE_FNV_PRIME (((unsigned __int128) 1 << 88) + 0x13b)
+#define CACHE_FNV_OFFSET ((((unsigned __int128) 0x6c62272e07bb0142ULL) << 64) + 0x62b821756295c58dULL)
+
+    static void
+cache_hash(unsigned __int128 *hash, const void *data, size_t size)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < size; ++i) {
+        *hash ^= p[i];
+        *hash *= CACHE_FNV_PRIME;
+    }
+}
+
+    static void
+cache_hash_int(unsigned __int128 *hash, int64_t value)
+{
+    cache_hash(hash, &value, sizeof value);
+}
+
+    static void
+cache_hash_double(unsigned __int128 *hash, double value)
+{
+    cache_hash(hash, &value, sizeof value);
+}
+
+    static void
+cache_hash_string(unsigned __int128 *hash, const char *s)
+{
+    cache_hash_int(hash, s ? (int64_t) strlen(s) : -1);
+    if (s)
+        cache_hash(hash, s, strlen(s));
+}
+
+/* The key covers everything the optimizer reads: the fixes and task
+ * waypoints of the track, the league, the complexity and the declaration.
+ * Fields are hashed one by one so that padding never enters the key. */
+    void
+cache_key(cache_key_t *key, const track_t *track, const char *league, int complexity, const declaration_t *declaration)
+{
+    unsigned __int128 hash = CACHE_FNV_OFFSET;
+    cache_hash_int(&hash, CACHE_VERSION);
+    cache_hash_string(&hash, league);
+    cache_hash_int(&hash, complexity);
+    cache_hash_int(&hash, declaration ? declaration->nturnpoints : -1);
+    for (int i = 0; declaration && i < declaration->nturnpoints; ++i) {
+        const turnpoint_t *turnpoint = declaration->turnpoints + i;
+        cache_hash_double(&hash, turnpoint->coord.x);
+        cache_hash_double(&hash, turnpoint->coord.y);
+        cache_hash_double(&hash, turnpoint->coord.z);
+        cache_hash_double(&hash, turnpoint->radius);
+    }
+    cache_hash_int(&hash, track->ntask_wpts);
+    for (int i = 0; i < track->ntask_wpts; ++i) {
+        const wpt_t *wpt = track->task_wpts + i;
+        cache_hash_int(&hash, wpt->lat);
+        cache_hash_int(&hash, wpt->lon);
+        cache_hash_string(&hash, wpt->name);
+    }
+    cache_hash_int(&hash, track->ntrkpts);
+    for (int i = 0; i < track->ntrkpts; ++i) {
+        const trkpt_t *trkpt = track->trkpts + i;
+        cache_hash_int(&hash, trkpt->time);
+        cache_hash_int(&hash, trkpt->lat);
+        cache_hash_int(&hash, trkpt->lon);
+        cache_hash_int(&hash, trkpt->val);
+        cache_hash_int(&hash, trkpt->alt);
+        cache_hash_int(&hash, trkpt->ele);
+    }
+    for (int i = 0; i < 16; ++i)
+        sprintf(key->hex + 2 * i, "%02x", (unsigned) (hash >> (8 * (15 - i))) & 0xff);
+}
+
+    static int
+cache_is_entry_name(const char *name)
+{
+    int i;
+    for (i = 0; name[i]; ++i)
+        if (!strchr("0123456789abcdef", name[i]))
+            return 0;
+    return i == 32;
+}
+
+    static int
+cache_compare_entries(const void *a, const void *b)
+{
+    const cache_entry_t *entry_a = a, *entry_b = b;
+    if (entry_a->mtime != entry_b->mtime)
+        return entry_a->mtime < entry_b->mtime ? -1 : 1;
+    return strcmp(entry_a->name, entry_b->name);
+}
+
+/* Totals the size of the entries in the cache and, if it exceeds bound,
+ * removes the least recently used entries down to the low water mark.  Must
+ * be called with the mutex held, so it returns -1 with errno set rather than
+ * raise an error. */
+    static int
+cache_scan(cache_t *cache, long bound)
+{
+    DIR *dir = opendir(cache->dirname);
+    if (!dir)
+        return -1;
+    int nentries = 0, entries_capacity = 0, result = 0;
+    cache_entry_t *entries = 0;
+    int fd = dirfd(dir);
+    struct dirent *dirent;
+    cache->size = 0;
+    while ((dirent = readdir(dir))) {
+        struct stat st;
+        if (!cache_is_entry_name(dirent->d_name) || fstatat(fd, dirent->d_name, &st, 0) == -1)
+            continue;
+        if (nentries == entries_capacity) {
+            entries_capacity = entries_capacity ? 2 * entries_capacity : 256;
+            cache_entry_t *new_entries = realloc(entries, entries_capacity * sizeof(cache_entry_t));
+            if (!new_entries) {
+                result = -1;
+                break;
+            }
+            entries = new_entries;
+        }
+        entries[nentries].name = strdup(dirent->d_name);
+        if (!entries[nentries].name) {
+            result = -1;
+            break;
+        }
+        entries[nentries].mtime = st.st_mtime;
+        entries[nentries].size = st.st_size;
+        cache->size += st.st_size;
+        ++nentries;
+    }
+    if (result == 0 && cache->size > bound) {
+        qsort(entries, nentries, sizeof(cache_entry_t), cache_compare_entries);
+        for (int i = 0; i < nentries && cache->size > CACHE_LOW_WATER * cache->max_size; ++i)
+            if (unlinkat(fd, entries[i].name, 0) == 0 || errno == ENOENT)
+                cache->size -= entries[i].size;
+    }
+    for (int i = 0; i < nentries; ++i)
+        free((char *) entries[i].name);
+    free(entries);
+    closedir(dir);
+    if (result == -1)
+        errno = ENOMEM;
+    return result;
+}
+
+    cache_t *
+cache_new(const char *dirname, long max_size)
+{
+    if (mkdir(dirname, 0777) == -1 && errno != EEXIST)
+        error("mkdir: %s: %s", dirname, strerror(errno));
+    cache_t *cache = alloc(sizeof(cache_t));
+    pthread_mutex_init(&cache->mutex, 0);
+    cache->dirname = mem_strdup(dirname);
+    if (!cache->dirname)
+        DIE("strdup", errno);
+    cache->max_size = max_size;
+    if (cache_scan(cache, cache->max_size) == -1)
+        error("opendir: %s: %s", dirname, strerror(errno));
+    return cache;
+}
+
+    void
+cache_delete(cache_t *cache)
+{
+    if (cache) {
+        for (int i = 0; i < cache->nstrings; ++i)
+            mem_free(cache->strings[i]);
+        mem_free(cache->strings);
+        mem_free(cache->dirname);
+        pthread_mutex_destroy(&cache->mutex);
+        mem_free(cache);
+    }
+}
+
+/* Routes point to static strings, so the strings of cached routes are kept
+ * once each for the life of the cache.  Must be called with the mutex
+ * held. */
+    static const char *
+cache_intern(cache_t *cache, const char *s, int len)
+{
+    for (int i = 0; i < cache->nstrings; ++i)
+        if (!strncmp(cache->strings[i], s, len) && !cache->strings[i][len])
+            return cache->strings[i];
+    if (cache->nstrings == cache->strings_capacity) {
+        int strings_capacity = cache->strings_capacity ? 2 * cache->strings_capacity : 32;
+        char **strings = mem_realloc(cache->strings, strings_capacity * sizeof(char *));
+        if (!strings)
+            DIE("realloc", errno);
+        cache->strings = strings;
+        cache->strings_capacity = strings_capacity;
+    }
+    char *string = alloc(len + 1);
+    memcpy(string, s, len);
+    cache->strings[cache->nstrings++] = string;
+    return string;
+}
+
+    static void
+cache_read(cache_reader_t *reader, void *data, int size)
+{
+    if (!reader->ok || reader->end - reader->p < size) {
+        reader->ok = 0;
+        memset(data, 0, size);
+        return;
+    }
+    memcpy(data, reader->p, size);
+    reader->p += size;
+}
+
+    static const char *
+cache_read_string(cache_reader_t *reader, cache_t *cache)
+{
+    uint16_t len = 0;
+    cache_read(reader, &len, sizeof len);
+    if (len == CACHE_NULL_STRING)
+        return 0;
+    if (!reader->ok || reader->end - reader->p < len) {
+        reader->ok = 0;
+        return 0;
+    }
+    const char *s = cache_intern(cache, reader->p, len);
+    reader->p += len;
+    return s;
+}
+
+    static void
+cache_write_string(string_buffer_t *buffer, const char *s)
+{
+    uint16_t len = s ? strlen(s) : CACHE_NULL_STRING;
+    string_buffer_append(buffer, (const char *) &len, sizeof len);
+    if (s)
+        string_buffer_append(buffer, s, len);
+}
+
+#define CACHE_WRITE(buffer, value) string_buffer_append((buffer), (const char *) &(value), sizeof (value))
+
+/* Appends the routes of the cache entry for key to result, returning whether
+ * there was one.  An entry that cannot be read is treated as missing. */
+    int
+cache_lookup(cache_t *cache, const cache_key_t *key, result_t *result)
+{
+    char *filename = 0;
+    if (asprintf(&filename, "%s/%s", cache->dirname, key->hex) < 0)
+        DIE("asprintf", errno);
+    int fd = open(filename, O_RDONLY);
+    free(filename);
+    if (fd == -1)
+        return 0;
+    struct stat st;
+    char *data = 0;
+    int ok = fstat(fd, &st) == 0;
+    if (ok) {
+        data = alloc(st.st_size + 1);
+        ok = read(fd, data, st.st_size) == st.st_size;
+    }
+    if (ok)
+        futimens(fd, 0);
+    close(fd);
+    if (!ok) {
+        mem_free(data);
+        return 0;
+    }
+
+    cache_reader_t reader = { data, data + st.st_size, 1 };
+    uint32_t magic = 0, version = 0, nroutes = 0;
+    cache_read(&reader, &magic, sizeof magic);
+    cache_read(&reader, &version, sizeof version);
+    cache_read(&reader, &nroutes, sizeof nroutes);
+    if (magic != CACHE_MAGIC || version != CACHE_VERSION) {
+        mem_free(data);
+        return 0;
+    }
+    int first = result->nroutes;
+    pthread_mutex_lock(&cache->mutex);
+    error_context_t context;
+    error_push(&context);
+    if (setjmp(context.env)) {
+        pthread_mutex_unlock(&cache->mutex);
+        mem_free(data);
+        error_raise(context.status, context.message);
+    }
+    for (uint32_t i = 0; i < nroutes && reader.ok; ++i) {
+        const char *league = cache_read_string(&reader, cache);
+        const char *name = cache_read_string(&reader, cache);
+        double distance, multiplier;
+        uint8_t circuit, declared;
+        uint32_t nwpts;
+        cache_read(&reader, &distance, sizeof distance);
+        cache_read(&reader, &multiplier, sizeof multiplier);
+        cache_read(&reader, &circuit, sizeof circuit);
+        cache_read(&reader, &declared, sizeof declared);
+        cache_read(&reader, &nwpts, sizeof nwpts);
+        if (!reader.ok)
+            break;
+        route_t *route = result_push_new_route(result, league, name, distance, multiplier, circuit, declared);
+        for (uint32_t j = 0; j < nwpts && reader.ok; ++j) {
+            wpt_t wpt;
+            int64_t time;
+            uint8_t val;
+            cache_read(&reader, &wpt.lat, sizeof wpt.lat);
+            cache_read(&reader, &wpt.lon, sizeof wpt.lon);
+            cache_read(&reader, &time, sizeof time);
+            cache_read(&reader, &val, sizeof val);
+            cache_read(&reader, &wpt.ele, sizeof wpt.ele);
+            wpt.time = time;
+            wpt.val = val;
+            wpt.name = (char *) cache_read_string(&reader, cache);
+            if (reader.ok)
+                route_push_wpt(route, &wpt);
+        }
+    }
+    error_pop(&context);
+    pthread_mutex_unlock(&cache->mutex);
+    mem_free(data);
+    if (!reader.ok || reader.p != reader.end) {
+        while (result->nroutes > first)
+            mem_free(result->routes[--result->nroutes].wpts);
+        return 0;
+    }
+    return 1;
+}
+
+/* Stores the routes of result from first onwards as the entry for key.
+ * Provisional and incomplete results depend on the deadline and are not
+ * stored.  The entry is written to a temporary file and renamed into place,
+ * so readers never see a partial entry.  Failures are reported but are not fatal. */
+    void
+cache_store(cache_t *cache, const cache_key_t *key, const result_t *result, int first)
+{
+    if (result->incomplete)
+        return;
+    for (int i = first; i < result->nroutes; ++i)
+        if (result->routes[i].provisional)
+            return;
+
+    string_buffer_t *buffer = string_buffer_new();
+    uint32_t magic = CACHE_MAGIC, version = CACHE_VERSION, nroutes = result->nroutes - first;
+    CACHE_WRITE(buffer, magic);
+    CACHE_WRITE(buffer, version);
+    CACHE_WRITE(buffer, nroutes);
+    for (int i = first; i < result->nroutes; ++i) {
+        const route_t *route = result->routes + i;
+        uint8_t circuit = route->circuit, declared = route->declared;
+        uint32_t nwpts = route->nwpts;
+        cache_write_string(buffer, route->league);
+        cache_write_string(buffer, route->name);
+        CACHE_WRITE(buffer, route->distance);
+        CACHE_WRITE(buffer, route->multiplier);
+        CACHE_WRITE(buffer, circuit);
+        CACHE_WRITE(buffer, declared);
+        CACHE_WRITE(buffer, nwpts);
+        for (int j = 0; j < route->nwpts; ++j) {
+            const wpt_t *wpt = route->wpts + j;
+            int64_t time = wpt->time;
+            uint8_t val = wpt->val;
+            CACHE_WRITE(buffer, wpt->lat);
+            CACHE_WRITE(buffer, wpt->lon);
+            CACHE_WRITE(buffer, time);
+            CACHE_WRITE(buffer, val);
+            CACHE_WRITE(buffer, wpt->ele);
+            cache_write_string(buffer, wpt->name);
+        }
+    }
+
+    char *tmpname = 0, *filename = 0;
+    if (asprintf(&tmpname, "%s/.%s.XXXXXX", cache->dirname, key->hex) < 0 || asprintf(&filename, "%s/%s", cache->dirname, key->hex) < 0)
+        DIE("asprintf", errno);
+    int fd = mkstemp(tmpname);
+    int ok = fd != -1;
+    if (ok) {
+        ok = write(fd, buffer->string, buffer->length) == buffer->length;
+        ok = close(fd) == 0 && ok;
+        ok = ok && rename(tmpname, filename) == 0;
+        if (!ok)
+            unlink(tmpname);
+    }
+    if (ok) {
+        pthread_mutex_lock(&cache->mutex);
+        cache->size += buffer->length;
+        if (cache->size > cache->max_size && cache_scan(cache, cache->max_size) == -1)
+            fprintf(stderr, "%s: cache: %s: %s\n", program_name, cache->dirname, strerror(errno));
+        pthread_mutex_unlock(&cache->mutex);
+    } else {
+        fprintf(stderr, "%s: cache: %s: %s\n", program_name, filename, strerror(errno));
+    }
+    free(filename);
+    free(tmpname);
+    string_buffer_free(buffer);
+}
@@ -13,19 +13,32 @@
 #include "maxxc.h"
 
 typedef struct {
+    XML_Parser parser;
     int state;
     string_buffer_t *radius;
     declaration_t *declaration;
+    const char *error;
 } state_t;
 
+    static void
+declaration_error(state_t *state, const char *error)
+{
+    if (!state->error) {
+        state->error = error;
+        XML_StopParser(state->parser, XML_FALSE);
+    }
+}
+
     static void
 declaration_push_turnpoint(declaration_t *declaration, const turnpoint_t *turnpoint)
 {
     if (declaration->nturnpoints == declaration->turnpoints_capacity) {
-        declaration->turnpoints_capacity = declaration->turnpoints_capacity ? 2 * declaration->turnpoints_capacity : 4;
-        declaration->turnpoints = realloc(declaration->turnpoints, declaration->turnpoints_capacity * sizeof(turnpoint_t));
-        if (!declaration->turnpoints)
+        int capacity = declaration->turnpoints_capacity ? 2 * declaration->turnpoints_capacity : 4;
+        turnpoint_t *turnpoints = mem_realloc(declaration->turnpoints, capacity * sizeof(turnpoint_t));
+        if (!turnpoints)
             DIE("realloc", errno);
+        declaration->turnpoints = turnpoints;
+        declaration->turnpoints_capacity = capacity;
     }
     declaration->turnpoints[declaration->nturnpoints] = *turnpoint;
     ++declaration->nturnpoints;
@@ -39,9 +52,7 @@ declaration_start_element_handler(void *userData, const XML_Char *name, const XM
     if (state->state == 0) {
         if (!strcmp(name, "rtept")) {
             turnpoint_t turnpoint;
-            turnpoint.coord.sin_lat = 0.0;
-            turnpoint.coord.cos_lat = 0.0;
-            turnpoint.coord.lon = 0.0;
+            double lat = 0.0, lon = 0.0;
             turnpoint.radius = 400.0;
             for (int i = 0; atts[i]; i += 2) {
                 if (!strcmp(atts[i], "lat")) {
@@ -49,19 +60,18 @@ declaration_start_element_handler(void *userData, const XML_Char *name, const XM
                     errno = 0;
                     double deg_lat = strtod(atts[i + 1], &endptr);
                     if (*endptr || errno)
-                        DIE("strtod", errno ? errno : EINVAL);
-                    double lat = M_PI * deg_lat / 180.0;
-                    turnpoint.coord.sin_lat = sin(lat);
-                    turnpoint.coord.cos_lat = cos(lat);
+                        declaration_error(state, "invalid latitude");
+                    lat = M_PI * deg_lat / 180.0;
                 } else if (!strcmp(atts[i], "lon")) {
                     char *endptr = 0;
                     errno = 0;
                     double deg_lon = strtod(atts[i + 1], &endptr);
                     if (*endptr || errno)
-                        DIE("strtod", errno ? errno : EINVAL);
-                    turnpoint.coord.lon = M_PI * deg_lon / 180.0;
+                        declaration_error(state, "invalid longitude");
+                    lon = M_PI * deg_lon / 180.0;
                 }
             }
+            coord_init(&turnpoint.coord, lat, lon);
             declaration_push_turnpoint(state->declaration, &turnpoint);
             ++state->state;
         }
@@ -107,7 +117,7 @@ declaration_end_element_handler(void *userData, const XML_Char *name)
                 while (isspace(*endptr))
                     ++endptr;
                 if (*endptr || errno)
-                    DIE("strtod", errno ? errno : EINVAL);
+                    declaration_error(state, "invalid radius");
                 state->declaration->turnpoints[state->declaration->nturnpoints - 1].radius = radius;
                 --state->state;
             }
@@ -115,35 +125,67 @@ declaration_end_element_handler(void *userData, const XML_Char *name)
     }
 }
 
+/* Reads a declaration from a GPX file, failing with
+ * MAXXC_ERROR_INVALID_DECLARATION if it is malformed. */
     declaration_t *
 declaration_new_from_file(FILE *file)
 {
+    static const XML_Memory_Handling_Suite memory = { mem_malloc, mem_realloc, mem_free };
+    XML_Parser volatile parser = 0;
+    string_buffer_t *volatile radius = 0;
+    declaration_t *volatile declaration = 0;
+    error_context_t context;
+    error_push(&context);
+    if (setjmp(context.env)) {
+        /* An allocation failed, possibly inside an expat callback. */
+        if (parser)
+            XML_ParserFree(parser);
+        string_buffer_free(radius);
+        declaration_free(declaration);
+        error_raise(context.status, context.message);
+    }
+    parser = XML_ParserCreate_MM("UTF-8", &memory, 0);
+    if (!parser)
+        DIE("XML_ParserCreate_MM", ENOMEM);
+    radius = string_buffer_new();
+    declaration = alloc(sizeof(declaration_t));
     state_t state;
-    state.state = 0;
-    state.radius = string_buffer_new();
-    state.declaration = alloc(sizeof(declaration_t));
-
-    XML_Parser p = XML_ParserCreate("UTF-8");
-    XML_SetUserData(p, &state);
-    XML_SetStartElementHandler(p, declaration_start_element_handler);
-    XML_SetCharacterDataHandler(p, declaration_character_data_handler);
-    XML_SetEndElementHandler(p, declaration_end_element_handler);
-    while (1) {
-        void *buffer = XML_GetBuffer(p, 4096);
-        if (!buffer)
-            DIE("XML_GetBuffer", errno);
+    memset(&state, 0, sizeof state);
+    state.parser = parser;
+    state.radius = radius;
+    state.declaration = declaration;
+    XML_SetUserData(state.parser, &state);
+    XML_SetStartElementHandler(state.parser, declaration_start_element_handler);
+    XML_SetCharacterDataHandler(state.parser, declaration_character_data_handler);
+    XML_SetEndElementHandler(state.parser, declaration_end_element_handler);
+    int _errno = 0, line = 0;
+    while (!state.error) {
+        void *buffer = XML_GetBuffer(state.parser, 4096);
+        if (!buffer) {
+            _errno = ENOMEM;
+            break;
+        }
         size_t size = fread(buffer, 1, 4096, file);
-        if (size == 0 && ferror(file))
-            DIE("fread", errno);
-        if (!XML_ParseBuffer(p, size, size == 0))
-            DIE("XML_ParseBuffer", errno);
+        if (size == 0 && ferror(file)) {
+            _errno = errno ? errno : EIO;
+            break;
+        }
+        if (!XML_ParseBuffer(state.parser, size, size == 0) && !state.error)
+            state.error = XML_ErrorString(XML_GetErrorCode(state.parser));
         if (!size)
             break;
     }
-    XML_ParserFree(p);
-
+    if (state.error)
+        line = XML_GetCurrentLineNumber(state.parser);
+    error_pop(&context);
+    XML_ParserFree(state.parser);
     string_buffer_free(state.radius);
-
+    if (_errno || state.error) {
+        declaration_free(state.declaration);
+        if (_errno)
+            DIE("declaration", _errno);
+        fail(MAXXC_ERROR_INVALID_DECLARATION, "declaration: line %d: %s", line, state.error);
+    }
     return state.declaration;
 }
 
@@ -151,7 +193,7 @@ declaration_new_from_file(FILE *file)
 declaration_free(declaration_t *declaration)
 {
     if (declaration) {
-        free(declaration->turnpoints);
-        free(declaration);
+        mem_free(declaration->turnpoints);
+        mem_free(declaration);
     }
 }
@@ -0,0 +1,132 @@
+/*
+
+   maxxc - maximise cross country flights
+   Copyright (C) 2008  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <math.h>
+#include "maxxc.h"
+
+/* Fixes are stored as unit vectors, so the distance between two of them
+ * follows from the length c of the chord between them.  The exact angle is
+ * 2 asin(c / 2); the optimizers use the first three terms of its series,
+ * which needs no trigonometry at all.  It falls short of the exact distance
+ * by about its first dropped term, 5 c^7 / 7168: a millimetre for a leg of
+ * 720 km and a centimetre for a leg of a thousand kilometres. */
+
+    void
+coord_init(coord_t *coord, double lat, double lon)
+{
+    coord->x = cos(lat) * cos(lon);
+    coord->y = cos(lat) * sin(lon);
+    coord->z = sin(lat);
+}
+
+    double
+coord_exact_delta(double chord2)
+{
+    return 2.0 * asin(0.5 * sqrt(chord2));
+}
+
+/* Computes the distances from coord to the n consecutive points whose
+ * coordinates start at x, y and z.  The vector versions are chosen at start
+ * up according to the instruction sets supported by the processor. */
+
+    static void
+coord_delta_row_scalar(const coord_t *coord, const double *x, const double *y, const double *z, int n, double *out)
+{
+    for (int k = 0; k < n; ++k) {
+        double dx = coord->x - x[k], dy = coord->y - y[k], dz = coord->z - z[k];
+        out[k] = coord_chord_delta(dx * dx + dy * dy + dz * dz);
+    }
+}
+
+#ifdef __x86_64__
+
+#include <immintrin.h>
+
+    static void
+coord_delta_row_sse2(const coord_t *coord, const double *x, const double *y, const double *z, int n, double *out)
+{
+    __m128d px = _mm_set1_pd(coord->x), py = _mm_set1_pd(coord->y), pz = _mm_set1_pd(coord->z);
+    __m128d one = _mm_set1_pd(1.0), a1 = _mm_set1_pd(COORD_CHORD_A1), a2 = _mm_set1_pd(COORD_CHORD_A2);
+    int k;
+    for (k = 0; k + 2 <= n; k += 2) {
+        __m128d dx = _mm_sub_pd(px, _mm_loadu_pd(x + k));
+        __m128d dy = _mm_sub_pd(py, _mm_loadu_pd(y + k));
+        __m128d dz = _mm_sub_pd(pz, _mm_loadu_pd(z + k));
+        __m128d c2 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), _mm_mul_pd(dz, dz));
+        __m128d series = _mm_add_pd(one, _mm_mul_pd(c2, _mm_add_pd(a1, _mm_mul_pd(c2, a2))));
+        _mm_storeu_pd(out + k, _mm_mul_pd(_mm_sqrt_pd(c2), series));
+    }
+    coord_delta_row_scalar(coord, x + k, y + k, z + k, n - k, out + k);
+}
+
+__attribute__ ((target("avx2")))
+    static void
+coord_delta_row_avx2(const coord_t *coord, const double *x, const double *y, const double *z, int n, double *out)
+{
+    __m256d px = _mm256_set1_pd(coord->x), py = _mm256_set1_pd(coord->y), pz = _mm256_set1_pd(coord->z);
+    __m256d one = _mm256_set1_pd(1.0), a1 = _mm256_set1_pd(COORD_CHORD_A1), a2 = _mm256_set1_pd(COORD_CHORD_A2);
+    int k;
+    for (k = 0; k + 4 <= n; k += 4) {
+        __m256d dx = _mm256_sub_pd(px, _mm256_loadu_pd(x + k));
+        __m256d dy = _mm256_sub_pd(py, _mm256_loadu_pd(y + k));
+        __m256d dz = _mm256_sub_pd(pz, _mm256_loadu_pd(z + k));
+        __m256d c2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz));
+        __m256d series = _mm256_add_pd(one, _mm256_mul_pd(c2, _mm256_add_pd(a1, _mm256_mul_pd(c2, a2))));
+        _mm256_storeu_pd(out + k, _mm256_mul_pd(_mm256_sqrt_pd(c2), series));
+    }
+    coord_delta_row_scalar(coord, x + k, y + k, z + k, n - k, out + k);
+}
+
+__attribute__ ((target("avx512f")))
+    static void
+coord_delta_row_avx512(const coord_t *coord, const double *x, const double *y, const double *z, int n, double *out)
+{
+    __m512d px = _mm512_set1_pd(coord->x), py = _mm512_set1_pd(coord->y), pz = _mm512_set1_pd(coord->z);
+    __m512d one = _mm512_set1_pd(1.0), a1 = _mm512_set1_pd(COORD_CHORD_A1), a2 = _mm512_set1_pd(COORD_CHORD_A2);
+    int k;
+    for (k = 0; k + 8 <= n; k += 8) {
+        __m512d dx = _mm512_sub_pd(px, _mm512_loadu_pd(x + k));
+        __m512d dy = _mm512_sub_pd(py, _mm512_loadu_pd(y + k));
+        __m512d dz = _mm512_sub_pd(pz, _mm512_loadu_pd(z + k));
+        __m512d c2 = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_mul_pd(dy, dy)), _mm512_mul_pd(dz, dz));
+        __m512d series = _mm512_add_pd(one, _mm512_mul_pd(c2, _mm512_add_pd(a1, _mm512_mul_pd(c2, a2))));
+        _mm512_storeu_pd(out + k, _mm512_mul_pd(_mm512_sqrt_pd(c2), series));
+    }
+    coord_delta_row_scalar(coord, x + k, y + k, z + k, n - k, out + k);
+}
+
+#endif
+
+void (*coord_delta_row)(const coord_t *, const double *, const double *, const double *, int, double *) = coord_delta_row_scalar;
+
+__attribute__ ((constructor))
+    static void
+coord_delta_row_select(void)
+{
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        coord_delta_row = coord_delta_row_avx512;
+    else if (__builtin_cpu_supports("avx2"))
+        coord_delta_row = coord_delta_row_avx2;
+    else
+        coord_delta_row = coord_delta_row_sse2;
+#endif
+}
@@ -0,0 +1,502 @@
+/*
+
+   maxxc - maximise cross country flights
+   Copyright (C) 2008  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "maxxc.h"
+
+#define MEM_ALIGNMENT 64
+
+const char *program_name = "maxxc";
+
+    static void *
+mem_default_malloc(size_t size, void *context)
+{
+    return malloc(size);
+}
+
+    static void *
+mem_default_realloc(void *p, size_t size, void *context)
+{
+    return realloc(p, size);
+}
+
+    static void
+mem_default_free(void *p, void *context)
+{
+    free(p);
+}
+
+static const maxxc_allocator_t mem_default_allocator = { mem_default_malloc, mem_default_realloc, mem_default_free, 0 };
+static maxxc_allocator_t mem_allocator = { mem_default_malloc, mem_default_realloc, mem_default_free, 0 };
+
+    void *
+mem_malloc(size_t size)
+{
+    void *p = mem_allocator.malloc(size ? size : 1, mem_allocator.context);
+    if (!p)
+        errno = ENOMEM;
+    return p;
+}
+
+    void *
+mem_realloc(void *p, size_t size)
+{
+    if (!p)
+        return mem_malloc(size);
+    void *q = mem_allocator.realloc(p, size ? size : 1, mem_allocator.context);
+    if (!q)
+        errno = ENOMEM;
+    return q;
+}
+
+    void
+mem_free(void *p)
+{
+    if (p)
+        mem_allocator.free(p, mem_allocator.context);
+}
+
+    char *
+mem_strdup(const char *s)
+{
+    size_t size = strlen(s) + 1;
+    char *t = mem_malloc(size);
+    if (t)
+        memcpy(t, s, size);
+    return t;
+}
+
+/* Returns memory aligned to a cache line, with the pointer to the underlying
+ * allocation stored just before it. */
+    void *
+mem_aligned_alloc(size_t size)
+{
+    char *p = mem_malloc(size + MEM_ALIGNMENT + sizeof(void *));
+    if (!p)
+        return 0;
+    char *aligned = (char *) (((uintptr_t) p + sizeof(void *) + MEM_ALIGNMENT - 1) & ~(uintptr_t) (MEM_ALIGNMENT - 1));
+    ((void **) aligned)[-1] = p;
+    return aligned;
+}
+
+    void
+mem_aligned_free(void *p)
+{
+    if (p)
+        mem_free(((void **) p)[-1]);
+}
+
+    void *
+alloc(int size)
+{
+    void *p = mem_malloc(size);
+    if (!p)
+        DIE("malloc", ENOMEM);
+    memset(p, 0, size);
+    return p;
+}
+
+static __thread error_context_t *error_contexts = 0;
+static __thread char error_message[256];
+
+    void
+error_push(error_context_t *context)
+{
+    context->status = MAXXC_OK;
+    context->message[0] = '\0';
+    context->next = error_contexts;
+    error_contexts = context;
+}
+
+    void
+error_pop(error_context_t *context)
+{
+    error_contexts = context->next;
+}
+
+    void
+error_raise(int status, const char *message)
+{
+    error_context_t *context = error_contexts;
+    if (!context) {
+        fprintf(stderr, "%s: %s\n", program_name, message);
+        exit(EXIT_FAILURE);
+    }
+    context->status = status;
+    snprintf(context->message, sizeof context->message, "%s", message);
+    error_contexts = context->next;
+    longjmp(context->env, 1);
+}
+
+__attribute__ ((noreturn))
+    static void
+error_vraise(int status, const char *format, va_list ap)
+{
+    char message[256];
+    vsnprintf(message, sizeof message, format, ap);
+    error_raise(status, message);
+}
+
+    void
+fail(int status, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    error_vraise(status, format, ap);
+    va_end(ap);
+}
+
+    void
+error(const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    error_vraise(MAXXC_ERROR, format, ap);
+    va_end(ap);
+}
+
+    void
+die(const char *file, int line, const char *function, const char *message, int _errno)
+{
+    int status = _errno == ENOMEM ? MAXXC_ERROR_NOMEM : _errno > 0 ? MAXXC_ERROR_IO : MAXXC_ERROR;
+    if (_errno > 0)
+        fail(status, "%s:%d: %s: %s: %s", file, line, function, message, strerror(_errno));
+    else if (message)
+        fail(status, "%s:%d: %s: %s", file, line, function, message);
+    else
+        fail(status, "%s:%d: %s", file, line, function);
+}
+
+/* Records the error caught by an API function for maxxc_error_message and
+ * returns its status. */
+    static maxxc_status_t
+maxxc_caught(const error_context_t *context)
+{
+    memcpy(error_message, context->message, sizeof error_message);
+    return context->status;
+}
+
+#define MAXXC_TRY(context) \
+    error_push(&(context)); \
+    if (setjmp((context).env)) \
+        return maxxc_caught(&(context))
+
+#define MAXXC_RETURN(context) \
+    do { \
+        error_pop(&(context)); \
+        return MAXXC_OK; \
+    } while (0)
+
+    void
+maxxc_set_allocator(const maxxc_allocator_t *allocator)
+{
+    mem_allocator = allocator ? *allocator : mem_default_allocator;
+}
+
+    void
+maxxc_free(void *p)
+{
+    mem_free(p);
+}
+
+    const char *
+maxxc_strerror(maxxc_status_t status)
+{
+    switch (status) {
+        case MAXXC_OK:
+            return "success";
+        case MAXXC_ERROR_NOMEM:
+            return "out of memory";
+        case MAXXC_ERROR_IO:
+            return "input/output error";
+        case MAXXC_ERROR_INVALID_ARGUMENT:
+            return "invalid argument";
+        case MAXXC_ERROR_INVALID_DECLARATION:
+            return "invalid declaration";
+        case MAXXC_ERROR_INVALID_TRACK:
+            return "invalid track";
+        case MAXXC_ERROR_CANCELLED:
+            return "cancelled";
+        default:
+            return "internal error";
+    }
+}
+
+    const char *
+maxxc_error_message(void)
+{
+    return error_message;
+}
+
+    maxxc_status_t
+maxxc_track_new(maxxc_track_t **track)
+{
+    error_context_t context;
+    MAXXC_TRY(context);
+    *track = track_new();
+    MAXXC_RETURN(context);
+}
+
+    void
+maxxc_track_delete(maxxc_track_t *track)
+{
+    track_delete(track);
+}
+
+    static void
+maxxc_track_set_filename(maxxc_track_t *track, const char *filename)
+{
+    mem_free(track->filename_buffer);
+    track->filename_buffer = 0;
+    if (filename && !(track->filename_buffer = mem_strdup(filename)))
+        DIE("strdup", ENOMEM);
+}
+
+/* Parses an IGC file held in memory, which is copied. */
+    maxxc_status_t
+maxxc_track_read_igc(maxxc_track_t *track, const char *filename, const char *igc, size_t size)
+{
+    error_context_t context;
+    error_push(&context);
+    if (setjmp(context.env)) {
+        track_clear(track);
+        return maxxc_caught(&context);
+    }
+    if (size >= INT32_MAX)
+        fail(MAXXC_ERROR_INVALID_ARGUMENT, "IGC file too large");
+    maxxc_track_set_filename(track, filename);
+    if ((int) size + 1 > track->igc_capacity) {
+        char *igc_buffer = mem_realloc(track->igc_buffer, size + 1);
+        if (!igc_buffer)
+            DIE("realloc", errno);
+        track->igc_buffer = igc_buffer;
+        track->igc_capacity = size + 1;
+    }
+    memcpy(track->igc_buffer, igc, size);
+    track->igc_buffer[size] = '\0';
+    track_read_igc_string(track, track->filename_buffer, track->igc_buffer, size);
+    MAXXC_RETURN(context);
+}
+
+/* Reads an IGC file or a precompiled track from path, keeping the IGC file
+ * for output if embed_igc is set. */
+    maxxc_status_t
+maxxc_track_open(maxxc_track_t *track, const char *filename, const char *path, int embed_igc)
+{
+    error_context_t context;
+    error_push(&context);
+    if (setjmp(context.env)) {
+        track_clear(track);
+        return maxxc_caught(&context);
+    }
+    maxxc_track_set_filename(track, filename);
+    if (track_map_igc(track, track->filename_buffer, path, embed_igc) == -1) {
+        if (errno == EINVAL)
+            fail(MAXXC_ERROR_INVALID_TRACK, "open: %s: %s", path, strerror(errno));
+        else
+            fail(MAXXC_ERROR_IO, "open: %s: %s", path, strerror(errno));
+    }
+    MAXXC_RETURN(context);
+}
+
+    int
+maxxc_track_ntrkpts(const maxxc_track_t *track)
+{
+    return track->ntrkpts;
+}
+
+    void
+maxxc_track_set_pyramid(maxxc_track_t *track, int pyramid)
+{
+    track->pyramid = pyramid;
+}
+
+/* Makes maxxc_optimize stop with the best flights found so far once the given
+ * number of seconds from now have passed, or removes the limit if seconds is
+ * zero. */
+    void
+maxxc_track_set_deadline(maxxc_track_t *track, double seconds)
+{
+    track_set_deadline(track, seconds);
+}
+
+/* Makes the optimisation running on the track stop as soon as possible.  May
+ * be called from any thread. */
+    void
+maxxc_track_cancel(maxxc_track_t *track)
+{
+    track->cancelled = 1;
+}
+
+    maxxc_status_t
+maxxc_declaration_new(maxxc_declaration_t **declaration, const char *gpx, size_t size)
+{
+    error_context_t context;
+    MAXXC_TRY(context);
+    FILE *file = fmemopen((void *) gpx, size, "r");
+    if (!file)
+        DIE("fmemopen", errno);
+    error_context_t inner;
+    error_push(&inner);
+    if (setjmp(inner.env)) {
+        fclose(file);
+        error_raise(inner.status, inner.message);
+    }
+    *declaration = declaration_new_from_file(file);
+    error_pop(&inner);
+    fclose(file);
+    MAXXC_RETURN(context);
+}
+
+    void
+maxxc_declaration_delete(maxxc_declaration_t *declaration)
+{
+    declaration_free(declaration);
+}
+
+    maxxc_status_t
+maxxc_result_new(maxxc_result_t **result)
+{
+    error_context_t context;
+    MAXXC_TRY(context);
+    *result = result_new();
+    MAXXC_RETURN(context);
+}
+
+    void
+maxxc_result_delete(maxxc_result_t *result)
+{
+    result_delete(result);
+}
+
+    void
+maxxc_result_reset(maxxc_result_t *result)
+{
+    result_reset(result);
+}
+
+    int
+maxxc_result_nroutes(const maxxc_result_t *result)
+{
+    return result->nroutes;
+}
+
+/* Returns whether the search was stopped by a deadline or cancellation before
+ * it finished, so that the result may lack some kinds of flight. */
+    int
+maxxc_result_incomplete(const maxxc_result_t *result)
+{
+    return result->incomplete;
+}
+
+    maxxc_status_t
+maxxc_result_route(const maxxc_result_t *result, int index, maxxc_route_t *route)
+{
+    if (index < 0 || index >= result->nroutes) {
+        snprintf(error_message, sizeof error_message, "route %d: no such route", index);
+        return MAXXC_ERROR_INVALID_ARGUMENT;
+    }
+    const route_t *r = result->routes + index;
+    route->league = r->league;
+    route->name = r->name;
+    route->distance = r->distance;
+    route->multiplier = r->multiplier;
+    route->score = r->distance * r->multiplier;
+    route->circuit = r->circuit;
+    route->declared = r->declared;
+    route->provisional = r->provisional;
+    route->upper_bound = r->upper_bound;
+    route->nrtepts = r->nwpts;
+    return MAXXC_OK;
+}
+
+/* Writes the result in the given format to a buffer that the caller must
+ * release with maxxc_free. */
+    maxxc_status_t
+maxxc_result_write(const maxxc_result_t *result, const maxxc_track_t *track, const char *format, int flags, char **data, size_t *size)
+{
+    result_write_t result_write = result_write_for_format(format);
+    if (!result_write) {
+        snprintf(error_message, sizeof error_message, "invalid format '%s'", format);
+        return MAXXC_ERROR_INVALID_ARGUMENT;
+    }
+    error_context_t context;
+    output_t *volatile output = 0;
+    error_push(&context);
+    if (setjmp(context.env)) {
+        output_delete(output);
+        return maxxc_caught(&context);
+    }
+    output = output_new_buffer();
+    result_write(result, track, flags & MAXXC_EMBED_IGC, flags & MAXXC_EMBED_TRK, output);
+    *data = output_steal(output, size);
+    output_delete(output);
+    MAXXC_RETURN(context);
+}
+
+    maxxc_status_t
+maxxc_result_write_file(const maxxc_result_t *result, const maxxc_track_t *track, const char *format, int flags, FILE *file)
+{
+    result_write_t result_write = result_write_for_format(format);
+    if (!result_write) {
+        snprintf(error_message, sizeof error_message, "invalid format '%s'", format);
+        return MAXXC_ERROR_INVALID_ARGUMENT;
+    }
+    error_context_t context;
+    output_t *volatile output = 0;
+    error_push(&context);
+    if (setjmp(context.env)) {
+        output_delete(output);
+        return maxxc_caught(&context);
+    }
+    output = output_new(file);
+    result_write(result, track, flags & MAXXC_EMBED_IGC, flags & MAXXC_EMBED_TRK, output);
+    if (output_flush(output) == -1)
+        DIE("fwrite", output->error);
+    if (fflush(file) == EOF || ferror(file))
+        DIE("fwrite", errno ? errno : EIO);
+    output_delete(output);
+    MAXXC_RETURN(context);
+}
+
+/* Appends the best flights of the track for the league to the result.  A
+ * negative complexity allows every kind of flight. */
+    maxxc_status_t
+maxxc_optimize(maxxc_track_t *track, const char *league, int complexity, const maxxc_declaration_t *declaration, maxxc_result_t *result)
+{
+    track_optimize_t track_optimize = track_optimize_for_league(league);
+    if (!track_optimize) {
+        snprintf(error_message, sizeof error_message, "invalid league '%s'", league);
+        return MAXXC_ERROR_INVALID_ARGUMENT;
+    }
+    error_context_t context;
+    MAXXC_TRY(context);
+    track_optimize(track, complexity, declaration, result);
+    error_pop(&context);
+    if (track->cancelled) {
+        snprintf(error_message, sizeof error_message, "cancelled");
+        return MAXXC_ERROR_CANCELLED;
+    }
+    return MAXXC_OK;
+}
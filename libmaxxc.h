@@ -0,0 +1,131 @@
+/*
+
+   maxxc - maximise cross country flights
+   Copyright (C) 2008  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+   libmaxxc - the maxxc optimiser as a library
+
+   Every function is reentrant: any number of threads may optimise different
+   tracks at the same time.  A single track, result or declaration must only
+   be used by one thread at a time, except for maxxc_track_cancel.  Functions
+   that can fail return a maxxc_status_t, and maxxc_error_message returns a
+   description of the last failure in the calling thread.  Memory returned
+   to the caller, such as the output of maxxc_result_write, is released with
+   maxxc_free.
+
+	maxxc_track_t *track;
+	maxxc_result_t *result;
+	char *gpx;
+	size_t size;
+	if (maxxc_track_new(&track) || maxxc_result_new(&result)
+	    || maxxc_track_read_igc(track, "flight.igc", igc, igc_size)
+	    || maxxc_optimize(track, "frcfd", -1, 0, result)
+	    || maxxc_result_write(result, track, "gpx", 0, &gpx, &size))
+		fprintf(stderr, "%s\n", maxxc_error_message());
+
+*/
+
+#ifndef LIBMAXXC_H
+#define LIBMAXXC_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAXXC_EXPORT __attribute__ ((visibility("default")))
+
+typedef enum {
+    MAXXC_OK = 0,
+    MAXXC_ERROR,
+    MAXXC_ERROR_NOMEM,
+    MAXXC_ERROR_IO,
+    MAXXC_ERROR_INVALID_ARGUMENT,
+    MAXXC_ERROR_INVALID_DECLARATION,
+    MAXXC_ERROR_INVALID_TRACK,
+    MAXXC_ERROR_CANCELLED,
+} maxxc_status_t;
+
+#define MAXXC_EMBED_IGC 1
+#define MAXXC_EMBED_TRK 2
+
+/* The functions must be safe to call from several threads at once.  realloc
+ * and free are never passed a null pointer. */
+typedef struct {
+    void *(*malloc)(size_t, void *);
+    void *(*realloc)(void *, size_t, void *);
+    void (*free)(void *, void *);
+    void *context;
+} maxxc_allocator_t;
+
+typedef struct track maxxc_track_t;
+typedef struct result maxxc_result_t;
+typedef struct declaration maxxc_declaration_t;
+
+typedef struct {
+    const char *league;
+    const char *name;
+    double distance;
+    double multiplier;
+    double score;
+    int circuit;
+    int declared;
+    int provisional;
+    double upper_bound;
+    int nrtepts;
+} maxxc_route_t;
+
+/* Replaces the allocator used for all memory, or restores malloc if null.
+ * It must be called before any other function. */
+MAXXC_EXPORT void maxxc_set_allocator(const maxxc_allocator_t *);
+MAXXC_EXPORT void maxxc_free(void *);
+MAXXC_EXPORT const char *maxxc_strerror(maxxc_status_t);
+MAXXC_EXPORT const char *maxxc_error_message(void);
+
+MAXXC_EXPORT maxxc_status_t maxxc_track_new(maxxc_track_t **);
+MAXXC_EXPORT void maxxc_track_delete(maxxc_track_t *);
+MAXXC_EXPORT maxxc_status_t maxxc_track_read_igc(maxxc_track_t *, const char *, const char *, size_t);
+MAXXC_EXPORT maxxc_status_t maxxc_track_open(maxxc_track_t *, const char *, const char *, int);
+MAXXC_EXPORT int maxxc_track_ntrkpts(const maxxc_track_t *);
+MAXXC_EXPORT void maxxc_track_set_pyramid(maxxc_track_t *, int);
+MAXXC_EXPORT void maxxc_track_set_deadline(maxxc_track_t *, double);
+MAXXC_EXPORT void maxxc_track_cancel(maxxc_track_t *);
+
+MAXXC_EXPORT maxxc_status_t maxxc_declaration_new(maxxc_declaration_t **, const char *, size_t);
+MAXXC_EXPORT void maxxc_declaration_delete(maxxc_declaration_t *);
+
+MAXXC_EXPORT maxxc_status_t maxxc_result_new(maxxc_result_t **);
+MAXXC_EXPORT void maxxc_result_delete(maxxc_result_t *);
+MAXXC_EXPORT void maxxc_result_reset(maxxc_result_t *);
+MAXXC_EXPORT int maxxc_result_nroutes(const maxxc_result_t *);
+MAXXC_EXPORT int maxxc_result_incomplete(const maxxc_result_t *);
+MAXXC_EXPORT maxxc_status_t maxxc_result_route(const maxxc_result_t *, int, maxxc_route_t *);
+MAXXC_EXPORT maxxc_status_t maxxc_result_write(const maxxc_result_t *, const maxxc_track_t *, const char *, int, char **, size_t *);
+MAXXC_EXPORT maxxc_status_t maxxc_result_write_file(const maxxc_result_t *, const maxxc_track_t *, const char *, int, FILE *);
+
+MAXXC_EXPORT maxxc_status_t maxxc_optimize(maxxc_track_t *, const char *, int, const maxxc_declaration_t *, maxxc_result_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,353 @@
+/*
+
+   maxxc - maximise cross country flights
+   Copyright (C) 2008  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+   maxxc-igcgen writes synthetic IGC files for benchmarking.  The same
+   options and seed always give the same file.  A flight alternates glides
+   along its course with climbs circling in thermals that drift with the
+   wind.  The course depends on the kind of flight:
+
+	glide		a single straight glide without thermals
+	thermal		a cross country flight whose course wanders
+	out-and-return	out along a fixed course and back along the same line
+	triangle	three legs 120 degrees apart, an FAI triangle
+
+   Out-and-return flights are the worst case for the flat triangle search.
+   GPS spikes, single fixes thrown several kilometres off the track, can be
+   added to any kind of flight.
+
+*/
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IGCGEN_R 6371000.0
+#define IGCGEN_GLIDE_SPEED 12.0
+#define IGCGEN_CLIMB_SPEED 10.0
+#define IGCGEN_CLIMB_RADIUS 40.0
+#define IGCGEN_WIND_SPEED 3.0
+#define IGCGEN_COURSE_SPEED 6.0
+#define IGCGEN_TURNPOINT_RADIUS 200.0
+#define IGCGEN_START_TIME (10 * 3600)
+
+typedef enum {
+    IGCGEN_GLIDE,
+    IGCGEN_THERMAL,
+    IGCGEN_OUT_AND_RETURN,
+    IGCGEN_TRIANGLE,
+} igcgen_kind_t;
+
+static const char *program_name = 0;
+static uint64_t igcgen_state = 0;
+
+    static void
+igcgen_error(const char *message, const char *arg)
+{
+    fprintf(stderr, "%s: %s '%s'\n", program_name, message, arg);
+    exit(EXIT_FAILURE);
+}
+
+/* splitmix64, so that the output does not depend on the C library. */
+    static uint64_t
+igcgen_next(void)
+{
+    uint64_t z = (igcgen_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+    static double
+igcgen_uniform(double lo, double hi)
+{
+    return lo + (hi - lo) * (igcgen_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+    static double
+igcgen_gaussian(double sigma)
+{
+    double u = 1.0 - igcgen_uniform(0.0, 1.0);
+    return sigma * sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * igcgen_uniform(0.0, 1.0));
+}
+
+    static int
+igcgen_compare_ints(const void *a, const void *b)
+{
+    return *(const int *) a - *(const int *) b;
+}
+
+/* Writes an angle in radians as degrees, minutes and thousandths of a
+ * minute, followed by its hemisphere. */
+    static void
+igcgen_write_angle(FILE *file, double angle, int width, char positive, char negative)
+{
+    long mmin = lround(fabs(angle) * 180.0 / M_PI * 60000.0);
+    fprintf(file, "%0*ld%05ld%c", width, mmin / 60000, mmin % 60000, angle < 0.0 ? negative : positive);
+}
+
+typedef struct {
+    double lat;
+    double lon;
+} igcgen_point_t;
+
+/* Returns the point distance metres from point on bearing, for distances
+ * short enough that the ground is flat. */
+    static igcgen_point_t
+igcgen_move(igcgen_point_t point, double distance, double bearing)
+{
+    igcgen_point_t result;
+    result.lat = point.lat + distance * cos(bearing) / IGCGEN_R;
+    result.lon = point.lon + distance * sin(bearing) / (IGCGEN_R * cos(point.lat));
+    return result;
+}
+
+    static double
+igcgen_bearing(igcgen_point_t from, igcgen_point_t to)
+{
+    return atan2((to.lon - from.lon) * cos(from.lat), to.lat - from.lat);
+}
+
+    static double
+igcgen_distance(igcgen_point_t from, igcgen_point_t to)
+{
+    return IGCGEN_R * hypot((to.lon - from.lon) * cos(from.lat), to.lat - from.lat);
+}
+
+    static void
+igcgen_write(FILE *file, igcgen_kind_t kind, int n, int rate, int interval, int nspikes)
+{
+    int *spikes = malloc((nspikes ? nspikes : 1) * sizeof(int));
+    if (!spikes) {
+        perror(program_name);
+        exit(EXIT_FAILURE);
+    }
+    for (int s = 0; s < nspikes; ++s)
+        spikes[s] = igcgen_next() % n;
+    qsort(spikes, nspikes, sizeof(int), igcgen_compare_ints);
+
+    /* The flight is simulated at rate and one fix is written per interval. */
+    int steps = interval ? interval * rate : 1;
+    double dt = 1.0 / rate;
+    igcgen_point_t position;
+    position.lat = igcgen_uniform(44.0, 46.0) * M_PI / 180.0;
+    position.lon = igcgen_uniform(5.0, 7.0) * M_PI / 180.0;
+    double alt = 1500.0;
+    double course = igcgen_uniform(0.0, 2.0 * M_PI);
+    double wind = igcgen_uniform(0.0, 2.0 * M_PI);
+    double heading = course;
+
+    /* Closed courses fly to their turnpoints in turn, sized so that the
+     * flight usually gets back to its start just before its last fix. */
+    igcgen_point_t targets[3];
+    int ntargets = 0, target = 0;
+    double length = IGCGEN_COURSE_SPEED * n * steps * dt;
+    if (kind == IGCGEN_OUT_AND_RETURN) {
+        targets[0] = igcgen_move(position, length / 2.0, course);
+        targets[1] = position;
+        ntargets = 2;
+    } else if (kind == IGCGEN_TRIANGLE) {
+        targets[0] = igcgen_move(position, length / 3.0, course);
+        targets[1] = igcgen_move(targets[0], length / 3.0, course + 2.0 * M_PI / 3.0);
+        targets[2] = position;
+        ntargets = 3;
+    }
+    int climbing = 0;
+    double remaining = igcgen_uniform(60.0, 300.0);
+    double turn = 1.0;
+
+    fprintf(file, "AXXXIGC\r\n");
+    fprintf(file, "HFDTE150708\r\n");
+    for (int i = 0, s = 0; i < n * steps; ++i) {
+        if (kind == IGCGEN_THERMAL)
+            course += igcgen_gaussian(0.002 * dt);
+        if (target < ntargets) {
+            if (target < ntargets - 1 && igcgen_distance(position, targets[target]) < IGCGEN_TURNPOINT_RADIUS)
+                ++target;
+            course = igcgen_bearing(position, targets[target]);
+        }
+        remaining -= dt;
+        if (remaining <= 0.0 && kind != IGCGEN_GLIDE) {
+            climbing = !climbing;
+            remaining = climbing ? igcgen_uniform(60.0, 240.0) : igcgen_uniform(60.0, 300.0);
+            turn = igcgen_uniform(0.0, 1.0) < 0.5 ? -1.0 : 1.0;
+        }
+        double dx, dy;
+        if (climbing) {
+            heading += turn * IGCGEN_CLIMB_SPEED / IGCGEN_CLIMB_RADIUS * dt;
+            dx = IGCGEN_CLIMB_SPEED * sin(heading) + IGCGEN_WIND_SPEED * sin(wind);
+            dy = IGCGEN_CLIMB_SPEED * cos(heading) + IGCGEN_WIND_SPEED * cos(wind);
+            alt += 2.0 * dt;
+        } else {
+            heading = course + igcgen_gaussian(0.05);
+            dx = IGCGEN_GLIDE_SPEED * sin(heading);
+            dy = IGCGEN_GLIDE_SPEED * cos(heading);
+            alt -= 1.0 * dt;
+        }
+        if (alt < 500.0)
+            alt = 500.0;
+        if (alt > 3000.0)
+            alt = 3000.0;
+        position.lat += dy * dt / IGCGEN_R;
+        position.lon += dx * dt / (IGCGEN_R * cos(position.lat));
+        if (i % steps)
+            continue;
+
+        igcgen_point_t fix = position;
+        for (; s < nspikes && spikes[s] == i / steps; ++s)
+            fix = igcgen_move(fix, igcgen_uniform(1000.0, 20000.0), igcgen_uniform(0.0, 2.0 * M_PI));
+        int seconds = IGCGEN_START_TIME + i / rate;
+        fprintf(file, "B%02d%02d%02d", seconds / 3600 % 24, seconds / 60 % 60, seconds % 60);
+        igcgen_write_angle(file, fix.lat, 2, 'N', 'S');
+        igcgen_write_angle(file, fix.lon, 3, 'E', 'W');
+        fprintf(file, "A%05d%05d\r\n", (int) alt - 20, (int) alt);
+    }
+    free(spikes);
+}
+
+    static void
+usage(void)
+{
+    printf("%s - write synthetic IGC files for benchmarking\n"
+            "Usage: %s [options]\n"
+            "Options:\n"
+            "\t-h, --help\t\tprint usage and exit\n"
+            "\t-k, --kind=KIND\t\tset kind of flight (default is thermal)\n"
+            "\t-n, --fixes=N\t\tset number of fixes (default is 3600)\n"
+            "\t-r, --rate=HZ\t\tset fixes per second, 1 to 10 (default is 1)\n"
+            "\t-i, --interval=SECONDS\twrite one fix every SECONDS seconds\n"
+            "\t-g, --spikes=N\t\tadd N GPS spikes (default is 0)\n"
+            "\t-s, --seed=SEED\t\tset random seed (default is 1)\n"
+            "\t-o, --output=FILENAME\tset output filename (default is stdout)\n"
+            "Kinds:\n"
+            "\tglide\t\tstraight glide\n"
+            "\tthermal\t\tcross country flight with thermals\n"
+            "\tout-and-return\tout and back along the same line\n"
+            "\ttriangle\tFAI triangle\n",
+            program_name, program_name);
+}
+
+    static int
+igcgen_parse_int(const char *arg, int min, int max, const char *message)
+{
+    char *endptr = 0;
+    errno = 0;
+    long value = strtol(arg, &endptr, 10);
+    if (errno || *endptr || value < min || value > max)
+        igcgen_error(message, arg);
+    return value;
+}
+
+    int
+main(int argc, char *argv[])
+{
+    program_name = strrchr(argv[0], '/');
+    program_name = program_name ? program_name + 1 : argv[0];
+
+    igcgen_kind_t kind = IGCGEN_THERMAL;
+    int n = 3600;
+    int rate = 1;
+    int interval = 0;
+    int nspikes = 0;
+    uint64_t seed = 1;
+    const char *output_filename = 0;
+
+    opterr = 0;
+    while (1) {
+        static struct option options[] = {
+            { "help",     no_argument,       0, 'h' },
+            { "kind",     required_argument, 0, 'k' },
+            { "fixes",    required_argument, 0, 'n' },
+            { "rate",     required_argument, 0, 'r' },
+            { "interval", required_argument, 0, 'i' },
+            { "spikes",   required_argument, 0, 'g' },
+            { "seed",     required_argument, 0, 's' },
+            { "output",   required_argument, 0, 'o' },
+            { 0,          0,                 0, 0 },
+        };
+        int c = getopt_long(argc, argv, ":hi:k:n:r:g:s:o:", options, 0);
+        if (c == -1)
+            break;
+        switch (c) {
+            case 'g':
+                nspikes = igcgen_parse_int(optarg, 0, 1000000, "invalid number of spikes");
+                break;
+            case 'h':
+                usage();
+                return EXIT_SUCCESS;
+            case 'i':
+                interval = igcgen_parse_int(optarg, 1, 3600, "invalid interval");
+                break;
+            case 'k':
+                if (!strcmp(optarg, "glide"))
+                    kind = IGCGEN_GLIDE;
+                else if (!strcmp(optarg, "thermal"))
+                    kind = IGCGEN_THERMAL;
+                else if (!strcmp(optarg, "out-and-return"))
+                    kind = IGCGEN_OUT_AND_RETURN;
+                else if (!strcmp(optarg, "triangle"))
+                    kind = IGCGEN_TRIANGLE;
+                else
+                    igcgen_error("invalid kind", optarg);
+                break;
+            case 'n':
+                n = igcgen_parse_int(optarg, 1, 100000000, "invalid number of fixes");
+                break;
+            case 'o':
+                output_filename = optarg;
+                break;
+            case 'r':
+                rate = igcgen_parse_int(optarg, 1, 10, "invalid rate");
+                break;
+            case 's':
+                seed = igcgen_parse_int(optarg, 0, 2147483647, "invalid seed");
+                break;
+            case ':':
+                fprintf(stderr, "%s: option '%c' requires an argument\n", program_name, optopt);
+                return EXIT_FAILURE;
+            case '?':
+                fprintf(stderr, "%s: invalid option '%c'\n", program_name, optopt);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc) {
+        fprintf(stderr, "%s: excess arguments on command line\n", program_name);
+        return EXIT_FAILURE;
+    }
+
+    igcgen_state = seed;
+    FILE *output = stdout;
+    if (output_filename && strcmp(output_filename, "-")) {
+        output = fopen(output_filename, "w");
+        if (!output) {
+            fprintf(stderr, "%s: fopen: %s: %s\n", program_name, output_filename, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+    igcgen_write(output, kind, n, rate, interval, nspikes);
+    if (output != stdout)
+        fclose(output);
+    return EXIT_SUCCESS;
+}
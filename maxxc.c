@@ -27,40 +27,7 @@
 #include <string.h>
 #include "maxxc.h"
 
-const char *program_name = 0;
-
-    void
-error(const char *message, ...)
-{
-    fprintf(stderr, "%s: ", program_name);
-    va_list ap;
-    va_start(ap, message);
-    vfprintf(stderr, message, ap);
-    va_end(ap);
-    fprintf(stderr, "\n");
-    abort();
-}
-
-    void
-die(const char *file, int line, const char *function, const char *message, int _errno)
-{
-    if (_errno)
-        error("%s:%d: %s: %s: %s", file, line, function, message, strerror(_errno));
-    else if (message)
-        error("%s:%d: %s: %s", file, line, function, message);
-    else
-        error("%s:%d: %s", file, line, function);
-}
-
-    void *
-alloc(int size)
-{
-    void *p = malloc(size);
-    if (!p)
-        DIE("malloc", errno);
-    memset(p, 0, size);
-    return p;
-}
+#define MAX_LEAGUES 8
 
     static void
 usage(void)
@@ -69,12 +36,35 @@ usage(void)
             "Usage: %s [options] [filename]\n"
             "Options:\n"
             "\t-h, --help\t\t\tprint usage and exit\n"
-            "\t-l, --league=LEAGUE\t\tset league\n"
+            "\t-l, --league=LEAGUE[,LEAGUE...]\tset league, or several leagues\n"
+            "\t\t\t\t\tto optimize for in one run\n"
             "\t-c, --complexity=N\t\tset maximum flight complexity\n"
             "\t-d, --declaration=FILENAME\tset flight declaration\n"
             "\t-o, --output=FILENAME\t\tset output filename (default is stdout)\n"
+            "\t-f, --format=FORMAT\t\tset output format, gpx, kml, json or mxr\n"
+            "\t\t\t\t\t(default is gpx)\n"
             "\t-i, --embed-igc\t\t\tembed IGC in output\n"
             "\t-t, --embed-trk\t\t\tembed GPX tracklog in output\n"
+            "\t-p, --pyramid\t\t\tsolve decimated copies of long tracks\n"
+            "\t\t\t\t\tfirst to speed up the search\n"
+            "\t-D, --deadline=SECONDS\t\tstop searching after SECONDS and output\n"
+            "\t\t\t\t\tthe best flights found so far\n"
+            "\t    --stats\t\t\twrite per-phase timings and counters to\n"
+            "\t\t\t\t\tstderr as JSON (needs a STATS=1 build)\n"
+            "\t    --verify\t\t\tcheck the flights against a brute force\n"
+            "\t\t\t\t\tsearch, for tracks of a few hundred fixes\n"
+            "\t    --igc2bin\t\t\twrite the track as a precompiled track\n"
+            "\t\t\t\t\tfile instead of optimizing it\n"
+            "\t    --cache=DIR\t\t\treuse results stored in DIR for flights\n"
+            "\t\t\t\t\tthat have been optimized before\n"
+            "\t    --cache-size=MEGABYTES\tset maximum size of the cache (default\n"
+            "\t\t\t\t\tis 256)\n"
+            "\t-b, --batch=LIST\t\toptimize every IGC file in LIST, a file of\n"
+            "\t\t\t\t\tfilenames or a directory, writing each\n"
+            "\t\t\t\t\tresult to the directory given by -o\n"
+            "\t\t\t\t\t(default is alongside the IGC file)\n"
+            "\t-S, --serve=SOCKET\t\tserve optimization requests on the Unix\n"
+            "\t\t\t\t\tdomain socket SOCKET\n"
             "Leagues:\n"
             "\tfrcfd\tCoupe F\303\251d\303\251rale de Distance (France)\n"
             "\tuknxcl\tNational Cross Country League (UK)\n"
@@ -94,16 +84,23 @@ main(int argc, char *argv[])
     program_name = strrchr(argv[0], '/');
     program_name = program_name ? program_name + 1 : argv[0];
 
-    setenv("TZ", "UTC", 1);
-    tzset();
-
     const char *league = 0;
     int complexity = -1;
     declaration_t *declaration = 0;
     const char *filename = 0;
     const char *output_filename = 0;
+    const char *format = "gpx";
     int embed_trk = 0;
     int embed_igc = 0;
+    int pyramid = 0;
+    double deadline = 0.0;
+    int stats = 0;
+    int verify = 0;
+    int igc2bin = 0;
+    const char *cache_dirname = 0;
+    long cache_size = 256;
+    const char *batch = 0;
+    const char *serve = 0;
 
     opterr = 0;
     while (1) {
@@ -113,21 +110,46 @@ main(int argc, char *argv[])
             { "complexity",  required_argument, 0, 'c' },
             { "declaration", required_argument, 0, 'd' },
             { "output",      required_argument, 0, 'o' },
+            { "format",      required_argument, 0, 'f' },
             { "embed-igc",   no_argument,       0, 'i' },
             { "embed-trk",   no_argument,       0, 't' },
+            { "pyramid",     no_argument,       0, 'p' },
+            { "deadline",    required_argument, 0, 'D' },
+            { "stats",       no_argument,       0, 's' },
+            { "verify",      no_argument,       0, 'v' },
+            { "igc2bin",     no_argument,       0, 'B' },
+            { "cache",       required_argument, 0, 'C' },
+            { "cache-size",  required_argument, 0, 'Z' },
+            { "batch",       required_argument, 0, 'b' },
+            { "serve",       required_argument, 0, 'S' },
             { 0,             0,                       0, 0 },
         };
-        int c = getopt_long(argc, argv, ":hl:c:d:o:it", options, 0);
+        int c = getopt_long(argc, argv, ":hl:c:d:o:f:itpD:b:S:", options, 0);
         if (c == -1)
             break;
         char *endptr = 0;
         switch (c) {
+            case 'B':
+                igc2bin = 1;
+                break;
+            case 'b':
+                batch = optarg;
+                break;
+            case 'C':
+                cache_dirname = optarg;
+                break;
             case 'c':
                 errno = 0;
                 complexity = strtol(optarg, &endptr, 10);
                 if (errno || *endptr)
                     error("invalid integer value '%s'", optarg);
                 break;
+            case 'D':
+                errno = 0;
+                deadline = strtod(optarg, &endptr);
+                if (errno || *endptr || deadline <= 0.0)
+                    error("invalid deadline '%s'", optarg);
+                break;
             case 'd':
                 {
                     if (declaration)
@@ -139,6 +161,11 @@ main(int argc, char *argv[])
                     fclose(file);
                 }
                 break;
+            case 'f':
+                if (!result_write_for_format(optarg))
+                    error("invalid format '%s'", optarg);
+                format = optarg;
+                break;
             case 'h':
                 usage();
                 return EXIT_SUCCESS;
@@ -151,9 +178,30 @@ main(int argc, char *argv[])
             case 'o':
                 output_filename = optarg;
                 break;
+            case 'p':
+                pyramid = 1;
+                break;
+            case 'S':
+                serve = optarg;
+                break;
+            case 's':
+#ifndef MAXXC_STATS
+                error("not built with statistics, rebuild with make STATS=1");
+#endif
+                stats = 1;
+                break;
             case 't':
                 embed_trk = 1;
                 break;
+            case 'v':
+                verify = 1;
+                break;
+            case 'Z':
+                errno = 0;
+                cache_size = strtol(optarg, &endptr, 10);
+                if (errno || *endptr || cache_size <= 0)
+                    error("invalid cache size '%s'", optarg);
+                break;
             case ':':
                 error("option '%c' requires and argument", optopt);
             case '?':
@@ -162,17 +210,79 @@ main(int argc, char *argv[])
         }
     }
 
-    result_t * (*track_optimize)(track_t *, int, const declaration_t *) = 0;
+    cache_t *cache = cache_dirname ? cache_new(cache_dirname, cache_size * 1024 * 1024) : 0;
+
+    if (serve) {
+        if (optind != argc)
+            error("excess arguments on command line");
+        serve_run(serve, cache);
+    }
+
+    if (igc2bin) {
+        const char *input_filename = 0;
+        if (optind + 1 == argc)
+            input_filename = argv[optind];
+        else if (optind != argc)
+            error("excess arguments on command line");
+        const char *basename = input_filename ? strrchr(input_filename, '/') : 0;
+        basename = basename ? basename + 1 : input_filename;
+        track_t *track = track_new();
+        if (!input_filename)
+            track_read_igc(track, 0, stdin);
+        else if (track_map_igc(track, basename, input_filename, 1) == -1)
+            error("open: %s: %s", input_filename, strerror(errno));
+        FILE *output = stdout;
+        if (output_filename && strcmp(output_filename, "-")) {
+            output = fopen(output_filename, "w");
+            if (!output)
+                error("fopen: %s: %s", output_filename, strerror(errno));
+        }
+        track_write_binary(track, output);
+        if (fclose(output))
+            DIE("fclose", errno);
+        track_delete(track);
+        return EXIT_SUCCESS;
+    }
+
     if (!league)
         error("no league specified");
-    else if (!strcmp(league, "frcfd"))
-        track_optimize = track_optimize_frcfd;
-    else if (!strcmp(league, "uknxcl"))
-        track_optimize = track_optimize_uknxcl;
-    else if (!strcmp(league, "ukxcl"))
-        track_optimize = track_optimize_ukxcl;
-    else
-        error("invalid league '%s'", league);
+    const char *names[MAX_LEAGUES];
+    track_optimize_t track_optimizes[MAX_LEAGUES];
+    track_optimize_t reference_optimizes[MAX_LEAGUES];
+    double circuit_bounds[MAX_LEAGUES];
+    int nleagues = 0, ncircuit_bounds = 0;
+    char *leagues = alloc(strlen(league) + 1);
+    strcpy(leagues, league);
+    char *saveptr = 0;
+    for (char *name = strtok_r(leagues, ",", &saveptr); name; name = strtok_r(0, ",", &saveptr)) {
+        if (nleagues == MAX_LEAGUES)
+            error("too many leagues");
+        track_optimizes[nleagues] = track_optimize_for_league(name);
+        if (!track_optimizes[nleagues])
+            error("invalid league '%s'", name);
+        reference_optimizes[nleagues] = reference_optimize_for_league(name);
+        names[nleagues] = name;
+        ++nleagues;
+        double circuit_bound = track_circuit_bound_for_league(name);
+        if (circuit_bound > 0.0)
+            circuit_bounds[ncircuit_bounds++] = circuit_bound;
+    }
+    if (!nleagues)
+        error("no league specified");
+
+    if (batch) {
+        if (optind != argc)
+            error("excess arguments on command line");
+        if (nleagues > 1)
+            error("only one league can be given in batch mode");
+        if (verify)
+            error("--verify cannot be used in batch mode");
+        int nfailures = batch_run(batch, output_filename, names[0], complexity, declaration, format, embed_igc, embed_trk, pyramid, deadline, stats, cache);
+        cache_delete(cache);
+        mem_free(leagues);
+        declaration_free(declaration);
+        return nfailures ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
 
     const char *input_filename = 0;
     if (optind == argc)
@@ -182,25 +292,51 @@ main(int argc, char *argv[])
     else
         error("excess arguments on command line");
 
-    FILE *input;
-    if (!input_filename) {
-        input = stdin;
-    } else {
-        input = fopen(input_filename, "r");
-        if (!input)
-            error("fopen: %s: %s", input_filename, strerror(errno));
-    }
     if (input_filename) {
         filename = strrchr(input_filename, '/');
         filename = filename ? filename + 1 : filename;
     } else {
         filename = 0;
     }
-    track_t *track = track_new_from_igc(filename, input);
-    if (input != stdin)
-        fclose(input);
+    track_t *track = track_new();
+    track->pyramid = pyramid;
+    if (!input_filename)
+        track_read_igc(track, filename, stdin);
+    else if (track_map_igc(track, filename, input_filename, embed_igc) == -1)
+        error("open: %s: %s", input_filename, strerror(errno));
 
-    result_t *result = track_optimize(track, complexity, declaration);
+    result_t *result = result_new();
+    track_set_deadline(track, deadline);
+    int shared = 0;
+    for (int i = 0; i < nleagues; ++i) {
+        cache_key_t key;
+        if (cache) {
+            cache_key(&key, track, names[i], complexity, declaration);
+            if (cache_lookup(cache, &key, result))
+                continue;
+        }
+        if (!shared && i < nleagues - 1) {
+            track_compute_circuit_tables(track, ncircuit_bounds, circuit_bounds);
+            shared = 1;
+        }
+        int first = result->nroutes;
+        track_optimizes[i](track, complexity, declaration, result);
+        if (cache && !track->stopped)
+            cache_store(cache, &key, result, first);
+    }
+#ifdef MAXXC_STATS
+    if (stats)
+        track_write_stats(track, stderr);
+#endif
+
+    int ndifferences = 0;
+    if (verify) {
+        result_t *expected = result_new();
+        for (int i = 0; i < nleagues; ++i)
+            reference_optimizes[i](track, complexity, declaration, expected);
+        ndifferences = reference_compare(result, expected, track, declaration, stderr);
+        result_delete(expected);
+    }
 
     FILE *output;
     if (!output_filename || !strcmp(output_filename, "-")) {
@@ -210,12 +346,16 @@ main(int argc, char *argv[])
         if (!output)
             error("fopen: %s: %s", output_filename, strerror(errno));
     }
-    result_write_gpx(result, track, embed_igc, embed_trk, output);
-    if (output != stdout)
-        fclose(output);
+    int flags = (embed_igc ? MAXXC_EMBED_IGC : 0) | (embed_trk ? MAXXC_EMBED_TRK : 0);
+    if (maxxc_result_write_file(result, track, format, flags, output) != MAXXC_OK)
+        error("%s", maxxc_error_message());
+    if (output != stdout && fclose(output))
+        DIE("fclose", errno);
 
     result_delete(result);
     track_delete(track);
+    cache_delete(cache);
+    mem_free(leagues);
 
-    return EXIT_SUCCESS;
+    return ndifferences ? EXIT_FAILURE : EXIT_SUCCESS;
 }
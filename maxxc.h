@@ -21,16 +21,42 @@
 #ifndef MAXXC_H
 #define MAXXC_H
 
+#include <math.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <time.h>
+#include "libmaxxc.h"
 
 #define R 6371.0
 
 #define DIE(syscall, _errno) die(__FILE__, __LINE__, __FUNCTION__, (syscall), (_errno))
 #define ABORT() die(__FILE__, __LINE__, __FUNCTION__, 0, -1)
 
+extern const char *program_name;
+
+/* Errors raised while an error context is pushed jump back to the setjmp on
+ * its env with the context already popped, so that the caller can return
+ * context.status.  Otherwise they print the message and exit. */
+typedef struct error_context {
+    jmp_buf env;
+    int status;
+    char message[256];
+    struct error_context *next;
+} error_context_t;
+
+void error_push(error_context_t *);
+void error_pop(error_context_t *);
+void error_raise(int, const char *) __attribute__ ((noreturn));
+void fail(int, const char *, ...) __attribute__ ((noreturn, format(printf, 2, 3)));
 void error(const char *, ...) __attribute__ ((noreturn, format(printf, 1, 2)));
 void die(const char *, int, const char *, const char *, int) __attribute__ ((noreturn));
+
+void *mem_malloc(size_t) __attribute__ ((malloc));
+void *mem_realloc(void *, size_t);
+void mem_free(void *);
+char *mem_strdup(const char *) __attribute__ ((malloc));
+void *mem_aligned_alloc(size_t) __attribute__ ((malloc));
+void mem_aligned_free(void *);
 void *alloc(int) __attribute__ ((malloc));
 
 typedef struct {
@@ -39,6 +65,16 @@ typedef struct {
     char *string;
 } string_buffer_t;
 
+typedef struct {
+    FILE *file;
+    char *buffer;
+    int length;
+    int capacity;
+    long long day;
+    char date[16];
+    int error;
+} output_t;
+
 typedef struct {
     int lat;
     int lon;
@@ -64,21 +100,24 @@ typedef struct {
     double multiplier;
     int circuit;
     int declared;
+    int provisional;
+    double upper_bound;
     int nwpts;
     int wpts_capacity;
     wpt_t *wpts;
 } route_t;
 
-typedef struct {
+typedef struct result {
     int nroutes;
     int routes_capacity;
     route_t *routes;
+    int incomplete;
 } result_t;
 
 typedef struct {
-    double cos_lat;
-    double sin_lat;
-    double lon;
+    double x;
+    double y;
+    double z;
 } coord_t;
 
 typedef struct {
@@ -87,42 +126,132 @@ typedef struct {
 } limit_t;
 
 typedef struct {
+    coord_t centre;
+    double radius;
+} cap_t;
+
+typedef struct {
+    double circuit_bound;
+    int capacity;
+    int *last_finish;
+    int *best_start;
+} circuit_table_t;
+
+#define TRACK_CIRCUIT_TABLES 4
+
+/* The tables of a track that a precompiled track file maps in place. */
+typedef struct {
+    trkpt_t *trkpts;
+    double *x;
+    double *y;
+    double *z;
+    double *sigma_delta;
+    limit_t *before;
+    limit_t *after;
+    cap_t *caps;
+} track_tables_t;
+
+typedef struct track track_t;
+
+#ifdef MAXXC_STATS
+typedef struct track_stats track_stats_t;
+#endif
+
+struct track {
     int ntrkpts;
     int trkpts_capacity;
     trkpt_t *trkpts;
     int ntask_wpts;
     int task_wpts_capacity;
     wpt_t *task_wpts;
-    coord_t *coords;
+    double *x;
+    double *y;
+    double *z;
+    int ncap_levels;
+    int cap_offsets[32];
+    int caps_capacity;
+    cap_t *caps;
     double max_delta;
     double *sigma_delta;
     limit_t *before;
     limit_t *after;
+    int tables_capacity;
+    double circuit_bound;
     int *last_finish;
     int *best_start;
+    int ncircuit_tables;
+    circuit_table_t circuit_tables[TRACK_CIRCUIT_TABLES];
     const char *filename;
+    char *filename_buffer;
+    volatile int cancelled;
+    double deadline;
+    volatile int stopped;
+    const char *igc;
     int igc_size;
+    size_t igc_mapping_size;
     int igc_capacity;
-    char *igc;
-} track_t;
+    char *igc_buffer;
+    void *binary;
+    size_t binary_mapping_size;
+    track_tables_t owned;
+    int pyramid;
+    track_t *coarse;
+    const track_t *fine;
+    double pyramid_error;
+    unsigned char *window;
+    int windowed;
+#ifdef MAXXC_STATS
+    track_stats_t *stats;
+#endif
+};
 
 typedef struct {
     coord_t coord;
     double radius;
 } turnpoint_t;
 
-typedef struct {
+typedef struct declaration {
     int nturnpoints;
     int turnpoints_capacity;
     turnpoint_t *turnpoints;
 } declaration_t;
 
+#define COORD_CHORD_A1 (1.0 / 24.0)
+#define COORD_CHORD_A2 (3.0 / 640.0)
+
+/* The angle subtended by a chord whose squared length is chord2. */
+__attribute__ ((const))
+    static inline double
+coord_chord_delta(double chord2)
+{
+    return sqrt(chord2) * (1.0 + chord2 * (COORD_CHORD_A1 + chord2 * COORD_CHORD_A2));
+}
+
+void coord_init(coord_t *, double, double);
+double coord_exact_delta(double);
+extern void (*coord_delta_row)(const coord_t *, const double *, const double *, const double *, int, double *);
+
 string_buffer_t *string_buffer_new(void);
 void string_buffer_free(string_buffer_t *);
 void string_buffer_append(string_buffer_t *, const char *, int);
 const char *string_buffer_string(const string_buffer_t *);
 void string_buffer_reset(string_buffer_t *);
 
+output_t *output_new(FILE *) __attribute__ ((malloc));
+output_t *output_new_buffer(void) __attribute__ ((malloc));
+int output_flush(output_t *);
+char *output_steal(output_t *, size_t *);
+int output_delete(output_t *);
+void output_write(output_t *, const char *, int);
+void output_puts(output_t *, const char *);
+void output_putc(output_t *, char);
+void output_printf(output_t *, const char *, ...) __attribute__ ((format(printf, 2, 3)));
+void output_int(output_t *, long long);
+void output_coord(output_t *, int);
+void output_time(output_t *, time_t);
+void output_uint(output_t *, unsigned long long, int);
+void output_double(output_t *, double);
+
 void trkpt_to_wpt(const trkpt_t *, wpt_t *);
 
 void route_delete(route_t *);
@@ -130,18 +259,61 @@ void route_push_wpt(route_t *, const wpt_t *);
 void route_push_trkpts(route_t *, const trkpt_t *, int, int *, const char **);
 
 result_t *result_new();
+void result_reset(result_t *);
 void result_delete(result_t *);
 route_t *result_push_new_route(result_t *, const char *, const char *, double, double, int, int);
-void result_write_gpx(const result_t *, const track_t *, int, int, FILE *);
+typedef void (*result_write_t)(const result_t *, const track_t *, int, int, output_t *);
+
+void result_write_gpx(const result_t *, const track_t *, int, int, output_t *);
+void result_write_kml(const result_t *, const track_t *, int, int, output_t *);
+void result_write_json(const result_t *, const track_t *, int, int, output_t *);
+void result_write_mxr(const result_t *, const track_t *, int, int, output_t *);
+result_write_t result_write_for_format(const char *);
 
 declaration_t *declaration_new_from_file(FILE *) __attribute__ ((malloc));
 void declaration_free(declaration_t *);
 
+typedef void (*track_optimize_t)(track_t *, int, const declaration_t *, result_t *);
+
+track_t *track_new(void) __attribute__ ((malloc));
 track_t *track_new_from_igc(const char *, FILE *) __attribute__ ((malloc));
-void track_compute_circuit_tables(track_t *, double);
+void track_read_igc(track_t *, const char *, FILE *);
+void track_read_igc_string(track_t *, const char *, const char *, int);
+int track_map_igc(track_t *, const char *, const char *, int);
+void track_write_binary(const track_t *, FILE *);
+void track_compute_circuit_tables(track_t *, int, const double *);
+void track_clear(track_t *);
 void track_delete(track_t *);
-result_t *track_optimize_frcfd(track_t *, int, const declaration_t *declaration);
-result_t *track_optimize_uknxcl(track_t *, int, const declaration_t *declaration);
-result_t *track_optimize_ukxcl(track_t *, int, const declaration_t *declaration);
+void track_set_deadline(track_t *, double);
+void track_optimize_frcfd(track_t *, int, const declaration_t *declaration, result_t *);
+void track_optimize_uknxcl(track_t *, int, const declaration_t *declaration, result_t *);
+void track_optimize_ukxcl(track_t *, int, const declaration_t *declaration, result_t *);
+track_optimize_t track_optimize_for_league(const char *);
+double track_circuit_bound_for_league(const char *);
+#ifdef MAXXC_STATS
+void track_write_stats(const track_t *, FILE *);
+#endif
+
+void reference_optimize_frcfd(track_t *, int, const declaration_t *declaration, result_t *);
+void reference_optimize_uknxcl(track_t *, int, const declaration_t *declaration, result_t *);
+void reference_optimize_ukxcl(track_t *, int, const declaration_t *declaration, result_t *);
+track_optimize_t reference_optimize_for_league(const char *);
+int reference_compare(const result_t *, const result_t *, const track_t *, const declaration_t *, FILE *);
+
+typedef struct cache cache_t;
+
+typedef struct {
+    char hex[33];
+} cache_key_t;
+
+cache_t *cache_new(const char *, long) __attribute__ ((malloc));
+void cache_delete(cache_t *);
+void cache_key(cache_key_t *, const track_t *, const char *, int, const declaration_t *);
+int cache_lookup(cache_t *, const cache_key_t *, result_t *);
+void cache_store(cache_t *, const cache_key_t *, const result_t *, int);
+
+int batch_run(const char *, const char *, const char *, int, const declaration_t *, const char *, int, int, int, double, int, cache_t *);
+
+void serve_run(const char *, cache_t *) __attribute__ ((noreturn));
 
 #endif
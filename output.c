@@ -0,0 +1,266 @@
+/*
+
+   maxxc - maximise cross country flights
+   Copyright (C) 2008  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include "maxxc.h"
+
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+#define OUTPUT_INITIAL_CAPACITY 65536
+#define OUTPUT_SECONDS_PER_DAY 86400
+
+    static output_t *
+output_new_with_capacity(FILE *file, int capacity)
+{
+    output_t *output = alloc(sizeof(output_t));
+    output->file = file;
+    output->capacity = capacity;
+    output->buffer = mem_malloc(capacity);
+    if (!output->buffer) {
+        mem_free(output);
+        DIE("malloc", ENOMEM);
+    }
+    output->day = -1;
+    return output;
+}
+
+    output_t *
+output_new(FILE *file)
+{
+    return output_new_with_capacity(file, OUTPUT_BUFFER_SIZE);
+}
+
+/* Returns an output that collects everything written to it in memory, to be
+ * taken with output_steal. */
+    output_t *
+output_new_buffer(void)
+{
+    return output_new_with_capacity(0, OUTPUT_INITIAL_CAPACITY);
+}
+
+/* Records the errno of the first write that failed, after which every flush
+ * fails. */
+    static void
+output_fwrite(output_t *output, const char *s, int len)
+{
+    if (fwrite(s, 1, len, output->file) != (size_t) len && !output->error)
+        output->error = errno ? errno : EIO;
+}
+
+    int
+output_flush(output_t *output)
+{
+    if (output->file && output->length) {
+        output_fwrite(output, output->buffer, output->length);
+        output->length = 0;
+    }
+    return output->error ? -1 : 0;
+}
+
+    static void
+output_grow(output_t *output, int len)
+{
+    int capacity = output->capacity;
+    while (output->length + len > capacity)
+        capacity *= 2;
+    char *buffer = mem_realloc(output->buffer, capacity);
+    if (!buffer)
+        DIE("realloc", errno);
+    output->buffer = buffer;
+    output->capacity = capacity;
+}
+
+/* Returns the contents of a memory output, followed by a NUL that is not
+ * counted in size, and leaves the output empty. */
+    char *
+output_steal(output_t *output, size_t *size)
+{
+    if (output->length == output->capacity)
+        output_grow(output, 1);
+    output->buffer[output->length] = '\0';
+    char *buffer = output->buffer;
+    *size = output->length;
+    output->buffer = 0;
+    output->length = output->capacity = 0;
+    return buffer;
+}
+
+/* Returns -1 if any write to the file failed, including the final flush. */
+    int
+output_delete(output_t *output)
+{
+    int result = 0;
+    if (output) {
+        result = output_flush(output);
+        mem_free(output->buffer);
+        mem_free(output);
+    }
+    return result;
+}
+
+    void
+output_write(output_t *output, const char *s, int len)
+{
+    if (output->length + len > output->capacity) {
+        if (!output->file) {
+            output_grow(output, len);
+        } else {
+            output_flush(output);
+            if (len > output->capacity) {
+                output_fwrite(output, s, len);
+                return;
+            }
+        }
+    }
+    memcpy(output->buffer + output->length, s, len);
+    output->length += len;
+}
+
+    void
+output_puts(output_t *output, const char *s)
+{
+    output_write(output, s, strlen(s));
+}
+
+    void
+output_putc(output_t *output, char c)
+{
+    if (output->length == output->capacity) {
+        if (output->file)
+            output_flush(output);
+        else
+            output_grow(output, 1);
+    }
+    output->buffer[output->length++] = c;
+}
+
+    void
+output_printf(output_t *output, const char *format, ...)
+{
+    char s[1024];
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(s, sizeof s, format, ap);
+    va_end(ap);
+    if (len < 0)
+        DIE("vsnprintf", errno);
+    if (len < (int) sizeof s) {
+        output_write(output, s, len);
+    } else {
+        char *t = alloc(len + 1);
+        va_start(ap, format);
+        vsnprintf(t, len + 1, format, ap);
+        va_end(ap);
+        output_write(output, t, len);
+        mem_free(t);
+    }
+}
+
+/* Writes the digits of n, which must not be negative, padded with zeros to
+ * at least width digits. */
+    static void
+output_digits(output_t *output, unsigned long long n, int width)
+{
+    char s[24];
+    int i = sizeof s;
+    do {
+        s[--i] = '0' + n % 10;
+        n /= 10;
+        --width;
+    } while (n || width > 0);
+    output_write(output, s + i, sizeof s - i);
+}
+
+    void
+output_int(output_t *output, long long n)
+{
+    if (n < 0) {
+        output_putc(output, '-');
+        output_digits(output, -(unsigned long long) n, 1);
+    } else {
+        output_digits(output, n, 1);
+    }
+}
+
+/* Writes a coordinate in thousandths of a minute as degrees with eight
+ * decimals, exactly as printf("%.8f", coord / 60000.0) would.  In units of
+ * the last decimal the value is coord * 5000 / 3, whose fractional part is
+ * never a half, so rounding the exact quotient matches printf. */
+    void
+output_coord(output_t *output, int coord)
+{
+    long long n = 5000LL * coord;
+    if (n < 0) {
+        output_putc(output, '-');
+        n = -n;
+    }
+    long long q = n / 3 + (n % 3 == 2);
+    output_digits(output, q / 100000000, 1);
+    output_putc(output, '.');
+    output_digits(output, q % 100000000, 8);
+}
+
+/* Writes an ISO 8601 UTC time.  Fixes are sorted by time, so the date is
+ * only formatted when the day changes. */
+    void
+output_time(output_t *output, time_t time)
+{
+    long long day = time / OUTPUT_SECONDS_PER_DAY;
+    long long seconds = time % OUTPUT_SECONDS_PER_DAY;
+    if (seconds < 0) {
+        --day;
+        seconds += OUTPUT_SECONDS_PER_DAY;
+    }
+    if (day != output->day) {
+        struct tm tm;
+        if (!gmtime_r(&time, &tm))
+            DIE("gmtime_r", errno);
+        if (!strftime(output->date, sizeof output->date, "%Y-%m-%dT", &tm))
+            DIE("strftime", errno);
+        output->day = day;
+    }
+    output_puts(output, output->date);
+    output_digits(output, seconds / 3600, 2);
+    output_putc(output, ':');
+    output_digits(output, seconds / 60 % 60, 2);
+    output_putc(output, ':');
+    output_digits(output, seconds % 60, 2);
+    output_putc(output, 'Z');
+}
+
+/* Writes n as a little-endian integer of size bytes. */
+    void
+output_uint(output_t *output, unsigned long long n, int size)
+{
+    char s[8];
+    for (int i = 0; i < size; ++i, n >>= 8)
+        s[i] = n & 0xff;
+    output_write(output, s, size);
+}
+
+    void
+output_double(output_t *output, double x)
+{
+    unsigned long long n;
+    memcpy(&n, &x, sizeof n);
+    output_uint(output, n, sizeof n);
+}
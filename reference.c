@@ -0,0 +1,519 @@
+/*
+
+   maxxc - maximise cross country flights
+   Copyright (C) 2008  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+   A brute force optimizer to check the real one against.  It knows nothing
+   of caps, fast forwards, pyramids or threads: it tabulates the distance
+   between every pair of fixes and tries every combination of turnpoints,
+   applying the same rules and the same series distance as track.c.  Open
+   distances are maximised leg by leg over every earlier fix, which visits
+   the same combinations without enumerating them one by one.
+
+   The tables take quadratic memory and the triangles cubic time, so it is
+   only usable on tracks of a few hundred fixes.
+
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "maxxc.h"
+
+#define REFERENCE_MAX_TRKPTS 2048
+#define REFERENCE_TOLERANCE 1e-6
+
+typedef struct {
+    const track_t *track;
+    int n;
+    double *delta;
+    int *start;
+    int *finish;
+} reference_t;
+
+    static reference_t *
+reference_new(const track_t *track)
+{
+    int n = track->ntrkpts;
+    if (n > REFERENCE_MAX_TRKPTS)
+        error("reference: too many fixes (%d, maximum is %d)", n, REFERENCE_MAX_TRKPTS);
+    reference_t *reference = alloc(sizeof(reference_t));
+    reference->track = track;
+    reference->n = n;
+    reference->delta = alloc((n ? n * n : 1) * sizeof(double));
+    reference->start = alloc((n ? n * n : 1) * sizeof(int));
+    reference->finish = alloc((n ? n * n : 1) * sizeof(int));
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < n; ++j) {
+            double dx = track->x[i] - track->x[j], dy = track->y[i] - track->y[j], dz = track->z[i] - track->z[j];
+            reference->delta[i * n + j] = coord_chord_delta(dx * dx + dy * dy + dz * dz);
+        }
+    }
+    return reference;
+}
+
+    static void
+reference_delete(reference_t *reference)
+{
+    mem_free(reference->delta);
+    mem_free(reference->start);
+    mem_free(reference->finish);
+    mem_free(reference);
+}
+
+    static inline double
+reference_delta(const reference_t *reference, int i, int j)
+{
+    return reference->delta[i * reference->n + j];
+}
+
+/* Records in start[i * n + j] and finish[i * n + j] a start at or before fix
+ * i and a finish at or after fix j that are closer than circuit_bound, or -1
+ * if there are none. */
+    static void
+reference_circuits(reference_t *reference, double circuit_bound)
+{
+    int n = reference->n;
+    for (int f = 0; f < n; ++f) {
+        int start = -1;
+        for (int i = 0; i < n; ++i) {
+            if (start == -1 && i <= f && reference_delta(reference, i, f) < circuit_bound)
+                start = i;
+            reference->start[i * n + f] = start;
+        }
+    }
+    for (int i = 0; i < n; ++i) {
+        int start = -1, finish = -1;
+        for (int j = n - 1; j >= 0; --j) {
+            if (finish == -1 && reference->start[i * n + j] != -1) {
+                start = reference->start[i * n + j];
+                finish = j;
+            }
+            reference->start[i * n + j] = start;
+            reference->finish[i * n + j] = finish;
+        }
+    }
+}
+
+/* The longest route from the first to the last fix through k turnpoints that
+ * is longer than bound. */
+    static double
+reference_open_distance(const reference_t *reference, int k, double bound, int *indexes)
+{
+    int n = reference->n;
+    for (int m = 0; m < k + 2; ++m)
+        indexes[m] = -1;
+    double *value = alloc((k + 2) * (n ? n : 1) * sizeof(double));
+    int *from = alloc((k + 2) * (n ? n : 1) * sizeof(int));
+    for (int j = 0; j < n; ++j)
+        value[j] = 0.0;
+    for (int m = 1; m < k + 2; ++m) {
+        for (int j = 0; j < n; ++j) {
+            value[m * n + j] = -INFINITY;
+            from[m * n + j] = -1;
+            for (int i = m - 1; i < j; ++i) {
+                double d = value[(m - 1) * n + i] + reference_delta(reference, i, j);
+                if (d > value[m * n + j]) {
+                    value[m * n + j] = d;
+                    from[m * n + j] = i;
+                }
+            }
+        }
+    }
+    int last = -1;
+    for (int j = 0; j < n; ++j) {
+        if (value[(k + 1) * n + j] > bound) {
+            bound = value[(k + 1) * n + j];
+            last = j;
+        }
+    }
+    if (last != -1) {
+        indexes[k + 1] = last;
+        for (int m = k + 1; m > 0; --m)
+            indexes[m - 1] = from[m * n + indexes[m]];
+    }
+    mem_free(value);
+    mem_free(from);
+    return bound;
+}
+
+    static double
+reference_out_and_return(const reference_t *reference, double bound, int *indexes)
+{
+    int n = reference->n;
+    indexes[0] = indexes[1] = indexes[2] = indexes[3] = -1;
+    for (int tp1 = 0; tp1 < n; ++tp1) {
+        for (int tp2 = tp1 + 1; tp2 < n; ++tp2) {
+            if (reference->finish[tp1 * n + tp2] == -1)
+                continue;
+            double distance = 2.0 * reference_delta(reference, tp1, tp2);
+            if (distance > bound) {
+                bound = distance;
+                indexes[0] = reference->start[tp1 * n + tp2];
+                indexes[1] = tp1;
+                indexes[2] = tp2;
+                indexes[3] = reference->finish[tp1 * n + tp2];
+            }
+        }
+    }
+    return bound;
+}
+
+/* The longest triangle longer than bound, in which no leg is shorter than 28%
+ * of the total if fai is set. */
+    static double
+reference_triangle(const reference_t *reference, int fai, double bound, int *indexes)
+{
+    int n = reference->n;
+    indexes[0] = indexes[1] = indexes[2] = indexes[3] = indexes[4] = -1;
+    for (int tp1 = 0; tp1 < n; ++tp1) {
+        for (int tp3 = tp1 + 2; tp3 < n; ++tp3) {
+            if (reference->finish[tp1 * n + tp3] == -1)
+                continue;
+            double leg3 = reference_delta(reference, tp3, tp1);
+            for (int tp2 = tp1 + 1; tp2 < tp3; ++tp2) {
+                double leg1 = reference_delta(reference, tp1, tp2);
+                double leg2 = reference_delta(reference, tp2, tp3);
+                double total = leg1 + leg2 + leg3;
+                if (!(total > bound))
+                    continue;
+                if (fai && (leg1 < 0.28 * total || leg2 < 0.28 * total || leg3 < 0.28 * total))
+                    continue;
+                bound = total;
+                indexes[0] = reference->start[tp1 * n + tp3];
+                indexes[1] = tp1;
+                indexes[2] = tp2;
+                indexes[3] = tp3;
+                indexes[4] = reference->finish[tp1 * n + tp3];
+            }
+        }
+    }
+    return bound;
+}
+
+/* The longest quadrilateral longer than bound.  Given its diagonal TP1-TP3,
+ * TP2 and TP4 can be chosen independently. */
+    static double
+reference_quadrilateral(const reference_t *reference, double bound, int *indexes)
+{
+    int n = reference->n;
+    for (int i = 0; i < 6; ++i)
+        indexes[i] = -1;
+    for (int tp1 = 0; tp1 < n; ++tp1) {
+        for (int tp3 = tp1 + 2; tp3 < n; ++tp3) {
+            double legs123 = -INFINITY;
+            int tp2 = -1;
+            for (int i = tp1 + 1; i < tp3; ++i) {
+                double legs = reference_delta(reference, tp1, i) + reference_delta(reference, i, tp3);
+                if (legs > legs123) {
+                    legs123 = legs;
+                    tp2 = i;
+                }
+            }
+            double legs341 = -INFINITY;
+            int tp4 = -1;
+            for (int i = tp3 + 1; i < n; ++i) {
+                if (reference->finish[tp1 * n + i] == -1)
+                    continue;
+                double legs = reference_delta(reference, tp3, i) + reference_delta(reference, i, tp1);
+                if (legs > legs341) {
+                    legs341 = legs;
+                    tp4 = i;
+                }
+            }
+            if (tp4 == -1 || !(legs123 + legs341 > bound))
+                continue;
+            bound = legs123 + legs341;
+            indexes[0] = reference->start[tp1 * n + tp4];
+            indexes[1] = tp1;
+            indexes[2] = tp2;
+            indexes[3] = tp3;
+            indexes[4] = tp4;
+            indexes[5] = reference->finish[tp1 * n + tp4];
+        }
+    }
+    return bound;
+}
+
+    static double
+reference_route_distance(const track_t *track, int n, const int *indexes, int circuit)
+{
+    double distance = 0.0;
+    for (int i = circuit; i < n - 1 - circuit; ++i) {
+        int a = indexes[i], b = indexes[i + 1];
+        double dx = track->x[a] - track->x[b], dy = track->y[a] - track->y[b], dz = track->z[a] - track->z[b];
+        distance += coord_exact_delta(dx * dx + dy * dy + dz * dz);
+    }
+    if (circuit) {
+        int a = indexes[n - 2], b = indexes[1];
+        double dx = track->x[a] - track->x[b], dy = track->y[a] - track->y[b], dz = track->z[a] - track->z[b];
+        distance += coord_exact_delta(dx * dx + dy * dy + dz * dz);
+    }
+    return R * distance;
+}
+
+    static void
+reference_push_route(result_t *result, const track_t *track, const char *league, const char *name, double multiplier, int circuit, int n, int *indexes, const char **names)
+{
+    if (indexes[0] == -1)
+        return;
+    route_t *route = result_push_new_route(result, league, name, reference_route_distance(track, n, indexes, circuit), multiplier, circuit, 0);
+    route_push_trkpts(route, track->trkpts, n, indexes, names);
+}
+
+    void
+reference_optimize_frcfd(track_t *track, int complexity, const declaration_t *declaration, result_t *result)
+{
+    static const char *league = "Coupe F\303\251d\303\251rale de Distance (France)";
+    static const char *names0[] = { "BD", "BA" };
+    static const char *names1[] = { "BD", "B1", "BA" };
+    static const char *names2[] = { "BD", "B1", "B2", "BA" };
+    static const char *names3[] = { "BD", "B1", "B2", "B3", "BA" };
+    static const char *names4[] = { "BD", "B1", "B2", "B3", "B4", "BA" };
+
+    reference_t *reference = reference_new(track);
+    int indexes[6];
+    double bound;
+
+    bound = reference_open_distance(reference, 0, 0.0, indexes);
+    reference_push_route(result, track, league, "distance libre sans point de contournement", 1.0, 0, 2, indexes, names0);
+    if (complexity == -1 || complexity >= 1) {
+        bound = reference_open_distance(reference, 1, bound, indexes);
+        reference_push_route(result, track, league, "distance libre avec un point de contournement", 1.0, 0, 3, indexes, names1);
+    }
+    if (complexity == -1 || complexity >= 2) {
+        bound = reference_open_distance(reference, 2, bound, indexes);
+        reference_push_route(result, track, league, "distance libre avec deux points de contournement", 1.0, 0, 4, indexes, names2);
+        reference_circuits(reference, 3.0 / R);
+        bound = reference_out_and_return(reference, 15.0 / R, indexes);
+        reference_push_route(result, track, league, "parcours en aller-retour", 1.2, 1, 4, indexes, names2);
+    }
+    if (complexity == -1 || complexity >= 3) {
+        bound = reference_triangle(reference, 1, bound, indexes);
+        reference_push_route(result, track, league, "triangle FAI", 1.4, 1, 5, indexes, names3);
+        bound = reference_triangle(reference, 0, bound, indexes);
+        reference_push_route(result, track, league, "triangle plat", 1.2, 1, 5, indexes, names3);
+    }
+    if (complexity == -1 || complexity >= 4) {
+        bound = reference_quadrilateral(reference, bound, indexes);
+        reference_push_route(result, track, league, "quadrilat\303\250re", 1.2, 1, 6, indexes, names4);
+    }
+    reference_delete(reference);
+}
+
+    void
+reference_optimize_uknxcl(track_t *track, int complexity, const declaration_t *declaration, result_t *result)
+{
+    static const char *league = "UK National XC League";
+    static const char *names0[] = { "Start", "Finish" };
+    static const char *names1[] = { "Start", "TP1", "Finish" };
+    static const char *names2[] = { "Start", "TP1", "TP2", "Finish" };
+    static const char *names3[] = { "Start", "TP1", "TP2", "TP3", "Finish" };
+
+    reference_t *reference = reference_new(track);
+    int indexes[6];
+    double bound;
+
+    bound = reference_open_distance(reference, 0, 0.0, indexes);
+    reference_push_route(result, track, league, "open distance", 1.0, 0, 2, indexes, names0);
+    if (complexity == -1 || complexity >= 1) {
+        bound = reference_open_distance(reference, 1, bound, indexes);
+        reference_push_route(result, track, league, "open distance via a turnpoint", 1.0, 0, 3, indexes, names1);
+    }
+    if (complexity == -1 || complexity >= 2) {
+        bound = reference_open_distance(reference, 2, bound, indexes);
+        reference_push_route(result, track, league, "open distance via two turnpoints", 1.0, 0, 4, indexes, names2);
+        reference_circuits(reference, 0.4 / R);
+        bound = reference_out_and_return(reference, 15.0 / R, indexes);
+        reference_push_route(result, track, league, "out and return via a turnpoint", 2.0, 1, 4, indexes, names2);
+    }
+    if (complexity == -1 || complexity >= 3) {
+        bound = reference_triangle(reference, 1, bound, indexes);
+        reference_push_route(result, track, league, "FAI triangle", 2.5, 1, 5, indexes, names3);
+        bound = reference_triangle(reference, 0, bound, indexes);
+        reference_push_route(result, track, league, "out and return via two turnpoints", 2.0, 1, 5, indexes, names3);
+    }
+    reference_delete(reference);
+}
+
+    static double
+reference_declaration_distance(const declaration_t *declaration, int begin, int end)
+{
+    double distance = 0.0;
+    for (int i = begin; i < end - 1; ++i) {
+        const coord_t *a = &declaration->turnpoints[i].coord, *b = &declaration->turnpoints[i + 1].coord;
+        double dx = a->x - b->x, dy = a->y - b->y, dz = a->z - b->z;
+        distance += coord_exact_delta(dx * dx + dy * dy + dz * dz);
+    }
+    return R * distance;
+}
+
+/* Checks every fix against each cylinder of the declaration in turn, taking
+ * the first fix inside it at or after the fix taken for the one before. */
+    static void
+reference_ukxcl_declared(const track_t *track, int complexity, const declaration_t *declaration, result_t *result, const char *league)
+{
+    static const char *names[] = { "Start", "TP1", "TP2", "TP3", "TP4", "TP5", "Goal" };
+
+    int n = declaration ? declaration->nturnpoints : 0;
+    if (n < 2 || n > (int) (sizeof names / sizeof names[0]))
+        return;
+    const turnpoint_t *start = declaration->turnpoints, *finish = declaration->turnpoints + n - 1;
+    double dx = start->coord.x - finish->coord.x, dy = start->coord.y - finish->coord.y, dz = start->coord.z - finish->coord.z;
+    int closed = 1000.0 * R * coord_chord_delta(dx * dx + dy * dy + dz * dz) <= start->radius;
+    double distance = reference_declaration_distance(declaration, 0, n);
+    const char *name;
+    double multiplier;
+    if (!closed) {
+        name = "declared goal";
+        multiplier = 1.5;
+    } else if (n == 3) {
+        name = "declared out and return";
+        multiplier = 2.0;
+    } else if (n == 4) {
+        int fai = 1;
+        for (int i = 0; i < 3; ++i)
+            if (reference_declaration_distance(declaration, i, i + 2) < 0.28 * distance)
+                fai = 0;
+        name = fai ? "declared FAI triangle" : "declared flat triangle";
+        multiplier = fai ? 2.5 : 2.0;
+    } else {
+        return;
+    }
+    if (complexity != -1 && complexity < (closed ? n - 1 : n - 2))
+        return;
+    int indexes[n];
+    for (int i = 0, j = 0; i < n; ++i) {
+        const turnpoint_t *turnpoint = declaration->turnpoints + i;
+        for (; j < track->ntrkpts; ++j) {
+            double dx = turnpoint->coord.x - track->x[j], dy = turnpoint->coord.y - track->y[j], dz = turnpoint->coord.z - track->z[j];
+            if (coord_chord_delta(dx * dx + dy * dy + dz * dz) <= turnpoint->radius / (1000.0 * R))
+                break;
+        }
+        if (j == track->ntrkpts)
+            return;
+        indexes[i] = j;
+    }
+    route_t *route = result_push_new_route(result, league, name, distance, multiplier, 0, 1);
+    route_push_trkpts(route, track->trkpts, n, indexes, names);
+}
+
+    void
+reference_optimize_ukxcl(track_t *track, int complexity, const declaration_t *declaration, result_t *result)
+{
+    static const char *league = "Cross Country League (United Kingdom)";
+    static const char *names0[] = { "Start", "Finish" };
+    static const char *names3[] = { "Start", "TP1", "TP2", "TP3", "Finish" };
+
+    reference_t *reference = reference_new(track);
+    int indexes[6];
+    double bound;
+
+    bound = reference_open_distance(reference, 0, 10.0 / R, indexes);
+    reference_push_route(result, track, league, "open distance", 1.0, 0, 2, indexes, names0);
+    reference_ukxcl_declared(track, complexity, declaration, result, league);
+    if (complexity == -1 || complexity >= 3) {
+        if (bound < 15.0 / R)
+            bound = 15.0 / R;
+        bound = reference_open_distance(reference, 3, bound, indexes);
+        reference_push_route(result, track, league, "turnpoint flight", 1.0, 0, 5, indexes, names3);
+    }
+    reference_delete(reference);
+}
+
+    track_optimize_t
+reference_optimize_for_league(const char *league)
+{
+    if (!strcmp(league, "frcfd"))
+        return reference_optimize_frcfd;
+    else if (!strcmp(league, "uknxcl"))
+        return reference_optimize_uknxcl;
+    else if (!strcmp(league, "ukxcl"))
+        return reference_optimize_ukxcl;
+    else
+        return 0;
+}
+
+/* Checks that the fixes of a declared route are fixes of the track, in order,
+ * each inside the cylinder of its turnpoint, writing the first that is not to
+ * file.  The distance is measured between the centres, so comparing it with
+ * the reference says nothing about the fixes. */
+    static int
+reference_check_declared(const route_t *route, const track_t *track, const declaration_t *declaration, FILE *file)
+{
+    if (!declaration || route->nwpts != declaration->nturnpoints) {
+        fprintf(file, "%s: %s: %s: %d fixes for %d turnpoints\n", program_name, route->league, route->name, route->nwpts, declaration ? declaration->nturnpoints : 0);
+        return 1;
+    }
+    for (int i = 0, j = 0; i < route->nwpts; ++i) {
+        const wpt_t *wpt = route->wpts + i;
+        for (; j < track->ntrkpts; ++j)
+            if (track->trkpts[j].time == wpt->time && track->trkpts[j].lat == wpt->lat && track->trkpts[j].lon == wpt->lon)
+                break;
+        if (j == track->ntrkpts) {
+            fprintf(file, "%s: %s: %s: %s is not a fix of the track after the one before\n", program_name, route->league, route->name, wpt->name);
+            return 1;
+        }
+        const turnpoint_t *turnpoint = declaration->turnpoints + i;
+        double dx = turnpoint->coord.x - track->x[j], dy = turnpoint->coord.y - track->y[j], dz = turnpoint->coord.z - track->z[j];
+        if (coord_chord_delta(dx * dx + dy * dy + dz * dz) > turnpoint->radius / (1000.0 * R)) {
+            fprintf(file, "%s: %s: %s: %s is outside its cylinder\n", program_name, route->league, route->name, wpt->name);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Compares the routes found by the optimizer with those found by the
+ * reference, writing each difference to file, and returns the number of
+ * differences.  The fixes of declared routes are checked against the
+ * declaration. */
+    int
+reference_compare(const result_t *result, const result_t *expected, const track_t *track, const declaration_t *declaration, FILE *file)
+{
+    int ndifferences = 0;
+    for (int i = 0; i < expected->nroutes; ++i) {
+        const route_t *want = expected->routes + i;
+        const route_t *got = 0;
+        for (int j = 0; j < result->nroutes && !got; ++j)
+            if (!strcmp(result->routes[j].league, want->league) && !strcmp(result->routes[j].name, want->name))
+                got = result->routes + j;
+        if (!got) {
+            fprintf(file, "%s: %s: %s: missing, reference is %.6f\n", program_name, want->league, want->name, want->distance);
+            ++ndifferences;
+        } else if (fabs(got->distance - want->distance) > REFERENCE_TOLERANCE) {
+            fprintf(file, "%s: %s: %s: %.6f, reference is %.6f\n", program_name, want->league, want->name, got->distance, want->distance);
+            ++ndifferences;
+        } else if (got->declared) {
+            ndifferences += reference_check_declared(got, track, declaration, file);
+        }
+    }
+    for (int j = 0; j < result->nroutes; ++j) {
+        const route_t *got = result->routes + j;
+        int found = 0;
+        for (int i = 0; i < expected->nroutes && !found; ++i)
+            found = !strcmp(expected->routes[i].league, got->league) && !strcmp(expected->routes[i].name, got->name);
+        if (!found) {
+            fprintf(file, "%s: %s: %s: %.6f, reference has none\n", program_name, got->league, got->name, got->distance);
+            ++ndifferences;
+        }
+    }
+    return ndifferences;
+}
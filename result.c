@@ -27,10 +27,12 @@
 route_push_wpt(route_t *route, const wpt_t *wpt)
 {
     if (route->nwpts == route->wpts_capacity) {
-        route->wpts_capacity = route->wpts_capacity ? 2 * route->wpts_capacity : 8;
-        route->wpts = realloc(route->wpts, route->wpts_capacity * sizeof(wpt_t));
-        if (!route->wpts)
+        int capacity = route->wpts_capacity ? 2 * route->wpts_capacity : 8;
+        wpt_t *wpts = mem_realloc(route->wpts, capacity * sizeof(wpt_t));
+        if (!wpts)
             DIE("realloc", errno);
+        route->wpts = wpts;
+        route->wpts_capacity = capacity;
     }
     route->wpts[route->nwpts] = *wpt;
     ++route->nwpts;
@@ -54,14 +56,22 @@ result_new(void)
     return result;
 }
 
+    void
+result_reset(result_t *result)
+{
+    for (int i = 0; i < result->nroutes; ++i)
+        mem_free(result->routes[i].wpts);
+    result->nroutes = 0;
+    result->incomplete = 0;
+}
+
     void
 result_delete(result_t *result)
 {
     if (result) {
-        for (int i = 0; i < result->nroutes; ++i)
-            free(result->routes[i].wpts);
-        free(result->routes);
-        free(result);
+        result_reset(result);
+        mem_free(result->routes);
+        mem_free(result);
     }
 }
 
@@ -69,10 +79,12 @@ result_delete(result_t *result)
 result_push_new_route(result_t *result, const char *league, const char *name, double distance, double multiplier, int circuit, int declared)
 {
     if (result->nroutes == result->routes_capacity) {
-        result->routes_capacity = result->routes_capacity ? 2 * result->routes_capacity : 8;
-        result->routes = realloc(result->routes, result->routes_capacity * sizeof(route_t));
-        if (!result->routes)
+        int capacity = result->routes_capacity ? 2 * result->routes_capacity : 8;
+        route_t *routes = mem_realloc(result->routes, capacity * sizeof(route_t));
+        if (!routes)
             DIE("realloc", errno);
+        result->routes = routes;
+        result->routes_capacity = capacity;
     }
     route_t *route = result->routes + result->nroutes++;
     memset(route, 0, sizeof(route_t));
@@ -86,92 +98,549 @@ result_push_new_route(result_t *result, const char *league, const char *name, do
 }
 
     static void
-time_write_gpx(time_t time, FILE *file, const char *prefix)
+time_write_gpx(time_t time, output_t *output, const char *prefix)
 {
     if (time != (time_t) -1) {
-        struct tm tm;
-        if (!gmtime_r(&time, &tm))
-            DIE("gmtime_r", errno);
-        char time[32];
-        if (!strftime(time, sizeof time, "%Y-%m-%dT%H:%M:%SZ", &tm))
-            DIE("strftime", errno);
-        fprintf(file, "%s<time>%s</time>\n", prefix, time);
+        output_puts(output, prefix);
+        output_puts(output, "<time>");
+        output_time(output, time);
+        output_puts(output, "</time>\n");
     }
 }
 
     static void
-wpt_write_gpx(const wpt_t *wpt, FILE *file, const char *type)
+wpt_write_gpx(const wpt_t *wpt, output_t *output, const char *type)
 {
-    fprintf(file, "\t\t<%s lat=\"%.8f\" lon=\"%.8f\">\n", type, wpt->lat / 60000.0, wpt->lon / 60000.0);
-    if (wpt->val == 'A')
-        fprintf(file, "\t\t\t<ele>%d</ele>\n", wpt->ele);
-    time_write_gpx(wpt->time, file, "\t\t\t");
+    output_printf(output, "\t\t<%s lat=\"", type);
+    output_coord(output, wpt->lat);
+    output_puts(output, "\" lon=\"");
+    output_coord(output, wpt->lon);
+    output_puts(output, "\">\n");
+    if (wpt->val == 'A') {
+        output_puts(output, "\t\t\t<ele>");
+        output_int(output, wpt->ele);
+        output_puts(output, "</ele>\n");
+    }
+    time_write_gpx(wpt->time, output, "\t\t\t");
     if (wpt->name)
-        fprintf(file, "\t\t\t<name>%s</name>\n", wpt->name);
-    fprintf(file, "\t\t</%s>\n", type);
+        output_printf(output, "\t\t\t<name>%s</name>\n", wpt->name);
+    output_printf(output, "\t\t</%s>\n", type);
 }
 
     static void
-route_write_gpx(const route_t *route, FILE *file)
+route_write_gpx(const route_t *route, output_t *output)
 {
-    fprintf(file, "\t<rte>\n");
+    output_puts(output, "\t<rte>\n");
     if (route->name)
-        fprintf(file, "\t\t<name>%s</name>\n", route->name);
-    fprintf(file, "\t\t<extensions>\n");
-    fprintf(file, "\t\t\t<league>%s</league>\n", route->league);
-    fprintf(file, "\t\t\t<distance>%.3f</distance>\n", route->distance);
-    fprintf(file, "\t\t\t<multiplier>%.1f</multiplier>\n", route->multiplier);
-    fprintf(file, "\t\t\t<score>%.2f</score>\n", route->distance * route->multiplier);
+        output_printf(output, "\t\t<name>%s</name>\n", route->name);
+    output_puts(output, "\t\t<extensions>\n");
+    output_printf(output, "\t\t\t<league>%s</league>\n", route->league);
+    output_printf(output, "\t\t\t<distance>%.3f</distance>\n", route->distance);
+    output_printf(output, "\t\t\t<multiplier>%.1f</multiplier>\n", route->multiplier);
+    output_printf(output, "\t\t\t<score>%.2f</score>\n", route->distance * route->multiplier);
     if (route->circuit)
-        fprintf(file, "\t\t\t<circuit/>\n");
+        output_puts(output, "\t\t\t<circuit/>\n");
     if (route->declared)
-        fprintf(file, "\t\t\t<declared/>\n");
-    fprintf(file, "\t\t</extensions>\n");
+        output_puts(output, "\t\t\t<declared/>\n");
+    if (route->provisional) {
+        output_puts(output, "\t\t\t<provisional/>\n");
+        output_printf(output, "\t\t\t<upper-bound>%.3f</upper-bound>\n", route->upper_bound);
+        output_printf(output, "\t\t\t<gap>%.3f</gap>\n", route->upper_bound - route->distance);
+    }
+    output_puts(output, "\t\t</extensions>\n");
     for (int i = 0; i < route->nwpts; ++i)
-        wpt_write_gpx(route->wpts + i, file, "rtept");
-    fprintf(file, "\t</rte>\n");
+        wpt_write_gpx(route->wpts + i, output, "rtept");
+    output_puts(output, "\t</rte>\n");
 }
 
     static void
-trkpt_write_gpx(const trkpt_t *trkpt, FILE *file)
+trkpt_write_gpx(const trkpt_t *trkpt, output_t *output)
 {
-    fprintf(file, "\t\t\t<trkpt lat=\"%.8f\" lon=\"%.8f\">\n", trkpt->lat / 60000.0, trkpt->lon / 60000.0);
-    if (trkpt->val == 'A')
-        fprintf(file, "\t\t\t\t<ele>%d</ele>\n", trkpt->ele);
-    time_write_gpx(trkpt->time, file, "\t\t\t\t");
-    fprintf(file, "\t\t\t</trkpt>\n");
+    output_puts(output, "\t\t\t<trkpt lat=\"");
+    output_coord(output, trkpt->lat);
+    output_puts(output, "\" lon=\"");
+    output_coord(output, trkpt->lon);
+    output_puts(output, "\">\n");
+    if (trkpt->val == 'A') {
+        output_puts(output, "\t\t\t\t<ele>");
+        output_int(output, trkpt->ele);
+        output_puts(output, "</ele>\n");
+    }
+    time_write_gpx(trkpt->time, output, "\t\t\t\t");
+    output_puts(output, "\t\t\t</trkpt>\n");
 }
 
     static void
-track_write_gpx(const track_t *track, FILE *file)
+track_write_gpx(const track_t *track, output_t *output)
 {
-    fprintf(file, "\t<trk>\n");
-    fprintf(file, "\t\t<trkseg>\n");
+    output_puts(output, "\t<trk>\n");
+    output_puts(output, "\t\t<trkseg>\n");
     for (int i = 0; i < track->ntrkpts; ++i)
-        trkpt_write_gpx(track->trkpts + i, file);
-    fprintf(file, "\t\t</trkseg>\n");
-    fprintf(file, "\t</trk>\n");
+        trkpt_write_gpx(track->trkpts + i, output);
+    output_puts(output, "\t\t</trkseg>\n");
+    output_puts(output, "\t</trk>\n");
 }
 
     void
-result_write_gpx(const result_t *result, const track_t *track, int embed_igc, int embed_trk, FILE *file)
+result_write_gpx(const result_t *result, const track_t *track, int embed_igc, int embed_trk, output_t *output)
 {
-    fprintf(file, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
-    fprintf(file, "<gpx creator=\"http://code.google.com/p/maxxc/\" version=\"1.1\" xmlns=\"http://www.topografix.com/GPX/1/1\" xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" xsi:schemaLocation=\"http://www.topografix.com/GPX/1/1 http://www.topografix.com/GPX/1/1/gpx.xsd\">\n");
-    fprintf(file, "\t<metadata>\n");
-    fprintf(file, "\t\t<extensions>\n");
+    output_puts(output, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    output_puts(output, "<gpx creator=\"http://code.google.com/p/maxxc/\" version=\"1.1\" xmlns=\"http://www.topografix.com/GPX/1/1\" xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" xsi:schemaLocation=\"http://www.topografix.com/GPX/1/1 http://www.topografix.com/GPX/1/1/gpx.xsd\">\n");
+    output_puts(output, "\t<metadata>\n");
+    output_puts(output, "\t\t<extensions>\n");
     if (track->filename)
-        fprintf(file, "\t\t\t<filename>%s</filename>\n", track->filename);
+        output_printf(output, "\t\t\t<filename>%s</filename>\n", track->filename);
+    if (result->incomplete)
+        output_puts(output, "\t\t\t<incomplete/>\n");
     if (embed_igc) {
-        fprintf(file, "\t\t\t<igc><![CDATA[");
-        fwrite(track->igc, track->igc_size, sizeof(char), file);
-        fprintf(file, "]]></igc>\n");
+        output_puts(output, "\t\t\t<igc><![CDATA[");
+        output_write(output, track->igc, track->igc_size);
+        output_puts(output, "]]></igc>\n");
     }
-    fprintf(file, "\t\t</extensions>\n");
-    fprintf(file, "\t</metadata>\n");
+    output_puts(output, "\t\t</extensions>\n");
+    output_puts(output, "\t</metadata>\n");
     for (int i = 0; i < result->nroutes; ++i)
-        route_write_gpx(result->routes + i, file);
+        route_write_gpx(result->routes + i, output);
     if (embed_trk)
-        track_write_gpx(track, file);
-    fprintf(file, "</gpx>\n");
+        track_write_gpx(track, output);
+    output_puts(output, "</gpx>\n");
+}
+
+#define KML_ARROW_LENGTH 0.2
+#define KML_ARROW_ANGLE (M_PI / 12.0)
+
+typedef struct {
+    double lat;
+    double lon;
+} kml_coord_t;
+
+    static kml_coord_t
+kml_coord_from_wpt(const wpt_t *wpt)
+{
+    kml_coord_t coord = { M_PI * wpt->lat / (180.0 * 60000.0), M_PI * wpt->lon / (180.0 * 60000.0) };
+    return coord;
+}
+
+    static double
+kml_coord_distance(kml_coord_t c1, kml_coord_t c2)
+{
+    double x = sin(c1.lat) * sin(c2.lat) + cos(c1.lat) * cos(c2.lat) * cos(c1.lon - c2.lon);
+    return x < 1.0 ? R * acos(x) : 0.0;
+}
+
+    static double
+kml_coord_bearing(kml_coord_t c1, kml_coord_t c2)
+{
+    return atan2(sin(c2.lon - c1.lon) * cos(c2.lat), cos(c1.lat) * sin(c2.lat) - sin(c1.lat) * cos(c2.lat) * cos(c2.lon - c1.lon));
+}
+
+    static kml_coord_t
+kml_coord_at(kml_coord_t c, double bearing, double distance)
+{
+    double d = distance / R;
+    kml_coord_t result;
+    result.lat = asin(sin(c.lat) * cos(d) + cos(c.lat) * sin(d) * cos(bearing));
+    result.lon = c.lon + atan2(sin(bearing) * sin(d) * cos(c.lat), cos(d) - sin(c.lat) * sin(result.lat));
+    return result;
+}
+
+    static kml_coord_t
+kml_coord_halfway(kml_coord_t c1, kml_coord_t c2)
+{
+    double bx = cos(c2.lat) * cos(c2.lon - c1.lon);
+    double by = cos(c2.lat) * sin(c2.lon - c1.lon);
+    kml_coord_t result;
+    result.lat = atan2(sin(c1.lat) + sin(c2.lat), sqrt((cos(c1.lat) + bx) * (cos(c1.lat) + bx) + by * by));
+    result.lon = c1.lon + atan2(by, cos(c1.lat) + bx);
+    return result;
+}
+
+    static void
+kml_coord_write(kml_coord_t c, output_t *output)
+{
+    output_printf(output, "%.8f,%.8f,0", 180.0 * c.lon / M_PI, 180.0 * c.lat / M_PI);
+}
+
+/* Writes a line from c1 to c2 with an arrowhead at c2. */
+    static void
+kml_arrow_write(kml_coord_t c1, kml_coord_t c2, output_t *output)
+{
+    output_puts(output, "\t\t\t\t\t\t<LineString><altitudeMode>clampToGround</altitudeMode><tessellate>1</tessellate><coordinates>");
+    kml_coord_write(c1, output);
+    output_putc(output, ' ');
+    kml_coord_write(c2, output);
+    output_puts(output, "</coordinates></LineString>\n");
+    double bearing = kml_coord_bearing(c2, c1);
+    output_puts(output, "\t\t\t\t\t\t<LineString><altitudeMode>clampToGround</altitudeMode><tessellate>1</tessellate><coordinates>");
+    kml_coord_write(kml_coord_at(c2, bearing - KML_ARROW_ANGLE, KML_ARROW_LENGTH), output);
+    output_putc(output, ' ');
+    kml_coord_write(c2, output);
+    output_putc(output, ' ');
+    kml_coord_write(kml_coord_at(c2, bearing + KML_ARROW_ANGLE, KML_ARROW_LENGTH), output);
+    output_puts(output, "</coordinates></LineString>\n");
+}
+
+    static void
+kml_leg_write_row(const wpt_t *wpt1, const wpt_t *wpt2, double total, output_t *output)
+{
+    double distance = kml_coord_distance(kml_coord_from_wpt(wpt1), kml_coord_from_wpt(wpt2));
+    output_printf(output, "<tr><td>%s \342\206\222 %s</td><td>%.3fkm", wpt1->name, wpt2->name, distance);
+    if (total > 0.0)
+        output_printf(output, " (%.1f%%)", 100.0 * distance / total);
+    output_puts(output, "</td></tr>");
+}
+
+    static void
+route_write_kml(const route_t *route, int visibility, output_t *output)
+{
+    const wpt_t *wpts = route->wpts;
+    int n = route->nwpts;
+    int circuit = route->circuit && n >= 4;
+    output_puts(output, "\t\t\t<Folder>\n");
+    output_printf(output, "\t\t\t\t<visibility>%d</visibility>\n", visibility);
+    output_printf(output, "\t\t\t\t<name>%s (%.2f points, %.3fkm)</name>\n", route->name ? route->name : "", route->distance * route->multiplier, route->distance);
+    output_puts(output, "\t\t\t\t<Snippet/>\n");
+    output_puts(output, "\t\t\t\t<Style><ListStyle><listItemType>checkHideChildren</listItemType></ListStyle></Style>\n");
+    output_puts(output, "\t\t\t\t<description><![CDATA[<table>");
+    if (circuit) {
+        for (int i = 1; i < n - 2; ++i)
+            kml_leg_write_row(wpts + i, wpts + i + 1, route->distance, output);
+        kml_leg_write_row(wpts + n - 2, wpts + 1, route->distance, output);
+        kml_leg_write_row(wpts + n - 1, wpts, 0.0, output);
+    } else {
+        for (int i = 0; i < n - 1; ++i)
+            kml_leg_write_row(wpts + i, wpts + i + 1, 0.0, output);
+    }
+    output_printf(output, "<tr><td>Distance</td><td>%.3fkm</td></tr>", route->distance);
+    output_printf(output, "<tr><td>Multiplier</td><td>\303\227 %.1f/km</td></tr>", route->multiplier);
+    output_printf(output, "<tr><td>Score</td><td><b>%.2f</b></td></tr>", route->distance * route->multiplier);
+    if (route->provisional)
+        output_printf(output, "<tr><td>Upper bound</td><td>%.3fkm</td></tr>", route->upper_bound);
+    output_puts(output, "</table>]]></description>\n");
+    for (int i = 0; i < n; ++i) {
+        output_printf(output, "\t\t\t\t<Placemark><name>%s</name><styleUrl>#rte</styleUrl><Point><coordinates>", wpts[i].name ? wpts[i].name : "");
+        kml_coord_write(kml_coord_from_wpt(wpts + i), output);
+        output_puts(output, "</coordinates></Point></Placemark>\n");
+    }
+    int first = circuit ? 1 : 0, last = circuit ? n - 2 : n - 1;
+    for (int i = first; i < last + circuit; ++i) {
+        kml_coord_t c1 = kml_coord_from_wpt(wpts + i);
+        kml_coord_t c2 = kml_coord_from_wpt(wpts + (i == last ? first : i + 1));
+        output_puts(output, "\t\t\t\t<Placemark>\n");
+        output_printf(output, "\t\t\t\t\t<name>%.2fkm</name>\n", kml_coord_distance(c1, c2));
+        output_puts(output, "\t\t\t\t\t<styleUrl>#rte</styleUrl>\n");
+        output_puts(output, "\t\t\t\t\t<MultiGeometry>\n");
+        output_puts(output, "\t\t\t\t\t\t<Point><coordinates>");
+        kml_coord_write(kml_coord_halfway(c1, c2), output);
+        output_puts(output, "</coordinates></Point>\n");
+        kml_arrow_write(c1, c2, output);
+        output_puts(output, "\t\t\t\t\t</MultiGeometry>\n");
+        output_puts(output, "\t\t\t\t</Placemark>\n");
+    }
+    if (circuit) {
+        for (int i = 0; i < 2; ++i) {
+            output_puts(output, "\t\t\t\t<Placemark>\n");
+            output_puts(output, "\t\t\t\t\t<styleUrl>#rte2</styleUrl>\n");
+            output_puts(output, "\t\t\t\t\t<MultiGeometry>\n");
+            kml_arrow_write(kml_coord_from_wpt(wpts + (i ? n - 2 : 0)), kml_coord_from_wpt(wpts + (i ? n - 1 : 1)), output);
+            output_puts(output, "\t\t\t\t\t</MultiGeometry>\n");
+            output_puts(output, "\t\t\t\t</Placemark>\n");
+        }
+    }
+    output_puts(output, "\t\t\t</Folder>\n");
+}
+
+    static void
+track_write_kml_coordinates(const track_t *track, output_t *output)
+{
+    for (int i = 0; i < track->ntrkpts; ++i) {
+        const trkpt_t *trkpt = track->trkpts + i;
+        if (i)
+            output_putc(output, ' ');
+        output_coord(output, trkpt->lon);
+        output_putc(output, ',');
+        output_coord(output, trkpt->lat);
+        output_putc(output, ',');
+        output_int(output, trkpt->val == 'A' ? trkpt->ele : 0);
+    }
+}
+
+    static void
+track_write_kml_line(const track_t *track, const char *style, const char *altitude_mode, output_t *output)
+{
+    output_printf(output, "<styleUrl>#%s</styleUrl><LineString><altitudeMode>%s</altitudeMode><coordinates>", style, altitude_mode);
+    track_write_kml_coordinates(track, output);
+    output_puts(output, "</coordinates></LineString></Placemark>\n");
+}
+
+    static void
+track_write_kml(const track_t *track, output_t *output)
+{
+    output_puts(output, "\t\t<Folder>\n");
+    output_puts(output, "\t\t\t<name>Track</name>\n");
+    output_puts(output, "\t\t\t<open>1</open>\n");
+    output_puts(output, "\t\t\t<Style><ListStyle><listItemType>radioFolder</listItemType></ListStyle></Style>\n");
+    output_puts(output, "\t\t\t<Placemark><name>2D</name><visibility>0</visibility>");
+    track_write_kml_line(track, "track", "clampToGround", output);
+    output_puts(output, "\t\t\t<Folder>\n");
+    output_puts(output, "\t\t\t\t<name>3D</name>\n");
+    output_puts(output, "\t\t\t\t<Style><ListStyle><listItemType>checkHideChildren</listItemType></ListStyle></Style>\n");
+    output_puts(output, "\t\t\t\t<Placemark>");
+    track_write_kml_line(track, "track", "absolute", output);
+    output_puts(output, "\t\t\t\t<Placemark>");
+    track_write_kml_line(track, "shadow", "clampToGround", output);
+    output_puts(output, "\t\t\t</Folder>\n");
+    output_puts(output, "\t\t</Folder>\n");
+}
+
+/* Writes the same document as maxxc-gpx2kml did from the GPX output, with
+ * the routes in decreasing order of score and only the best one visible. */
+    void
+result_write_kml(const result_t *result, const track_t *track, int embed_igc, int embed_trk, output_t *output)
+{
+    static const char *styles[] = { "rte", "ff00ffff", "rte2", "8000ffff" };
+    output_puts(output, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    output_puts(output, "<kml xmlns=\"http://earth.google.com/kml/2.1\">\n");
+    output_puts(output, "<Document>\n");
+    output_puts(output, "\t<Style id=\"track\"><LineStyle><color>ffff00ff</color><width>2</width></LineStyle></Style>\n");
+    output_puts(output, "\t<Style id=\"shadow\"><LineStyle><color>ff000000</color></LineStyle></Style>\n");
+    for (int i = 0; i < 4; i += 2)
+        output_printf(output, "\t<Style id=\"%s\"><IconStyle><color>%s</color><scale>0.5</scale><Icon><href>http://maps.google.com/mapfiles/kml/pal4/icon24.png</href></Icon></IconStyle><LabelStyle><color>%s</color></LabelStyle><LineStyle><color>%s</color></LineStyle></Style>\n", styles[i], styles[i + 1], styles[i + 1], styles[i + 1]);
+    output_puts(output, "\t<Folder>\n");
+    output_printf(output, "\t\t<name>%s</name>\n", track->filename ? track->filename : "(stdin)");
+    output_puts(output, "\t\t<open>1</open>\n");
+    output_puts(output, "\t\t<Folder>\n");
+    output_puts(output, "\t\t\t<name>Routes</name>\n");
+    output_puts(output, "\t\t\t<open>1</open>\n");
+    output_puts(output, "\t\t\t<Style><ListStyle><listItemType>radioFolder</listItemType></ListStyle></Style>\n");
+    int *order = alloc((result->nroutes + 1) * sizeof(int));
+    for (int i = 0; i < result->nroutes; ++i) {
+        double score = result->routes[i].distance * result->routes[i].multiplier;
+        int j = i;
+        for (; j > 0 && result->routes[order[j - 1]].distance * result->routes[order[j - 1]].multiplier < score; --j)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+    for (int i = 0; i < result->nroutes; ++i)
+        route_write_kml(result->routes + order[i], i == 0, output);
+    mem_free(order);
+    output_puts(output, "\t\t</Folder>\n");
+    if (embed_trk)
+        track_write_kml(track, output);
+    output_puts(output, "\t</Folder>\n");
+    output_puts(output, "</Document>\n");
+    output_puts(output, "</kml>\n");
+}
+
+    static void
+json_write_string(const char *s, int len, output_t *output)
+{
+    output_putc(output, '"');
+    for (int i = 0; i < len; ++i) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            output_putc(output, '\\');
+            output_putc(output, c);
+        } else if (c == '\n') {
+            output_puts(output, "\\n");
+        } else if (c == '\r') {
+            output_puts(output, "\\r");
+        } else if (c == '\t') {
+            output_puts(output, "\\t");
+        } else if (c < 0x20) {
+            output_printf(output, "\\u%04x", c);
+        } else {
+            output_putc(output, c);
+        }
+    }
+    output_putc(output, '"');
+}
+
+    static void
+json_write_point(int lat, int lon, int val, int ele, time_t time, output_t *output)
+{
+    output_puts(output, "{\"lat\": ");
+    output_coord(output, lat);
+    output_puts(output, ", \"lon\": ");
+    output_coord(output, lon);
+    if (val == 'A') {
+        output_puts(output, ", \"ele\": ");
+        output_int(output, ele);
+    }
+    if (time != (time_t) -1) {
+        output_puts(output, ", \"time\": \"");
+        output_time(output, time);
+        output_putc(output, '"');
+    }
+}
+
+    static void
+route_write_json(const route_t *route, output_t *output)
+{
+    output_puts(output, "{\"name\": ");
+    json_write_string(route->name ? route->name : "", route->name ? strlen(route->name) : 0, output);
+    output_puts(output, ", \"league\": ");
+    json_write_string(route->league, strlen(route->league), output);
+    output_printf(output, ", \"distance\": %.3f, \"multiplier\": %.1f, \"score\": %.2f", route->distance, route->multiplier, route->distance * route->multiplier);
+    output_printf(output, ", \"circuit\": %s, \"declared\": %s", route->circuit ? "true" : "false", route->declared ? "true" : "false");
+    if (route->provisional)
+        output_printf(output, ", \"provisional\": true, \"upper_bound\": %.3f, \"gap\": %.3f", route->upper_bound, route->upper_bound - route->distance);
+    output_puts(output, ", \"rtepts\": [");
+    for (int i = 0; i < route->nwpts; ++i) {
+        const wpt_t *wpt = route->wpts + i;
+        if (i)
+            output_puts(output, ", ");
+        json_write_point(wpt->lat, wpt->lon, wpt->val, wpt->ele, wpt->time, output);
+        if (wpt->name) {
+            output_puts(output, ", \"name\": ");
+            json_write_string(wpt->name, strlen(wpt->name), output);
+        }
+        output_putc(output, '}');
+    }
+    output_puts(output, "]}");
+}
+
+/* Writes one JSON object with the filename, whether the result is incomplete,
+ * the routes in the same order and with the same precision as the GPX output,
+ * and the "igc" string and "trk" array of fixes when they are embedded. */
+    void
+result_write_json(const result_t *result, const track_t *track, int embed_igc, int embed_trk, output_t *output)
+{
+    output_putc(output, '{');
+    if (track->filename) {
+        output_puts(output, "\"filename\": ");
+        json_write_string(track->filename, strlen(track->filename), output);
+        output_puts(output, ",\n");
+    }
+    if (result->incomplete)
+        output_puts(output, "\"incomplete\": true,\n");
+    output_puts(output, "\"routes\": [");
+    for (int i = 0; i < result->nroutes; ++i) {
+        output_puts(output, i ? ",\n\t" : "\n\t");
+        route_write_json(result->routes + i, output);
+    }
+    output_puts(output, "]");
+    if (embed_trk) {
+        output_puts(output, ",\n\"trk\": [");
+        for (int i = 0; i < track->ntrkpts; ++i) {
+            const trkpt_t *trkpt = track->trkpts + i;
+            output_puts(output, i ? ",\n\t" : "\n\t");
+            json_write_point(trkpt->lat, trkpt->lon, trkpt->val, trkpt->ele, trkpt->time, output);
+            output_putc(output, '}');
+        }
+        output_puts(output, "]");
+    }
+    if (embed_igc) {
+        output_puts(output, ",\n\"igc\": ");
+        json_write_string(track->igc, track->igc_size, output);
+    }
+    output_puts(output, "}\n");
+}
+
+#define MXR_MAGIC "MAXXCRES"
+#define MXR_VERSION 1
+#define MXR_TRK 1
+#define MXR_IGC 2
+#define MXR_INCOMPLETE 4
+#define MXR_CIRCUIT 1
+#define MXR_DECLARED 2
+#define MXR_PROVISIONAL 4
+#define MXR_NO_ELE (-2147483647 - 1)
+
+    static void
+mxr_write_string(const char *s, int len, output_t *output)
+{
+    output_uint(output, len, 4);
+    output_write(output, s, len);
+}
+
+    static void
+mxr_write_point(int lat, int lon, int val, int ele, time_t time, output_t *output)
+{
+    output_uint(output, lat, 4);
+    output_uint(output, lon, 4);
+    output_uint(output, val == 'A' ? ele : MXR_NO_ELE, 4);
+    output_uint(output, time, 8);
+}
+
+/* Writes the compact binary result format.  All integers are little-endian
+ * and strings are a u32 length followed by that many bytes:
+
+	char magic[8]		"MAXXCRES"
+	u32 version		1
+	u32 flags		1 if the track follows, 2 if the IGC file follows,
+				4 if the result is incomplete
+	string filename		empty if unknown
+	u32 nroutes
+	route routes[nroutes]
+	u32 ntrkpts		if flags & 1
+	point trkpts[ntrkpts]	if flags & 1
+	string igc		if flags & 2
+
+   where a route is
+
+	string league
+	string name
+	u32 flags		1 circuit, 2 declared, 4 provisional
+	f64 distance		in km
+	f64 multiplier
+	f64 upper_bound		in km, only meaningful if provisional
+	u32 nrtepts
+	rtept rtepts[nrtepts]
+
+   and an rtept is a point followed by its name as a string.  A point is
+
+	i32 lat			in thousandths of a minute
+	i32 lon			in thousandths of a minute
+	i32 ele			in metres, or INT32_MIN if not known
+	i64 time		seconds since the epoch, or -1 if not known
+
+*/
+    void
+result_write_mxr(const result_t *result, const track_t *track, int embed_igc, int embed_trk, output_t *output)
+{
+    output_write(output, MXR_MAGIC, 8);
+    output_uint(output, MXR_VERSION, 4);
+    output_uint(output, (embed_trk ? MXR_TRK : 0) | (embed_igc ? MXR_IGC : 0) | (result->incomplete ? MXR_INCOMPLETE : 0), 4);
+    mxr_write_string(track->filename ? track->filename : "", track->filename ? strlen(track->filename) : 0, output);
+    output_uint(output, result->nroutes, 4);
+    for (int i = 0; i < result->nroutes; ++i) {
+        const route_t *route = result->routes + i;
+        mxr_write_string(route->league, strlen(route->league), output);
+        mxr_write_string(route->name ? route->name : "", route->name ? strlen(route->name) : 0, output);
+        output_uint(output, (route->circuit ? MXR_CIRCUIT : 0) | (route->declared ? MXR_DECLARED : 0) | (route->provisional ? MXR_PROVISIONAL : 0), 4);
+        output_double(output, route->distance);
+        output_double(output, route->multiplier);
+        output_double(output, route->provisional ? route->upper_bound : 0.0);
+        output_uint(output, route->nwpts, 4);
+        for (int j = 0; j < route->nwpts; ++j) {
+            const wpt_t *wpt = route->wpts + j;
+            mxr_write_point(wpt->lat, wpt->lon, wpt->val, wpt->ele, wpt->time, output);
+            mxr_write_string(wpt->name ? wpt->name : "", wpt->name ? strlen(wpt->name) : 0, output);
+        }
+    }
+    if (embed_trk) {
+        output_uint(output, track->ntrkpts, 4);
+        for (int i = 0; i < track->ntrkpts; ++i) {
+            const trkpt_t *trkpt = track->trkpts + i;
+            mxr_write_point(trkpt->lat, trkpt->lon, trkpt->val, trkpt->ele, trkpt->time, output);
+        }
+    }
+    if (embed_igc)
+        mxr_write_string(track->igc, track->igc_size, output);
+}
+
+    result_write_t
+result_write_for_format(const char *format)
+{
+    if (!strcmp(format, "gpx"))
+        return result_write_gpx;
+    else if (!strcmp(format, "kml"))
+        return result_write_kml;
+    else if (!strcmp(format, "json"))
+        return result_write_json;
+    else if (!strcmp(format, "mxr"))
+        return result_write_mxr;
+    else
+        return 0;
 }
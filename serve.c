@@ -0,0 +1,434 @@
+/*
+
+   maxxc - maximise cross country flights
+   Copyright (C) 2008  Tom Payne
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+   Protocol
+
+   A client connects to the socket and sends a header of "key value" lines
+   terminated by an empty line, followed by the declaration (if any) and the
+   IGC file:
+
+	league frcfd
+	complexity 3
+	format json
+	embed-igc
+	embed-trk
+	pyramid
+	deadline 2.5
+	declaration 1234
+	igc 56789
+
+   The declaration and igc values are the sizes in bytes of the data that
+   follow the header, in that order.  The deadline, in seconds, bounds the
+   time spent optimizing; flights found when it expires are marked
+   provisional.  Only league and igc are required.  The server replies with
+   the result in the given format, GPX by default, or a single "error: ..."
+   line, and closes the connection.
+
+   A request is cancelled if the client closes its connection or sends
+   "cancel" while waiting for the result.  Shutting down only the writing
+   side of the connection does not cancel the request.
+
+*/
+
+#include <errno.h>
+#include <omp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "maxxc.h"
+
+#define SERVE_QUEUE_CAPACITY 64
+#define SERVE_MAX_REQUEST_SIZE (64 * 1024 * 1024)
+#define SERVE_TIMEOUT 30
+#define SERVE_ACCEPT_BACKOFF 100000
+
+typedef struct serve serve_t;
+
+typedef struct {
+    pthread_t thread;
+    serve_t *serve;
+    track_t *track;
+    result_t *result;
+    string_buffer_t *buffer;
+    int fd;
+    int generation;
+    int watched;
+    int eof;
+} worker_t;
+
+struct serve {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    cache_t *cache;
+    int queue[SERVE_QUEUE_CAPACITY];
+    int queue_head;
+    int queue_size;
+    int nworkers;
+    worker_t *workers;
+};
+
+typedef struct {
+    const char *league;
+    track_optimize_t track_optimize;
+    int complexity;
+    const char *format;
+    int embed_igc;
+    int embed_trk;
+    int pyramid;
+    double deadline;
+    int declaration_size;
+    int igc_size;
+} request_t;
+
+    static void
+serve_reply_error(int fd, const char *message)
+{
+    char line[256];
+    int len = snprintf(line, sizeof line, "error: %s\n", message);
+    if (len > (int) sizeof line - 1)
+        len = sizeof line - 1;
+    if (write(fd, line, len) != len)
+        return;
+}
+
+    static const char *
+serve_parse_header(char *header, request_t *request)
+{
+    memset(request, 0, sizeof *request);
+    request->complexity = -1;
+    request->format = "gpx";
+    request->igc_size = -1;
+    char *saveptr = 0;
+    for (char *line = strtok_r(header, "\n", &saveptr); line; line = strtok_r(0, "\n", &saveptr)) {
+        char *value = strchr(line, ' ');
+        if (value)
+            *value++ = '\0';
+        int *size = 0;
+        if (!strcmp(line, "league")) {
+            if (!value || !(request->track_optimize = track_optimize_for_league(value)))
+                return "invalid league";
+            request->league = value;
+        } else if (!strcmp(line, "complexity")) {
+            char *endptr = 0;
+            errno = 0;
+            request->complexity = value ? strtol(value, &endptr, 10) : 0;
+            if (!value || errno || *endptr)
+                return "invalid complexity";
+        } else if (!strcmp(line, "format")) {
+            if (!value || !result_write_for_format(value))
+                return "invalid format";
+            request->format = value;
+        } else if (!strcmp(line, "embed-igc")) {
+            request->embed_igc = 1;
+        } else if (!strcmp(line, "embed-trk")) {
+            request->embed_trk = 1;
+        } else if (!strcmp(line, "pyramid")) {
+            request->pyramid = 1;
+        } else if (!strcmp(line, "deadline")) {
+            char *endptr = 0;
+            errno = 0;
+            request->deadline = value ? strtod(value, &endptr) : 0.0;
+            if (!value || errno || *endptr || request->deadline <= 0.0)
+                return "invalid deadline";
+        } else if (!strcmp(line, "declaration")) {
+            size = &request->declaration_size;
+        } else if (!strcmp(line, "igc")) {
+            size = &request->igc_size;
+        } else {
+            return "invalid header";
+        }
+        if (size) {
+            char *endptr = 0;
+            errno = 0;
+            long n = value ? strtol(value, &endptr, 10) : -1;
+            if (!value || errno || *endptr || n < 0 || n > SERVE_MAX_REQUEST_SIZE)
+                return "invalid size";
+            *size = n;
+        }
+    }
+    if (!request->track_optimize)
+        return "no league specified";
+    if (request->igc_size < 0)
+        return "no igc specified";
+    return 0;
+}
+
+/* Reads a complete request into worker->buffer, returning the offset of the
+ * first payload byte or -1 if the connection failed.  Any bytes received
+ * after the payload can only be a cancellation. */
+    static int
+serve_read_request(worker_t *worker, request_t *request, const char **message)
+{
+    string_buffer_t *buffer = worker->buffer;
+    string_buffer_reset(buffer);
+    worker->track->cancelled = 0;
+    int header_size = -1, size = -1;
+    char chunk[65536];
+    while (size < 0 || buffer->length < size) {
+        ssize_t n = read(worker->fd, chunk, sizeof chunk);
+        if (n <= 0)
+            return -1;
+        string_buffer_append(buffer, chunk, n);
+        if (header_size < 0) {
+            char *end = strstr(buffer->string, "\n\n");
+            if (!end) {
+                if (buffer->length > 4096) {
+                    *message = "invalid header";
+                    return -1;
+                }
+                continue;
+            }
+            *end = '\0';
+            header_size = end - buffer->string + 2;
+            if ((*message = serve_parse_header(buffer->string, request)))
+                return -1;
+            size = header_size + request->declaration_size + request->igc_size;
+        }
+    }
+    if (buffer->length > size)
+        worker->track->cancelled = 1;
+    return header_size;
+}
+
+    static void
+serve_handle(worker_t *worker)
+{
+    request_t request;
+    const char *message = 0;
+    int offset = serve_read_request(worker, &request, &message);
+    if (offset < 0) {
+        if (message)
+            serve_reply_error(worker->fd, message);
+        return;
+    }
+    char *payload = worker->buffer->string + offset;
+
+    declaration_t *declaration = 0;
+    if (request.declaration_size && maxxc_declaration_new(&declaration, payload, request.declaration_size) != MAXXC_OK) {
+        serve_reply_error(worker->fd, maxxc_error_message());
+        return;
+    }
+    int cancelled = worker->track->cancelled;
+    worker->track->pyramid = request.pyramid;
+    if (maxxc_track_read_igc(worker->track, 0, payload + request.declaration_size, request.igc_size) != MAXXC_OK) {
+        serve_reply_error(worker->fd, maxxc_error_message());
+        declaration_free(declaration);
+        return;
+    }
+    worker->track->cancelled = cancelled;
+
+    serve_t *serve = worker->serve;
+    pthread_mutex_lock(&serve->mutex);
+    worker->watched = 1;
+    worker->eof = 0;
+    ++worker->generation;
+    pthread_mutex_unlock(&serve->mutex);
+
+    /* An error while optimizing or caching, such as running out of memory
+     * or failing to write the cache, fails this request only. */
+    error_context_t context;
+    error_push(&context);
+    if (setjmp(context.env)) {
+        serve_reply_error(worker->fd, context.message);
+        declaration_free(declaration);
+        return;
+    }
+    result_reset(worker->result);
+    cache_t *cache = serve->cache;
+    cache_key_t key;
+    if (cache)
+        cache_key(&key, worker->track, request.league, request.complexity, declaration);
+    if (!worker->track->cancelled && (!cache || !cache_lookup(cache, &key, worker->result))) {
+        track_set_deadline(worker->track, request.deadline);
+        request.track_optimize(worker->track, request.complexity, declaration, worker->result);
+        if (cache && !worker->track->stopped)
+            cache_store(cache, &key, worker->result, 0);
+    }
+    error_pop(&context);
+    declaration_free(declaration);
+
+    if (!worker->track->cancelled) {
+        int fd = dup(worker->fd);
+        FILE *output = fd == -1 ? 0 : fdopen(fd, "w");
+        if (!output) {
+            serve_reply_error(worker->fd, strerror(errno));
+            if (fd != -1)
+                close(fd);
+            return;
+        }
+        int flags = (request.embed_igc ? MAXXC_EMBED_IGC : 0) | (request.embed_trk ? MAXXC_EMBED_TRK : 0);
+        maxxc_result_write_file(worker->result, worker->track, request.format, flags, output);
+        fclose(output);
+    }
+}
+
+    static void *
+serve_worker(void *arg)
+{
+    worker_t *worker = arg;
+    serve_t *serve = worker->serve;
+    omp_set_num_threads(1);
+    while (1) {
+        pthread_mutex_lock(&serve->mutex);
+        while (!serve->queue_size)
+            pthread_cond_wait(&serve->cond, &serve->mutex);
+        int fd = serve->queue[serve->queue_head];
+        serve->queue_head = (serve->queue_head + 1) % SERVE_QUEUE_CAPACITY;
+        --serve->queue_size;
+        worker->fd = fd;
+        worker->watched = 0;
+        pthread_mutex_unlock(&serve->mutex);
+
+        serve_handle(worker);
+
+        pthread_mutex_lock(&serve->mutex);
+        worker->fd = -1;
+        worker->watched = 0;
+        pthread_mutex_unlock(&serve->mutex);
+        close(fd);
+    }
+    return 0;
+}
+
+/* Watches the connections of running requests for cancellation. */
+    static void *
+serve_monitor(void *arg)
+{
+    serve_t *serve = arg;
+    struct pollfd *pollfds = alloc(serve->nworkers * sizeof(struct pollfd));
+    int *generations = alloc(serve->nworkers * sizeof(int));
+    while (1) {
+        pthread_mutex_lock(&serve->mutex);
+        for (int i = 0; i < serve->nworkers; ++i) {
+            worker_t *worker = serve->workers + i;
+            pollfds[i].fd = worker->watched ? worker->fd : -1;
+            pollfds[i].events = worker->eof ? 0 : POLLIN;
+            pollfds[i].revents = 0;
+            generations[i] = worker->generation;
+        }
+        pthread_mutex_unlock(&serve->mutex);
+        if (poll(pollfds, serve->nworkers, 100) <= 0)
+            continue;
+        pthread_mutex_lock(&serve->mutex);
+        for (int i = 0; i < serve->nworkers; ++i) {
+            worker_t *worker = serve->workers + i;
+            if (!pollfds[i].revents || worker->fd != pollfds[i].fd || worker->generation != generations[i])
+                continue;
+            if (pollfds[i].revents & (POLLHUP | POLLERR | POLLNVAL)) {
+                worker->track->cancelled = 1;
+            } else if (pollfds[i].revents & POLLIN) {
+                char buffer[64];
+                ssize_t n = recv(worker->fd, buffer, sizeof buffer - 1, MSG_DONTWAIT);
+                if (n == 0) {
+                    worker->eof = 1;
+                } else if (n > 0) {
+                    buffer[n] = '\0';
+                    if (strstr(buffer, "cancel"))
+                        worker->track->cancelled = 1;
+                }
+            }
+        }
+        pthread_mutex_unlock(&serve->mutex);
+    }
+    return 0;
+}
+
+    void
+serve_run(const char *path, cache_t *cache)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof addr.sun_path)
+        error("socket path too long '%s'", path);
+    strcpy(addr.sun_path, path);
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+        DIE("socket", errno);
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof addr) < 0)
+        error("bind: %s: %s", path, strerror(errno));
+    if (listen(listen_fd, SERVE_QUEUE_CAPACITY) < 0)
+        DIE("listen", errno);
+
+    serve_t serve;
+    memset(&serve, 0, sizeof serve);
+    pthread_mutex_init(&serve.mutex, 0);
+    pthread_cond_init(&serve.cond, 0);
+    serve.cache = cache;
+    serve.nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (serve.nworkers < 1)
+        serve.nworkers = 1;
+    serve.workers = alloc(serve.nworkers * sizeof(worker_t));
+    for (int i = 0; i < serve.nworkers; ++i) {
+        worker_t *worker = serve.workers + i;
+        worker->serve = &serve;
+        worker->track = track_new();
+        worker->result = result_new();
+        worker->buffer = string_buffer_new();
+        worker->fd = -1;
+        if ((errno = pthread_create(&worker->thread, 0, serve_worker, worker)))
+            DIE("pthread_create", errno);
+    }
+    pthread_t monitor;
+    if ((errno = pthread_create(&monitor, 0, serve_monitor, &serve)))
+        DIE("pthread_create", errno);
+
+    while (1) {
+        int fd = accept(listen_fd, 0, 0);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            /* Running out of descriptors or memory under load fails only
+             * the connections that arrive until some are released. */
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                fprintf(stderr, "%s: accept: %s\n", program_name, strerror(errno));
+                usleep(SERVE_ACCEPT_BACKOFF);
+                continue;
+            }
+            DIE("accept", errno);
+        }
+        struct timeval timeout = { SERVE_TIMEOUT, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+        pthread_mutex_lock(&serve.mutex);
+        if (serve.queue_size == SERVE_QUEUE_CAPACITY) {
+            pthread_mutex_unlock(&serve.mutex);
+            serve_reply_error(fd, "server busy");
+            close(fd);
+            continue;
+        }
+        serve.queue[(serve.queue_head + serve.queue_size) % SERVE_QUEUE_CAPACITY] = fd;
+        ++serve.queue_size;
+        pthread_cond_signal(&serve.cond);
+        pthread_mutex_unlock(&serve.mutex);
+    }
+}
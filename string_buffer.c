@@ -7,7 +7,7 @@
     string_buffer_t *
 string_buffer_new(void)
 {
-    string_buffer_t *string_buffer = alloc(sizeof(string_buffer));
+    string_buffer_t *string_buffer = alloc(sizeof(string_buffer_t));
     string_buffer->capacity = 16;
     string_buffer->string = alloc(string_buffer->capacity);
     string_buffer->string[0] = 0;
@@ -19,8 +19,8 @@ string_buffer_new(void)
 string_buffer_free(string_buffer_t *string_buffer)
 {
     if (string_buffer) {
-        free(string_buffer->string);
-        free(string_buffer);
+        mem_free(string_buffer->string);
+        mem_free(string_buffer);
     }
 }
 
@@ -28,10 +28,14 @@ string_buffer_free(string_buffer_t *string_buffer)
 string_buffer_append(string_buffer_t *string_buffer, const char *s, int len)
 {
     if (string_buffer->length + len + 1 > string_buffer->capacity) {
-        string_buffer->capacity = 2 * string_buffer->capacity;
-        string_buffer->string = realloc(string_buffer->string, string_buffer->capacity);
-        if (!string_buffer->string)
+        int capacity = string_buffer->capacity;
+        while (string_buffer->length + len + 1 > capacity)
+            capacity = 2 * capacity;
+        char *string = mem_realloc(string_buffer->string, capacity);
+        if (!string)
             DIE("realloc", errno);
+        string_buffer->string = string;
+        string_buffer->capacity = capacity;
     }
     memcpy(string_buffer->string + string_buffer->length, s, len);
     string_buffer->length += len;
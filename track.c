@@ -19,9 +19,17 @@
 */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
 #include <math.h>
+#include <omp.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "maxxc.h"
 
     void
@@ -35,20 +43,397 @@ trkpt_to_wpt(const trkpt_t *trkpt, wpt_t *wpt)
     wpt->val = trkpt->val;
 }
 
-__attribute__ ((nonnull(1, 2))) __attribute__ ((pure))
+#ifdef MAXXC_STATS
+
+/* Counters are kept per thread, each in its own cache line, and summed into
+ * the phase when its outermost run ends.  Runs on the coarser tracks of the
+ * pyramid share the stats of the full track and so count towards the same
+ * phase. */
+enum {
+    TRACK_STATS_INITIALIZE,
+    TRACK_STATS_CIRCUIT_TABLES,
+    TRACK_STATS_OPEN_DISTANCE,
+    TRACK_STATS_OPEN_DISTANCE1,
+    TRACK_STATS_OPEN_DISTANCE2,
+    TRACK_STATS_OPEN_DISTANCE3,
+    TRACK_STATS_ALLER_RETOUR,
+    TRACK_STATS_TRIANGLE_FAI,
+    TRACK_STATS_TRIANGLE_PLAT,
+    TRACK_STATS_QUADRILATERE,
+    TRACK_STATS_DECLARED,
+    TRACK_STATS_NPHASES
+};
+
+static const char *track_stats_names[TRACK_STATS_NPHASES] = {
+    "initialize",
+    "circuit_tables",
+    "open_distance",
+    "open_distance1",
+    "open_distance2",
+    "open_distance3",
+    "aller_retour",
+    "triangle_fai",
+    "triangle_plat",
+    "quadrilatere",
+    "declared",
+};
+
+typedef struct {
+    long long deltas;
+    long long fast_forwards;
+    long long skipped;
+    long long improvements;
+} track_counters_t;
+
+typedef union {
+    track_counters_t counters;
+    char padding[64];
+} track_thread_counters_t;
+
+typedef struct {
+    int runs;
+    double wall;
+    double cpu;
+    track_counters_t counters;
+} track_phase_stats_t;
+
+struct track_stats {
+    int depth;
+    int phase;
+    struct timespec wall;
+    struct timespec cpu;
+    int nthreads;
+    track_thread_counters_t *threads;
+    track_phase_stats_t phases[TRACK_STATS_NPHASES];
+};
+
+#define TRACK_STATS_ADD(track, counter, n) ((track)->stats->threads[omp_get_thread_num()].counters.counter += (n))
+/* Functions that count are only pure when they do not, or the compiler could
+ * merge or drop their calls and their counts with them. */
+#define TRACK_PURE
+#define TRACK_STATS_BEGIN(track, phase) track_stats_begin((track)->stats, (phase))
+#define TRACK_STATS_END(track) track_stats_end((track)->stats)
+
     static inline double
-coord_delta(const coord_t *coord1, const coord_t *coord2)
+track_stats_elapsed(const struct timespec *begin, const struct timespec *end)
+{
+    return (end->tv_sec - begin->tv_sec) + (end->tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+/* Inside a parallel region the optimizer runs on the calling thread alone, so
+ * its CPU time is the thread's, not the process's. */
+    static inline clockid_t
+track_stats_cpu_clock(void)
+{
+    return omp_in_parallel() ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID;
+}
+
+__attribute__ ((nonnull(1)))
+    static void
+track_stats_begin(track_stats_t *stats, int phase)
+{
+    if (stats->depth++)
+        return;
+    int nthreads = omp_in_parallel() ? 1 : omp_get_max_threads();
+    if (nthreads > stats->nthreads) {
+        mem_aligned_free(stats->threads);
+        stats->threads = 0;
+        stats->nthreads = 0;
+        if (!(stats->threads = mem_aligned_alloc(nthreads * sizeof(track_thread_counters_t))))
+            DIE("posix_memalign", ENOMEM);
+        stats->nthreads = nthreads;
+    }
+    memset(stats->threads, 0, stats->nthreads * sizeof(track_thread_counters_t));
+    stats->phase = phase;
+    clock_gettime(CLOCK_MONOTONIC, &stats->wall);
+    clock_gettime(track_stats_cpu_clock(), &stats->cpu);
+}
+
+__attribute__ ((nonnull(1)))
+    static void
+track_stats_end(track_stats_t *stats)
+{
+    if (--stats->depth)
+        return;
+    struct timespec wall, cpu;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(track_stats_cpu_clock(), &cpu);
+    track_phase_stats_t *phase = stats->phases + stats->phase;
+    ++phase->runs;
+    phase->wall += track_stats_elapsed(&stats->wall, &wall);
+    phase->cpu += track_stats_elapsed(&stats->cpu, &cpu);
+    for (int t = 0; t < stats->nthreads; ++t) {
+        const track_counters_t *counters = &stats->threads[t].counters;
+        phase->counters.deltas += counters->deltas;
+        phase->counters.fast_forwards += counters->fast_forwards;
+        phase->counters.skipped += counters->skipped;
+        phase->counters.improvements += counters->improvements;
+    }
+}
+
+    static void
+track_stats_delete(track_stats_t *stats)
+{
+    if (stats) {
+        mem_aligned_free(stats->threads);
+        mem_free(stats);
+    }
+}
+
+    static void
+track_stats_write_string(const char *string, FILE *file)
+{
+    if (!string) {
+        fputs("null", file);
+        return;
+    }
+    putc('"', file);
+    for (const char *p = string; *p; ++p) {
+        if (*p == '"' || *p == '\\')
+            fprintf(file, "\\%c", *p);
+        else if ((unsigned char) *p < 0x20)
+            fprintf(file, "\\u%04x", *p);
+        else
+            putc(*p, file);
+    }
+    putc('"', file);
+}
+
+/* Writes the counters of every phase that has run since the track was read as
+ * a single line of JSON. */
+    void
+track_write_stats(const track_t *track, FILE *file)
 {
-    double x = coord1->sin_lat * coord2->sin_lat + coord1->cos_lat * coord2->cos_lat * cos(coord1->lon - coord2->lon);
-    return x < 1.0 ? acos(x) : 0.0;
+    const track_stats_t *stats = track->stats;
+    flockfile(file);
+    fputs("{\"filename\": ", file);
+    track_stats_write_string(track->filename, file);
+    fprintf(file, ", \"ntrkpts\": %d, \"phases\": [", track->ntrkpts);
+    const char *separator = "";
+    for (int p = 0; p < TRACK_STATS_NPHASES; ++p) {
+        const track_phase_stats_t *phase = stats->phases + p;
+        if (!phase->runs)
+            continue;
+        fprintf(file, "%s{\"name\": \"%s\", \"runs\": %d, \"wall\": %.6f, \"cpu\": %.6f, \"deltas\": %lld, \"fast_forwards\": %lld, \"average_skip\": %.2f, \"improvements\": %lld}",
+                separator, track_stats_names[p], phase->runs, phase->wall, phase->cpu, phase->counters.deltas, phase->counters.fast_forwards,
+                phase->counters.fast_forwards ? (double) phase->counters.skipped / phase->counters.fast_forwards : 0.0, phase->counters.improvements);
+        separator = ", ";
+    }
+    fputs("]}\n", file);
+    funlockfile(file);
+}
+
+#else
+
+#define TRACK_STATS_ADD(track, counter, n) ((void) 0)
+#define TRACK_PURE __attribute__ ((pure))
+#define TRACK_STATS_BEGIN(track, phase) ((void) 0)
+#define TRACK_STATS_END(track) ((void) 0)
 
+#endif
+
+/* The skips over caps and along sigma_delta rely on the triangle inequality,
+ * which rounding and the truncation of the chord series can break by far less
+ * than this for fixes up to several hundred kilometres apart.  Nearly
+ * collinear fixes, as on a straight glide, are enough to break it. */
+#define TRACK_DELTA_EPSILON 1e-9
+
+__attribute__ ((nonnull(1, 2))) __attribute__ ((pure))
+    static inline double
+track_coord_chord2(const track_t *track, const coord_t *coord, int i)
+{
+    double dx = coord->x - track->x[i], dy = coord->y - track->y[i], dz = coord->z - track->z[i];
+    return dx * dx + dy * dy + dz * dz;
 }
 
 __attribute__ ((nonnull(1))) __attribute__ ((pure))
     static inline double
+track_chord2(const track_t *track, int i, int j)
+{
+    double dx = track->x[i] - track->x[j], dy = track->y[i] - track->y[j], dz = track->z[i] - track->z[j];
+    return dx * dx + dy * dy + dz * dz;
+}
+
+__attribute__ ((nonnull(1, 2))) TRACK_PURE
+    static inline double
+track_coord_delta(const track_t *track, const coord_t *coord, int i)
+{
+    TRACK_STATS_ADD(track, deltas, 1);
+    return coord_chord_delta(track_coord_chord2(track, coord, i));
+}
+
+__attribute__ ((nonnull(1))) TRACK_PURE
+    static inline double
 track_delta(const track_t *track, int i, int j)
 {
-    return coord_delta(track->coords + i, track->coords + j);
+    TRACK_STATS_ADD(track, deltas, 1);
+    return coord_chord_delta(track_chord2(track, i, j));
+}
+
+__attribute__ ((nonnull(1))) __attribute__ ((pure))
+    static inline double
+track_exact_delta(const track_t *track, int i, int j)
+{
+    return coord_exact_delta(track_chord2(track, i, j));
+}
+
+__attribute__ ((nonnull(1, 2))) __attribute__ ((pure))
+    static inline double
+coord_delta(const coord_t *coord1, const coord_t *coord2)
+{
+    double dx = coord1->x - coord2->x, dy = coord1->y - coord2->y, dz = coord1->z - coord2->z;
+    return coord_chord_delta(dx * dx + dy * dy + dz * dz);
+}
+
+/* The caps form a binary tree over the track.  Each leaf covers
+ * TRACK_CAP_SIZE consecutive fixes and each node at level k covers the fixes
+ * of its two children at level k - 1.  Every fix covered by a node lies within
+ * radius of its centre, so when a scan enters a new leaf it can reject the
+ * rest of the largest node containing it whose cap cannot hold a candidate. */
+#define TRACK_CAP_SIZE 16
+
+__attribute__ ((nonnull(1))) __attribute__ ((pure))
+    static inline const cap_t *
+track_cap(const track_t *track, int level, int i)
+{
+    return track->caps + track->cap_offsets[level] + (i / TRACK_CAP_SIZE >> level);
+}
+
+/* Returns the first fix after the largest node containing fix j in which no
+ * fix is further than bound from coord, or j if there is none. */
+__attribute__ ((nonnull(1, 2))) __attribute__ ((pure))
+    static inline int
+track_cap_skip_far(const track_t *track, const coord_t *coord, int j, double bound)
+{
+    int next = j;
+    for (int level = 0; level < track->ncap_levels; ++level) {
+        const cap_t *cap = track_cap(track, level, j);
+        if (coord_delta(coord, &cap->centre) + cap->radius > bound)
+            break;
+        next = ((j / TRACK_CAP_SIZE >> level) + 1) * (TRACK_CAP_SIZE << level);
+    }
+    return next;
+}
+
+/* Returns the last fix before the largest node containing fix j in which no
+ * fix is further than bound from coord, or j if there is none. */
+__attribute__ ((nonnull(1, 2))) __attribute__ ((pure))
+    static inline int
+track_cap_skip_far_backward(const track_t *track, const coord_t *coord, int j, double bound)
+{
+    int next = j;
+    for (int level = 0; level < track->ncap_levels; ++level) {
+        const cap_t *cap = track_cap(track, level, j);
+        if (coord_delta(coord, &cap->centre) + cap->radius > bound)
+            break;
+        next = (j / TRACK_CAP_SIZE >> level) * (TRACK_CAP_SIZE << level) - 1;
+    }
+    return next;
+}
+
+/* Returns the first fix after the largest node containing fix j in which no
+ * fix is nearer than bound to coord, or j if there is none. */
+__attribute__ ((nonnull(1, 2))) __attribute__ ((pure))
+    static inline int
+track_cap_skip_near(const track_t *track, const coord_t *coord, int j, double bound)
+{
+    int next = j;
+    for (int level = 0; level < track->ncap_levels; ++level) {
+        const cap_t *cap = track_cap(track, level, j);
+        if (coord_delta(coord, &cap->centre) - cap->radius < bound)
+            break;
+        next = ((j / TRACK_CAP_SIZE >> level) + 1) * (TRACK_CAP_SIZE << level);
+    }
+    return next;
+}
+
+/* Returns the first fix after the largest node containing fix j in which no
+ * fix has a sum of distances to coord1 and coord2 greater than bound, or j if
+ * there is none. */
+__attribute__ ((nonnull(1, 2, 3))) __attribute__ ((pure))
+    static inline int
+track_cap_skip_far2(const track_t *track, const coord_t *coord1, const coord_t *coord2, int j, double bound)
+{
+    int next = j;
+    for (int level = 0; level < track->ncap_levels; ++level) {
+        const cap_t *cap = track_cap(track, level, j);
+        if (coord_delta(coord1, &cap->centre) + coord_delta(coord2, &cap->centre) + 2.0 * cap->radius > bound)
+            break;
+        next = ((j / TRACK_CAP_SIZE >> level) + 1) * (TRACK_CAP_SIZE << level);
+    }
+    return next;
+}
+
+#define TRACK_PYRAMID_FACTOR 4
+#define TRACK_PYRAMID_MIN_TRKPTS 2048
+
+#define TRACK_ROW_SIZE 32
+#define TRACK_ROW_RUN 8
+
+/* A row caches the distances from one fix to a block of consecutive fixes.
+ * Scans usually skip ahead, so a block is only computed with the vector
+ * kernel once the scan has visited TRACK_ROW_RUN consecutive fixes. */
+typedef struct {
+    coord_t coord;
+    int last;
+    int run;
+    int begin;
+    int end;
+    double delta[TRACK_ROW_SIZE];
+} track_row_t;
+
+__attribute__ ((nonnull(1, 2)))
+    static inline void
+track_row_init_coord(track_row_t *row, const coord_t *coord)
+{
+    row->coord = *coord;
+    row->last = -2;
+    row->run = row->begin = row->end = 0;
+}
+
+__attribute__ ((nonnull(1, 2)))
+    static inline void
+track_row_init(const track_t *track, track_row_t *row, int i)
+{
+    coord_t coord = { track->x[i], track->y[i], track->z[i] };
+    track_row_init_coord(row, &coord);
+}
+
+__attribute__ ((nonnull(1, 2)))
+    static inline double
+track_row_forward(const track_t *track, track_row_t *row, int j, int limit)
+{
+    if (row->begin <= j && j < row->end)
+        return row->delta[j - row->begin];
+    row->run = j == row->last + 1 ? row->run + 1 : 0;
+    row->last = j;
+    if (row->run < TRACK_ROW_RUN)
+        return track_coord_delta(track, &row->coord, j);
+    int n = limit - j < TRACK_ROW_SIZE ? limit - j : TRACK_ROW_SIZE;
+    coord_delta_row(&row->coord, track->x + j, track->y + j, track->z + j, n, row->delta);
+    TRACK_STATS_ADD(track, deltas, n);
+    row->begin = j;
+    row->end = j + n;
+    return row->delta[0];
+}
+
+__attribute__ ((nonnull(1, 2)))
+    static inline double
+track_row_backward(const track_t *track, track_row_t *row, int j, int limit)
+{
+    if (row->begin <= j && j < row->end)
+        return row->delta[j - row->begin];
+    row->run = j == row->last - 1 ? row->run + 1 : 0;
+    row->last = j;
+    if (row->run < TRACK_ROW_RUN)
+        return track_coord_delta(track, &row->coord, j);
+    int n = j + 1 - limit < TRACK_ROW_SIZE ? j + 1 - limit : TRACK_ROW_SIZE;
+    int begin = j + 1 - n;
+    coord_delta_row(&row->coord, track->x + begin, track->y + begin, track->z + begin, n, row->delta);
+    TRACK_STATS_ADD(track, deltas, n);
+    row->begin = begin;
+    row->end = j + 1;
+    return row->delta[j - begin];
 }
 
 __attribute__ ((nonnull(1))) __attribute__ ((pure))
@@ -59,22 +444,22 @@ track_forward(const track_t *track, int i, double d)
     return step > 0 ? i + step : ++i;
 }
 
-__attribute__ ((nonnull(1))) __attribute__ ((pure))
+__attribute__ ((nonnull(1))) TRACK_PURE
     static inline int
 track_fast_forward(const track_t *track, int i, double d)
 {
+    d -= TRACK_DELTA_EPSILON;
     double target = track->sigma_delta[i] + d;
-    i = track_forward(track, i, d);
-    if (i >= track->ntrkpts)
-        return i;
-    while (1) {
-        double error = target - track->sigma_delta[i];
+    int j = track_forward(track, i, d);
+    while (j < track->ntrkpts) {
+        double error = target - track->sigma_delta[j];
         if (error <= 0.0)
-            return i;
-        i = track_forward(track, i, error);
-        if (i >= track->ntrkpts)
-            return i;
+            break;
+        j = track_forward(track, j, error);
     }
+    TRACK_STATS_ADD(track, fast_forwards, 1);
+    TRACK_STATS_ADD(track, skipped, j - i);
+    return j;
 }
 
 __attribute__ ((nonnull(1))) __attribute__ ((pure))
@@ -85,31 +470,48 @@ track_backward(const track_t *track, int i, double d)
     return step > 0 ? i - step : --i;
 }
 
-__attribute__ ((nonnull(1))) __attribute__ ((pure))
+__attribute__ ((nonnull(1))) TRACK_PURE
     static inline int
 track_fast_backward(const track_t *track, int i, double d)
 {
+    d -= TRACK_DELTA_EPSILON;
     double target = track->sigma_delta[i] - d;
-    i = track_backward(track, i, d);
-    if (i < 0)
-        return i;
-    while (1) {
-        double error = track->sigma_delta[i] - target;
+    int j = track_backward(track, i, d);
+    while (j >= 0) {
+        double error = track->sigma_delta[j] - target;
         if (error <= 0.0)
-            return i;
-        i = track_backward(track, i, error);
-        if (i < 0)
-            return i;
+            break;
+        j = track_backward(track, j, error);
     }
+    TRACK_STATS_ADD(track, fast_forwards, 1);
+    TRACK_STATS_ADD(track, skipped, i - j);
+    return j;
 }
 
 __attribute__ ((nonnull(1))) __attribute__ ((pure))
     static inline int
+track_outside_window(const track_t *track, int i)
+{
+    return track->windowed && !track->window[i / TRACK_PYRAMID_FACTOR];
+}
+
+__attribute__ ((nonnull(1)))
+    static inline int
 track_furthest_from(const track_t *track, int i, int begin, int end, double bound, double *out)
 {
-    int result = -1;
+    track_row_t row;
+    track_row_init(track, &row, i);
+    int result = -1, leaf = -1;
     for (int j = begin; j < end; ) {
-        double d = track_delta(track, i, j);
+        if (j / TRACK_CAP_SIZE != leaf) {
+            int next = track_cap_skip_far(track, &row.coord, j, bound);
+            if (next != j) {
+                j = next;
+                continue;
+            }
+            leaf = j / TRACK_CAP_SIZE;
+        }
+        double d = track_row_forward(track, &row, j, end);
         if (d > bound) {
             bound = *out = d;
             result = j;
@@ -121,13 +523,23 @@ track_furthest_from(const track_t *track, int i, int begin, int end, double boun
     return result;
 }
 
-__attribute__ ((nonnull(1))) __attribute__ ((pure))
+__attribute__ ((nonnull(1)))
     static inline int
 track_nearest_to(const track_t *track, int i, int begin, int end, double bound, double *out)
 {
-    int result = -1;
+    track_row_t row;
+    track_row_init(track, &row, i);
+    int result = -1, leaf = -1;
     for (int j = begin; j < end; ) {
-        double d = track_delta(track, i, j);
+        if (j / TRACK_CAP_SIZE != leaf) {
+            int next = track_cap_skip_near(track, &row.coord, j, bound);
+            if (next != j) {
+                j = next;
+                continue;
+            }
+            leaf = j / TRACK_CAP_SIZE;
+        }
+        double d = track_row_forward(track, &row, j, end);
         if (d < bound) {
             result = j;
             bound = *out = d;
@@ -139,13 +551,27 @@ track_nearest_to(const track_t *track, int i, int begin, int end, double bound,
     return result;
 }
 
+/* Returns the first fix in [begin, end) with the greatest sum of distances to
+ * coord1 and coord2 if that sum is greater than bound, storing the sum in out,
+ * or -1 otherwise. */
+__attribute__ ((nonnull(1, 2, 3, 7)))
     static inline int
-__attribute__ ((nonnull(1))) __attribute__ ((pure))
-track_furthest_from2(const track_t *track, int i, int j, int begin, int end, double bound, double *out)
+track_coords_furthest_from2(const track_t *track, const coord_t *coord1, const coord_t *coord2, int begin, int end, double bound, double *out)
 {
-    int result = -1;
+    track_row_t row_i, row_j;
+    track_row_init_coord(&row_i, coord1);
+    track_row_init_coord(&row_j, coord2);
+    int result = -1, leaf = -1;
     for (int k = begin; k < end; ) {
-        double d = track_delta(track, i, k) + track_delta(track, k, j);
+        if (k / TRACK_CAP_SIZE != leaf) {
+            int next = track_cap_skip_far2(track, &row_i.coord, &row_j.coord, k, bound);
+            if (next != k) {
+                k = next;
+                continue;
+            }
+            leaf = k / TRACK_CAP_SIZE;
+        }
+        double d = track_row_forward(track, &row_i, k, end) + track_row_forward(track, &row_j, k, end);
         if (d > bound) {
             result = k;
             bound = *out = d;
@@ -157,12 +583,32 @@ track_furthest_from2(const track_t *track, int i, int j, int begin, int end, dou
     return result;
 }
 
+__attribute__ ((nonnull(1, 7)))
     static inline int
-__attribute__ ((nonnull(1))) __attribute__ ((pure))
+track_furthest_from2(const track_t *track, int i, int j, int begin, int end, double bound, double *out)
+{
+    coord_t coord_i = { track->x[i], track->y[i], track->z[i] };
+    coord_t coord_j = { track->x[j], track->y[j], track->z[j] };
+    return track_coords_furthest_from2(track, &coord_i, &coord_j, begin, end, bound, out);
+}
+
+    static inline int
+__attribute__ ((nonnull(1))) TRACK_PURE
 track_first_at_least(const track_t *track, int i, int begin, int end, double bound)
 {
+    track_row_t row;
+    track_row_init(track, &row, i);
+    int leaf = -1;
     for (int j = begin; j < end; ) {
-        double d = track_delta(track, i, j);
+        if (j / TRACK_CAP_SIZE != leaf) {
+            int next = track_cap_skip_far(track, &row.coord, j, bound);
+            if (next != j) {
+                j = next;
+                continue;
+            }
+            leaf = j / TRACK_CAP_SIZE;
+        }
+        double d = track_row_forward(track, &row, j, end);
         if (d > bound)
             return j;
         j = track_fast_forward(track, j, bound - d);
@@ -170,12 +616,23 @@ track_first_at_least(const track_t *track, int i, int begin, int end, double bou
     return -1;
 }
 
-__attribute__ ((nonnull(1))) __attribute__ ((pure))
+__attribute__ ((nonnull(1))) TRACK_PURE
     static inline int
 track_last_at_least(const track_t *track, int i, int begin, int end, double bound)
 {
+    track_row_t row;
+    track_row_init(track, &row, i);
+    int leaf = -1;
     for (int j = end - 1; j >= begin; ) {
-        double d = track_delta(track, i, j);
+        if (j / TRACK_CAP_SIZE != leaf) {
+            int next = track_cap_skip_far_backward(track, &row.coord, j, bound);
+            if (next != j) {
+                j = next;
+                continue;
+            }
+            leaf = j / TRACK_CAP_SIZE;
+        }
+        double d = track_row_backward(track, &row, j, begin);
         if (d > bound)
             return j;
         j = track_fast_backward(track, j, bound - d);
@@ -183,12 +640,21 @@ track_last_at_least(const track_t *track, int i, int begin, int end, double boun
     return -1;
 }
 
-__attribute__ ((nonnull(1, 2))) __attribute__ ((pure))
+__attribute__ ((nonnull(1, 2))) TRACK_PURE
     static inline int
 track_first_inside(const track_t *track, const coord_t *coord, double radius, int begin, int end)
 {
+    int leaf = -1;
     for (int i = begin; i < end; ) {
-        double d = coord_delta(coord, track->coords + i);
+        if (i / TRACK_CAP_SIZE != leaf) {
+            int next = track_cap_skip_near(track, coord, i, nextafter(radius, INFINITY));
+            if (next != i) {
+                i = next;
+                continue;
+            }
+            leaf = i / TRACK_CAP_SIZE;
+        }
+        double d = track_coord_delta(track, coord, i);
         if (d <= radius)
             return i;
         i = track_forward(track, i, d - radius);
@@ -196,90 +662,374 @@ track_first_inside(const track_t *track, const coord_t *coord, double radius, in
     return -1;
 }
 
-__attribute__ ((nonnull(1, 2))) __attribute__ ((pure))
+__attribute__ ((nonnull(1, 2))) TRACK_PURE
     static inline int
 track_first_outside(const track_t *track, const coord_t *coord, double radius, int begin, int end)
 {
+    int leaf = -1;
     for (int i = begin; i < end; ) {
-        double d = coord_delta(coord, track->coords + i);
+        if (i / TRACK_CAP_SIZE != leaf) {
+            int next = track_cap_skip_far(track, coord, i, radius);
+            if (next != i) {
+                i = next;
+                continue;
+            }
+            leaf = i / TRACK_CAP_SIZE;
+        }
+        double d = track_coord_delta(track, coord, i);
         if (d > radius)
             return i;
-        i = track_forward(track, i, d - radius);
+        i = track_forward(track, i, radius - d);
     }
     return -1;
 }
 
+    static void *
+track_resize_table(void *table, int size)
+{
+    void *resized = mem_realloc(table, size);
+    if (!resized)
+        DIE("realloc", errno);
+    return resized;
+}
+
+    static void *
+track_resize_aligned_table(void *table, int size)
+{
+    void *resized = mem_aligned_alloc(size);
+    if (!resized)
+        DIE("posix_memalign", ENOMEM);
+    mem_aligned_free(table);
+    return resized;
+}
+
     static void
-track_initialize(track_t *track)
+track_cap_normalize(coord_t *coord)
+{
+    double norm = sqrt(coord->x * coord->x + coord->y * coord->y + coord->z * coord->z);
+    coord->x /= norm;
+    coord->y /= norm;
+    coord->z /= norm;
+}
+
+/* Fills cap_offsets with the offset of each level of the cap tree of a track
+ * of ntrkpts fixes and returns the number of levels. */
+    static int
+track_cap_layout(int ntrkpts, int *cap_offsets)
+{
+    int nleaves = (ntrkpts + TRACK_CAP_SIZE - 1) / TRACK_CAP_SIZE;
+    int ncaps = 0, ncap_levels = 0;
+    for (int n = nleaves; ; n = (n + 1) / 2) {
+        cap_offsets[ncap_levels++] = ncaps;
+        ncaps += n;
+        if (n == 1)
+            break;
+    }
+    return ncap_levels;
+}
+
+    static void
+track_compute_caps(track_t *track)
+{
+    int nleaves = (track->ntrkpts + TRACK_CAP_SIZE - 1) / TRACK_CAP_SIZE;
+    track->ncap_levels = track_cap_layout(track->ntrkpts, track->cap_offsets);
+    int ncaps = track->cap_offsets[track->ncap_levels - 1] + 1;
+    if (ncaps > track->caps_capacity) {
+        track->caps = track_resize_table(track->caps, ncaps * sizeof(cap_t));
+        track->caps_capacity = ncaps;
+    }
+#pragma omp parallel for schedule(static)
+    for (int m = 0; m < nleaves; ++m) {
+        cap_t *cap = track->caps + m;
+        int begin = m * TRACK_CAP_SIZE, end = begin + TRACK_CAP_SIZE < track->ntrkpts ? begin + TRACK_CAP_SIZE : track->ntrkpts;
+        cap->centre.x = cap->centre.y = cap->centre.z = 0.0;
+        for (int i = begin; i < end; ++i) {
+            cap->centre.x += track->x[i];
+            cap->centre.y += track->y[i];
+            cap->centre.z += track->z[i];
+        }
+        track_cap_normalize(&cap->centre);
+        cap->radius = 0.0;
+        for (int i = begin; i < end; ++i) {
+            double d = track_coord_delta(track, &cap->centre, i);
+            if (d > cap->radius)
+                cap->radius = d;
+        }
+        cap->radius += TRACK_DELTA_EPSILON;
+    }
+    for (int level = 1; level < track->ncap_levels; ++level) {
+        const cap_t *children = track->caps + track->cap_offsets[level - 1];
+        int nchildren = track->cap_offsets[level] - track->cap_offsets[level - 1];
+        cap_t *caps = track->caps + track->cap_offsets[level];
+        for (int m = 0; 2 * m < nchildren; ++m) {
+            cap_t *cap = caps + m;
+            const cap_t *child1 = children + 2 * m;
+            const cap_t *child2 = 2 * m + 1 < nchildren ? child1 + 1 : child1;
+            cap->centre.x = child1->centre.x + child2->centre.x;
+            cap->centre.y = child1->centre.y + child2->centre.y;
+            cap->centre.z = child1->centre.z + child2->centre.z;
+            track_cap_normalize(&cap->centre);
+            double radius1 = coord_delta(&cap->centre, &child1->centre) + child1->radius;
+            double radius2 = coord_delta(&cap->centre, &child2->centre) + child2->radius;
+            cap->radius = (radius1 > radius2 ? radius1 : radius2) + TRACK_DELTA_EPSILON;
+        }
+    }
+}
+
+#define TRACK_SIGMA_BLOCK 4096
+#define TRACK_LIMIT_MIN_CHUNK 256
+#define TRACK_LIMIT_CHUNKS_PER_THREAD 8
+
+/* Computes the running sum of the leg lengths in fixed size blocks, so that
+ * the rounding does not depend on the number of threads. */
+    static void
+track_compute_sigma_delta(track_t *track)
 {
-    track->coords = alloc(track->ntrkpts * sizeof(coord_t));
+    int n = track->ntrkpts;
+    int nblocks = (n + TRACK_SIGMA_BLOCK - 1) / TRACK_SIGMA_BLOCK;
+    double max_delta = 0.0;
+#pragma omp parallel for schedule(static) reduction(max:max_delta)
+    for (int b = 0; b < nblocks; ++b) {
+        int begin = b * TRACK_SIGMA_BLOCK, end = begin + TRACK_SIGMA_BLOCK < n ? begin + TRACK_SIGMA_BLOCK : n;
+        double sum = 0.0;
+        for (int i = begin; i < end; ++i) {
+            double delta = i ? track_delta(track, i - 1, i) : 0.0;
+            sum += delta;
+            track->sigma_delta[i] = sum;
+            if (delta > max_delta)
+                max_delta = delta;
+        }
+    }
+    track->max_delta = max_delta;
+    if (nblocks < 2)
+        return;
+    double *offsets = alloc(nblocks * sizeof(double));
+    for (int b = 1; b < nblocks; ++b) {
+        int end = (b + 1) * TRACK_SIGMA_BLOCK < n ? (b + 1) * TRACK_SIGMA_BLOCK : n;
+        offsets[b] = track->sigma_delta[b * TRACK_SIGMA_BLOCK - 1];
+        track->sigma_delta[end - 1] += offsets[b];
+    }
 #pragma omp parallel for schedule(static)
+    for (int b = 1; b < nblocks; ++b) {
+        int end = (b + 1) * TRACK_SIGMA_BLOCK < n ? (b + 1) * TRACK_SIGMA_BLOCK : n;
+        for (int i = b * TRACK_SIGMA_BLOCK; i < end - 1; ++i)
+            track->sigma_delta[i] += offsets[b];
+    }
+    mem_free(offsets);
+}
+
+/* Computes the before and after tables in chunks of consecutive fixes.
+ * Within a chunk each search starts from the previous fix's distance less the
+ * longest leg, which is a lower bound on the answer, and the first search of a
+ * chunk starts from the distance to the first or last fix of the track.  That
+ * start is much weaker, so there are only a few chunks per thread. */
+    static void
+track_compute_limits(track_t *track)
+{
+    int n = track->ntrkpts;
+    int nthreads = omp_in_parallel() ? 1 : omp_get_max_threads();
+    int chunk = n / (TRACK_LIMIT_CHUNKS_PER_THREAD * nthreads) + 1;
+    if (chunk < TRACK_LIMIT_MIN_CHUNK)
+        chunk = TRACK_LIMIT_MIN_CHUNK;
+    int nchunks = (n + chunk - 1) / chunk;
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int c = 0; c < 2 * nchunks; ++c) {
+        int begin = (c % nchunks) * chunk, end = begin + chunk < n ? begin + chunk : n;
+        if (c < nchunks) {
+            if (begin == 0) {
+                track->before[0].index = 0;
+                track->before[0].distance = 0.0;
+                ++begin;
+            }
+            double bound = begin < end ? nextafter(track_delta(track, begin, 0), -INFINITY) : 0.0;
+            for (int i = begin; i < end; ++i) {
+                if (i > begin)
+                    bound = track->before[i - 1].distance - track->max_delta - TRACK_DELTA_EPSILON;
+                track->before[i].index = track_furthest_from(track, i, 0, i, bound, &track->before[i].distance);
+            }
+        } else {
+            if (end == n) {
+                track->after[n - 1].index = n - 1;
+                track->after[n - 1].distance = 0.0;
+                --end;
+            }
+            double bound = begin < end ? nextafter(track_delta(track, begin, n - 1), -INFINITY) : 0.0;
+            for (int i = begin; i < end; ++i) {
+                if (i > begin)
+                    bound = track->after[i - 1].distance - track->max_delta - TRACK_DELTA_EPSILON;
+                track->after[i].index = track_furthest_from(track, i, i + 1, n, bound, &track->after[i].distance);
+            }
+        }
+    }
+}
+
+static void track_initialize(track_t *);
+
+/* Fills coarse with every TRACK_PYRAMID_FACTOR-th fix of track. */
+    static void
+track_decimate(track_t *coarse, track_t *track)
+{
+    int ntrkpts = (track->ntrkpts + TRACK_PYRAMID_FACTOR - 1) / TRACK_PYRAMID_FACTOR;
+    if (ntrkpts > coarse->trkpts_capacity) {
+        coarse->trkpts = track_resize_table(coarse->trkpts, ntrkpts * sizeof(trkpt_t));
+        coarse->trkpts_capacity = ntrkpts;
+    }
+    for (int i = 0; i < ntrkpts; ++i)
+        coarse->trkpts[i] = track->trkpts[TRACK_PYRAMID_FACTOR * i];
+    coarse->ntrkpts = ntrkpts;
+    coarse->pyramid = track->pyramid;
+    track_initialize(coarse);
+    track->pyramid_error = 0.0;
     for (int i = 0; i < track->ntrkpts; ++i) {
-        double lat = M_PI * track->trkpts[i].lat / (180 * 60000);
-        double lon = M_PI * track->trkpts[i].lon / (180 * 60000);
-        track->coords[i].sin_lat = sin(lat);
-        track->coords[i].cos_lat = cos(lat);
-        track->coords[i].lon = lon;
-    }
-    track->max_delta = 0.0;
-    track->sigma_delta = alloc(track->ntrkpts * sizeof(double));
-    track->sigma_delta[0] = 0.0;
-    for (int i = 1; i < track->ntrkpts; ++i) {
-        double delta = track_delta(track, i - 1, i);
-        track->sigma_delta[i] = track->sigma_delta[i - 1] + delta;
-        if (delta > track->max_delta)
-            track->max_delta = delta;
-    }
-#pragma omp parallel sections
-    {
-#pragma omp section
-        {
-#pragma omp critical
-            track->before = alloc(track->ntrkpts * sizeof(limit_t));
-            track->before[0].index = 0;
-            track->before[0].distance = 0.0;
-            for (int i = 1; i < track->ntrkpts; ++i)
-                track->before[i].index = track_furthest_from(track, i, 0, i, track->before[i - 1].distance - track->max_delta, &track->before[i].distance);
-        }
-#pragma omp section
-        {
-#pragma omp critical
-            track->after = alloc(track->ntrkpts * sizeof(limit_t));
-            track->after[0].index = track_furthest_from(track, 0, 1, track->ntrkpts, 0.0, &track->after[0].distance);
-            for (int i = 1; i < track->ntrkpts - 1; ++i)
-                track->after[i].index = track_furthest_from(track, i, i + 1, track->ntrkpts, track->after[i - 1].distance - track->max_delta, &track->after[i].distance);
-            track->after[track->ntrkpts - 1].index = track->ntrkpts - 1;
-            track->after[track->ntrkpts - 1].distance = 0.0;
+        double error = track_delta(track, i, i - i % TRACK_PYRAMID_FACTOR);
+        if (error > track->pyramid_error)
+            track->pyramid_error = error;
+    }
+    track->window = track_resize_table(track->window, ntrkpts);
+}
+
+    static void
+track_initialize_pyramid(track_t *track)
+{
+    if (track->pyramid && track->ntrkpts >= TRACK_PYRAMID_MIN_TRKPTS) {
+        if (!track->coarse) {
+            track->coarse = track_new();
+            track->coarse->fine = track;
+#ifdef MAXXC_STATS
+            track_stats_delete(track->coarse->stats);
+            track->coarse->stats = track->stats;
+#endif
         }
+        track_decimate(track->coarse, track);
+    }
+}
+
+    static void
+track_initialize(track_t *track)
+{
+    if (track->coarse)
+        track->coarse->ntrkpts = 0;
+    track->ncircuit_tables = 0;
+    if (!track->ntrkpts)
+        return;
+    TRACK_STATS_BEGIN(track, TRACK_STATS_INITIALIZE);
+    if (track->ntrkpts > track->tables_capacity) {
+        int n = track->ntrkpts;
+        track->x = track_resize_aligned_table(track->x, n * sizeof(double));
+        track->y = track_resize_aligned_table(track->y, n * sizeof(double));
+        track->z = track_resize_aligned_table(track->z, n * sizeof(double));
+        track->sigma_delta = track_resize_table(track->sigma_delta, n * sizeof(double));
+        track->before = track_resize_table(track->before, n * sizeof(limit_t));
+        track->after = track_resize_table(track->after, n * sizeof(limit_t));
+        track->tables_capacity = n;
+    }
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < track->ntrkpts; ++i) {
+        coord_t coord;
+        coord_init(&coord, M_PI * track->trkpts[i].lat / (180 * 60000), M_PI * track->trkpts[i].lon / (180 * 60000));
+        track->x[i] = coord.x;
+        track->y[i] = coord.y;
+        track->z[i] = coord.z;
     }
+    track_compute_caps(track);
+    track_compute_sigma_delta(track);
+    track_compute_limits(track);
+    track_initialize_pyramid(track);
+    TRACK_STATS_END(track);
+}
+
+    static int
+track_compare_circuit_bounds(const void *a, const void *b)
+{
+    double bound_a = *(const double *) a, bound_b = *(const double *) b;
+    return bound_a > bound_b ? -1 : bound_a < bound_b ? 1 : 0;
 }
 
+/* Computes the last finish and best start tables for each of the n closing
+ * distances in circuit_bounds that are not already cached.  last_finish[i] is
+ * the last fix within the closing distance of fix i and best_start[i] the
+ * first fix up to i with the latest last finish.  The last finish for a
+ * shorter closing distance is never later, so one backwards scan from the end
+ * of the track serves every distance, longest first. */
     void
-track_compute_circuit_tables(track_t *track, double circuit_bound)
-{
-    track->last_finish = alloc(track->ntrkpts * sizeof(int));
-    track->best_start = alloc(track->ntrkpts * sizeof(int));
-    int current_best_start = 0, i, j;
-    for (i = 0; i < track->ntrkpts; ++i) {
-        for (j = track->ntrkpts - 1; j >= i; ) {
-            double error = track_delta(track, i, j);
-            if (error < circuit_bound) {
-                track->last_finish[i] = j;
-                break;
-            } else {
-                j = track_fast_backward(track, j, error - circuit_bound);
+track_compute_circuit_tables(track_t *track, int n, const double *circuit_bounds)
+{
+    double bounds[TRACK_CIRCUIT_TABLES];
+    int nbounds;
+    for (int evicted = 0; ; evicted = 1) {
+        nbounds = 0;
+        for (int k = 0; k < n && nbounds < TRACK_CIRCUIT_TABLES; ++k) {
+            int cached = 0;
+            for (int t = 0; t < track->ncircuit_tables; ++t)
+                cached |= track->circuit_tables[t].circuit_bound == circuit_bounds[k];
+            for (int t = 0; t < nbounds; ++t)
+                cached |= bounds[t] == circuit_bounds[k];
+            if (!cached)
+                bounds[nbounds++] = circuit_bounds[k];
+        }
+        if (evicted || track->ncircuit_tables + nbounds <= TRACK_CIRCUIT_TABLES)
+            break;
+        track->ncircuit_tables = 0;
+    }
+    qsort(bounds, nbounds, sizeof(double), track_compare_circuit_bounds);
+
+    circuit_table_t *tables = track->circuit_tables + track->ncircuit_tables;
+    for (int t = 0; t < nbounds; ++t) {
+        tables[t].circuit_bound = bounds[t];
+        if (track->ntrkpts > tables[t].capacity) {
+            tables[t].last_finish = track_resize_table(tables[t].last_finish, track->ntrkpts * sizeof(int));
+            tables[t].best_start = track_resize_table(tables[t].best_start, track->ntrkpts * sizeof(int));
+            tables[t].capacity = track->ntrkpts;
+        }
+    }
+    if (nbounds) {
+        TRACK_STATS_BEGIN(track, TRACK_STATS_CIRCUIT_TABLES);
+#pragma omp parallel for schedule(dynamic, 64)
+        for (int i = 0; i < track->ntrkpts; ++i) {
+            int j = track->ntrkpts - 1;
+            for (int t = 0; t < nbounds; ++t) {
+                while (j > i) {
+                    double error = track_delta(track, i, j);
+                    if (error < bounds[t])
+                        break;
+                    j = track_fast_backward(track, j, error - bounds[t]);
+                }
+                if (j < i)
+                    j = i;
+                tables[t].last_finish[i] = j;
+            }
+        }
+#pragma omp parallel for schedule(static, 1)
+        for (int t = 0; t < nbounds; ++t) {
+            int best_start = 0;
+            for (int i = 0; i < track->ntrkpts; ++i) {
+                if (tables[t].last_finish[i] > tables[t].last_finish[best_start])
+                    best_start = i;
+                tables[t].best_start[i] = best_start;
             }
         }
-        if (track->last_finish[i] > track->last_finish[current_best_start])
-            current_best_start = i;
-        if (track->last_finish[current_best_start] < i) {
-            current_best_start = 0;
-            for (j = 1; j <= i; ++j)
-                if (track->last_finish[j] > track->last_finish[current_best_start])
-                    current_best_start = j;
+        track->ncircuit_tables += nbounds;
+        TRACK_STATS_END(track);
+    }
+
+    if (track->coarse && track->coarse->ntrkpts)
+        track_compute_circuit_tables(track->coarse, n, circuit_bounds);
+}
+
+/* Makes the tables for circuit_bound current, computing them if need be. */
+    static void
+track_select_circuit_tables(track_t *track, double circuit_bound)
+{
+    track_compute_circuit_tables(track, 1, &circuit_bound);
+    for (int t = 0; t < track->ncircuit_tables; ++t) {
+        if (track->circuit_tables[t].circuit_bound == circuit_bound) {
+            track->circuit_bound = circuit_bound;
+            track->last_finish = track->circuit_tables[t].last_finish;
+            track->best_start = track->circuit_tables[t].best_start;
         }
-        track->best_start[i] = current_best_start;
     }
+    if (track->coarse && track->coarse->ntrkpts)
+        track_select_circuit_tables(track->coarse, circuit_bound);
 }
 
     static inline const char *
@@ -333,7 +1083,7 @@ match_capture_until(const char *p, char c, char **result)
 {
     if (!p) return 0;
     const char *start = p;
-    while (*p && *p != c)
+    while (*p && *p != c && *p != '\n')
         ++p;
     if (!p) return 0;
     *result = alloc(p - start + 1);
@@ -346,59 +1096,62 @@ match_capture_until(const char *p, char c, char **result)
 match_until_eol(const char *p)
 {
     if (!p) return 0;
-    while (*p && *p != '\r')
+    while (*p && *p != '\r' && *p != '\n')
         ++p;
     if (*p != '\r') return 0;
     ++p;
     return *p == '\n' ? ++p : 0;
 }
 
+    static inline int
+match_digits(const char *p, int n)
+{
+    int result = 0;
+    for (; n > 0; --n)
+        result = 10 * result + *p++ - '0';
+    return result;
+}
+
+/* Matches a B record at fixed offsets.  The time of the fix is returned as
+ * seconds since midnight, the date is applied when the records are merged. */
     static const char *
-match_b_record(const char *p, struct tm *tm, trkpt_t *trkpt)
+match_b_record(const char *p, int *seconds, trkpt_t *trkpt)
 {
-    p = match_char(p, 'B');
-    if (!p) return 0;
+    static const char format[] = "B9999999999999N99999999EA9999999999";
+    for (int i = 0; format[i]; ++i) {
+        char c = p[i];
+        switch (format[i]) {
+            case '9':
+                if (c < '0' || '9' < c) return 0;
+                break;
+            case 'N':
+                if (c != 'N' && c != 'S') return 0;
+                break;
+            case 'E':
+                if (c != 'E' && c != 'W') return 0;
+                break;
+            case 'A':
+                if (c != 'A' && c != 'V') return 0;
+                break;
+            default:
+                if (c != format[i]) return 0;
+                break;
+        }
+    }
 
-    int hour = 0, min = 0, sec = 0;
-    p = match_unsigned(p, 2, &hour);
-    p = match_unsigned(p, 2, &min);
-    p = match_unsigned(p, 2, &sec);
+    int lat = 60000 * match_digits(p + 7, 2) + match_digits(p + 9, 5);
+    if (p[14] == 'S') lat *= -1;
+    int lon = 60000 * match_digits(p + 15, 3) + match_digits(p + 18, 5);
+    if (p[23] == 'W') lon *= -1;
+    char val = p[24];
+    int alt = match_digits(p + 25, 5);
+    int ele = match_digits(p + 30, 5);
+    int hour = match_digits(p + 1, 2), min = match_digits(p + 3, 2), sec = match_digits(p + 5, 2);
+
+    p = match_until_eol(p + sizeof format - 1);
     if (!p) return 0;
 
-    int lat_deg = 0, lat_mmin = 0;
-    char lat_hemi = 0;
-    p = match_unsigned(p, 2, &lat_deg);
-    p = match_unsigned(p, 5, &lat_mmin);
-    p = match_one_of(p, "NS", &lat_hemi);
-    int lat = 60000 * lat_deg + lat_mmin;
-    if (lat_hemi == 'S') lat *= -1;
-
-    int lon_deg = 0, lon_mmin = 0;
-    char lon_hemi = 0;
-    p = match_unsigned(p, 3, &lon_deg);
-    p = match_unsigned(p, 5, &lon_mmin);
-    p = match_one_of(p, "EW", &lon_hemi);
-    int lon = 60000 * lon_deg + lon_mmin;
-    if (lon_hemi == 'W') lon *= -1;
-
-    char val = 0;
-    p = match_one_of(p, "AV", &val);
-
-    int alt = 0, ele = 0;
-    p = match_unsigned(p, 5, &alt);
-    p = match_unsigned(p, 5, &ele);
-
-    p = match_until_eol(p);
-    if (!p) return 0;
-
-    tm->tm_hour = hour;
-    tm->tm_min = min;
-    tm->tm_sec = sec;
-    time_t time;
-    time = mktime(tm);
-    if (time == (time_t) -1)
-        DIE("mktime", errno);
-    trkpt->time = time;
+    *seconds = 3600 * hour + 60 * min + sec;
     trkpt->lat = lat;
     trkpt->lon = lon;
     trkpt->val = val;
@@ -446,8 +1199,25 @@ match_c_record(const char *p, wpt_t *wpt)
     return p;
 }
 
+/* Returns midnight UTC on the given date, normalising out of range months and
+ * days as mktime does. */
+    static time_t
+igc_date(int year, int mon, int mday)
+{
+    int m = mon - 1;
+    year += m >= 0 ? m / 12 : (m - 11) / 12;
+    m = (m % 12 + 12) % 12;
+    int y = m < 2 ? year - 1 : year;
+    int era = (y >= 0 ? y : y - 399) / 400;
+    int yoe = y - 400 * era;
+    int doy = (153 * ((m + 10) % 12) + 2) / 5;
+    int doe = 365 * yoe + yoe / 4 - yoe / 100 + doy;
+    long days = 146097L * era + doe - 719468 + mday - 1;
+    return (time_t) days * 86400;
+}
+
     static const char *
-match_hfdte_record(const char *p, struct tm *tm)
+match_hfdte_record(const char *p, time_t *date)
 {
     int mday = 0, mon = 0, year = 0;
     p = match_string(p, "HFDTE");
@@ -457,514 +1227,2304 @@ match_hfdte_record(const char *p, struct tm *tm)
     p = match_unsigned(p, 2, &year);
     p = match_string(p, "\r\n");
     if (!p) return 0;
-    tm->tm_year = year + 2000 - 1900;
-    tm->tm_mon = mon - 1;
-    tm->tm_mday = mday;
+    *date = igc_date(year + 2000, mon, mday);
     return p;
 }
 
-    static void
-track_push_trkpt(track_t *track, const trkpt_t *trkpt)
-{
-    if (track->ntrkpts == track->trkpts_capacity) {
-        track->trkpts_capacity = track->trkpts_capacity ? 2 * track->trkpts_capacity : 16384;
-        track->trkpts = realloc(track->trkpts, track->trkpts_capacity * sizeof(trkpt_t));
-        if (!track->trkpts)
-            DIE("realloc", errno);
-    }
-    track->trkpts[track->ntrkpts] = *trkpt;
-    ++track->ntrkpts;
-}
-
     static void
 track_push_task_wpt(track_t *track, const wpt_t *task_wpt)
 {
     if (track->ntask_wpts == track->task_wpts_capacity) {
-        track->task_wpts_capacity = track->task_wpts_capacity ? 2 * track->task_wpts_capacity : 16;
-        track->task_wpts = realloc(track->task_wpts, track->task_wpts_capacity * sizeof(wpt_t));
-        if (!track->task_wpts)
+        int capacity = track->task_wpts_capacity ? 2 * track->task_wpts_capacity : 16;
+        wpt_t *task_wpts = mem_realloc(track->task_wpts, capacity * sizeof(wpt_t));
+        if (!task_wpts)
             DIE("realloc", errno);
+        track->task_wpts = task_wpts;
+        track->task_wpts_capacity = capacity;
     }
     track->task_wpts[track->ntask_wpts] = *task_wpt;
     ++track->ntask_wpts;
 }
 
     track_t *
-track_new_from_igc(const char *filename, FILE *file)
+track_new(void)
 {
     track_t *track = alloc(sizeof(track_t));
-    track->filename = filename;
+#ifdef MAXXC_STATS
+    track->stats = alloc(sizeof(track_stats_t));
+#endif
+    return track;
+}
+
+    static void
+track_reset(track_t *track)
+{
+    track->ntrkpts = 0;
+    track->cancelled = 0;
+    for (int i = 0; i < track->ntask_wpts; ++i)
+        mem_free(track->task_wpts[i].name);
+    track->ntask_wpts = 0;
+    if (track->igc_mapping_size)
+        munmap((void *) track->igc, track->igc_mapping_size);
+    track->igc_mapping_size = 0;
+    track->igc = 0;
+    track->igc_size = 0;
+    if (track->binary) {
+        munmap(track->binary, track->binary_mapping_size);
+        track->binary = 0;
+        track->binary_mapping_size = 0;
+        track->trkpts = track->owned.trkpts;
+        track->x = track->owned.x;
+        track->y = track->owned.y;
+        track->z = track->owned.z;
+        track->sigma_delta = track->owned.sigma_delta;
+        track->before = track->owned.before;
+        track->after = track->owned.after;
+        track->caps = track->owned.caps;
+    }
+#ifdef MAXXC_STATS
+    if (track->stats)
+        memset(track->stats->phases, 0, sizeof track->stats->phases);
+#endif
+}
+
+#define IGC_CHUNK_SIZE 262144
+#define IGC_MAX_CHUNKS 256
+
+typedef struct {
+    int index;
+    time_t date;
+} igc_date_t;
+
+typedef struct {
+    const char *begin;
+    const char *end;
+    int ntrkpts;
+    int trkpts_capacity;
+    trkpt_t *trkpts;
+    int nwpts;
+    int wpts_capacity;
+    wpt_t *wpts;
+    int ndates;
+    int dates_capacity;
+    igc_date_t *dates;
+    int status;
+    char message[256];
+} igc_chunk_t;
+
+    static void *
+igc_chunk_grow(void *array, int n, int *capacity, int size, int initial_capacity)
+{
+    if (n == *capacity) {
+        int new_capacity = *capacity ? 2 * *capacity : initial_capacity;
+        void *resized = mem_realloc(array, new_capacity * size);
+        if (!resized)
+            DIE("realloc", errno);
+        array = resized;
+        *capacity = new_capacity;
+    }
+    return array;
+}
 
-    struct tm tm;
-    memset(&tm, 0, sizeof tm);
+    static void
+igc_chunk_parse(igc_chunk_t *chunk)
+{
     trkpt_t trkpt;
     memset(&trkpt, 0, sizeof trkpt);
     wpt_t wpt;
     memset(&wpt, 0, sizeof wpt);
-    char record[1024];
-    while (fgets(record, sizeof record, file)) {
-        int n = strlen(record);
-        if (track->igc_size + n > track->igc_capacity) {
-            track->igc_capacity = track->igc_capacity ? 2 * track->igc_capacity : 131072;
-            track->igc = realloc(track->igc, track->igc_capacity);
-            if (!track->igc)
-                DIE("realloc", errno);
-        }
-        memcpy(track->igc + track->igc_size, record, n);
-        track->igc_size += n;
+    time_t date;
+    for (const char *record = chunk->begin; record < chunk->end; ) {
+        int seconds;
         switch (record[0]) {
             case 'B':
-                if (match_b_record(record, &tm, &trkpt))
-                    track_push_trkpt(track, &trkpt);
+                if (match_b_record(record, &seconds, &trkpt)) {
+                    chunk->trkpts = igc_chunk_grow(chunk->trkpts, chunk->ntrkpts, &chunk->trkpts_capacity, sizeof(trkpt_t), 4096);
+                    trkpt.time = seconds;
+                    chunk->trkpts[chunk->ntrkpts++] = trkpt;
+                }
                 break;
             case 'C':
-                if (match_c_record(record, &wpt))
-                    track_push_task_wpt(track, &wpt);
+                if (match_c_record(record, &wpt)) {
+                    chunk->wpts = igc_chunk_grow(chunk->wpts, chunk->nwpts, &chunk->wpts_capacity, sizeof(wpt_t), 16);
+                    chunk->wpts[chunk->nwpts++] = wpt;
+                }
                 break;
             case 'H':
-                match_hfdte_record(record, &tm);
+                if (match_hfdte_record(record, &date)) {
+                    chunk->dates = igc_chunk_grow(chunk->dates, chunk->ndates, &chunk->dates_capacity, sizeof(igc_date_t), 4);
+                    chunk->dates[chunk->ndates].index = chunk->ntrkpts;
+                    chunk->dates[chunk->ndates].date = date;
+                    ++chunk->ndates;
+                }
+                break;
+        }
+        const char *eol = memchr(record, '\n', chunk->end - record);
+        record = eol ? eol + 1 : chunk->end;
+    }
+}
+
+/* Chunks are parsed by other threads, so their errors are caught here and
+ * raised again by the thread that is parsing the file. */
+    static void
+igc_chunk_parse_catch(igc_chunk_t *chunk)
+{
+    error_context_t context;
+    error_push(&context);
+    if (setjmp(context.env)) {
+        chunk->status = context.status;
+        memcpy(chunk->message, context.message, sizeof chunk->message);
+        return;
+    }
+    igc_chunk_parse(chunk);
+    error_pop(&context);
+}
+
+    static void
+igc_chunk_free(igc_chunk_t *chunk)
+{
+    mem_free(chunk->trkpts);
+    mem_free(chunk->wpts);
+    mem_free(chunk->dates);
+}
+
+/* Parses the records of an IGC file held in memory.  igc[size] must be a NUL
+ * so that the record matchers can never run off the end of the buffer.  Large
+ * files are split into record aligned chunks which are parsed in parallel.
+ * Fix times are then assigned in order, starting from midnight of the last
+ * HFDTE record and moving to the next day whenever the time of day wraps
+ * around. */
+    static void
+track_parse_igc(track_t *track, const char *igc, int size)
+{
+    int nchunks = size / IGC_CHUNK_SIZE + 1;
+    if (nchunks > IGC_MAX_CHUNKS)
+        nchunks = IGC_MAX_CHUNKS;
+    igc_chunk_t *chunks = alloc(nchunks * sizeof(igc_chunk_t));
+    for (int i = 0; i < nchunks; ++i) {
+        const char *begin = igc;
+        if (i) {
+            const char *split = igc + (long) i * size / nchunks - 1;
+            begin = memchr(split, '\n', igc + size - split);
+            begin = begin ? begin + 1 : igc + size;
+            if (begin < chunks[i - 1].begin)
+                begin = chunks[i - 1].begin;
+        }
+        chunks[i].begin = begin;
+        if (i)
+            chunks[i - 1].end = begin;
+    }
+    chunks[nchunks - 1].end = igc + size;
+
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < nchunks; ++i)
+        igc_chunk_parse_catch(chunks + i);
+    for (int i = 0; i < nchunks; ++i) {
+        if (chunks[i].status) {
+            int status = chunks[i].status;
+            char message[sizeof chunks[i].message];
+            memcpy(message, chunks[i].message, sizeof message);
+            for (int j = 0; j < nchunks; ++j) {
+                for (int k = 0; k < chunks[j].nwpts; ++k)
+                    mem_free(chunks[j].wpts[k].name);
+                igc_chunk_free(chunks + j);
+            }
+            mem_free(chunks);
+            error_raise(status, message);
+        }
+    }
+
+    int ntrkpts = 0;
+    for (int i = 0; i < nchunks; ++i)
+        ntrkpts += chunks[i].ntrkpts;
+    if (ntrkpts > track->trkpts_capacity) {
+        trkpt_t *trkpts = mem_realloc(track->trkpts, ntrkpts * sizeof(trkpt_t));
+        if (!trkpts)
+            DIE("realloc", errno);
+        track->trkpts = trkpts;
+        track->trkpts_capacity = ntrkpts;
+    }
+
+    time_t date = igc_date(1900, 1, 0);
+    time_t day = 0;
+    int last_seconds = -1;
+    for (int i = 0; i < nchunks; ++i) {
+        igc_chunk_t *chunk = chunks + i;
+        int d = 0;
+        for (int j = 0; j <= chunk->ntrkpts; ++j) {
+            for (; d < chunk->ndates && chunk->dates[d].index == j; ++d) {
+                date = chunk->dates[d].date;
+                day = 0;
+                last_seconds = -1;
+            }
+            if (j == chunk->ntrkpts)
                 break;
+            trkpt_t *trkpt = track->trkpts + track->ntrkpts++;
+            *trkpt = chunk->trkpts[j];
+            int seconds = trkpt->time;
+            if (last_seconds - seconds > 43200)
+                day += 86400;
+            last_seconds = seconds;
+            trkpt->time = date + day + seconds;
         }
+        for (int j = 0; j < chunk->nwpts; ++j)
+            track_push_task_wpt(track, chunk->wpts + j);
+        igc_chunk_free(chunk);
     }
+    mem_free(chunks);
+
     track_initialize(track);
+}
+
+    void
+track_read_igc(track_t *track, const char *filename, FILE *file)
+{
+    track_reset(track);
+    track->filename = filename;
+    int size = 0;
+    while (1) {
+        if (size + 1 >= track->igc_capacity) {
+            int capacity = track->igc_capacity ? 2 * track->igc_capacity : 131072;
+            char *igc_buffer = mem_realloc(track->igc_buffer, capacity);
+            if (!igc_buffer)
+                DIE("realloc", errno);
+            track->igc_buffer = igc_buffer;
+            track->igc_capacity = capacity;
+        }
+        size_t n = fread(track->igc_buffer + size, 1, track->igc_capacity - size - 1, file);
+        if (n == 0) {
+            if (ferror(file))
+                DIE("fread", errno);
+            break;
+        }
+        size += n;
+    }
+    track->igc_buffer[size] = '\0';
+    track->igc = track->igc_buffer;
+    track->igc_size = size;
+    track_parse_igc(track, track->igc, size);
+}
+
+/* Reads an IGC file that is already in memory and NUL terminated.  The track
+ * refers to the caller's bytes, which must outlive any use of track->igc. */
+    void
+track_read_igc_string(track_t *track, const char *filename, const char *igc, int size)
+{
+    track_reset(track);
+    track->filename = filename;
+    track->igc = igc;
+    track->igc_size = size;
+    track_parse_igc(track, igc, size);
+}
+
+/* A precompiled track file holds the fixes and task waypoints of a track
+ * together with the tables computed from them by track_initialize, so that
+ * it can be mapped and used in place without parsing or computation.  After
+ * a fixed header come sections aligned to TRACK_BINARY_ALIGNMENT: the
+ * trkpt_t array, the coordinate, sigma_delta, before and after tables, the
+ * cap tree, the task waypoints, their NUL terminated names and the original
+ * IGC file.  Everything is stored in the native byte order and layout, which
+ * the header records, so a file can only be read by a build that would have
+ * written it byte for byte.  Bump TRACK_BINARY_VERSION whenever the tables
+ * change meaning. */
+#define TRACK_BINARY_MAGIC "MAXXCTRK"
+#define TRACK_BINARY_VERSION 1
+#define TRACK_BINARY_BYTE_ORDER 0x01020304
+#define TRACK_BINARY_ALIGNMENT 64
+
+enum {
+    TRACK_BINARY_TRKPTS,
+    TRACK_BINARY_X,
+    TRACK_BINARY_Y,
+    TRACK_BINARY_Z,
+    TRACK_BINARY_SIGMA_DELTA,
+    TRACK_BINARY_BEFORE,
+    TRACK_BINARY_AFTER,
+    TRACK_BINARY_CAPS,
+    TRACK_BINARY_TASK_WPTS,
+    TRACK_BINARY_STRINGS,
+    TRACK_BINARY_IGC,
+    TRACK_BINARY_NSECTIONS
+};
+
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+} track_binary_section_t;
+
+typedef struct {
+    int64_t time;
+    int32_t lat;
+    int32_t lon;
+    int32_t val;
+    int32_t ele;
+    int32_t name;
+    int32_t pad;
+} track_binary_wpt_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t sizes[4];
+    int32_t ntrkpts;
+    int32_t ntask_wpts;
+    int32_t ncap_levels;
+    int32_t cap_offsets[32];
+    int32_t filename;
+    double max_delta;
+    track_binary_section_t sections[TRACK_BINARY_NSECTIONS];
+} track_binary_header_t;
+
+    static void
+track_binary_header_init(track_binary_header_t *header)
+{
+    memset(header, 0, sizeof *header);
+    memcpy(header->magic, TRACK_BINARY_MAGIC, sizeof header->magic);
+    header->version = TRACK_BINARY_VERSION;
+    header->byte_order = TRACK_BINARY_BYTE_ORDER;
+    header->sizes[0] = sizeof(trkpt_t);
+    header->sizes[1] = sizeof(limit_t);
+    header->sizes[2] = sizeof(cap_t);
+    header->sizes[3] = sizeof(track_binary_header_t);
+}
+
+    static int
+track_binary_ncaps(int ntrkpts, int ncap_levels, const int32_t *cap_offsets)
+{
+    return ntrkpts && ncap_levels ? cap_offsets[ncap_levels - 1] + 1 : 0;
+}
+
+    static uint64_t
+track_binary_align(uint64_t offset)
+{
+    return (offset + TRACK_BINARY_ALIGNMENT - 1) / TRACK_BINARY_ALIGNMENT * TRACK_BINARY_ALIGNMENT;
+}
+
+/* Writes track, whose tables must be initialized, as a precompiled track
+ * file.  The IGC file is included if the track still has it. */
+    void
+track_write_binary(const track_t *track, FILE *file)
+{
+    int n = track->ntrkpts;
+    track_binary_header_t header;
+    track_binary_header_init(&header);
+    header.ntrkpts = n;
+    header.ntask_wpts = track->ntask_wpts;
+    header.ncap_levels = n ? track->ncap_levels : 0;
+    for (int level = 0; level < header.ncap_levels; ++level)
+        header.cap_offsets[level] = track->cap_offsets[level];
+    header.max_delta = n ? track->max_delta : 0.0;
+
+    string_buffer_t *strings = string_buffer_new();
+    header.filename = -1;
+    if (track->filename) {
+        header.filename = strings->length;
+        string_buffer_append(strings, track->filename, strlen(track->filename) + 1);
+    }
+    track_binary_wpt_t *wpts = alloc((track->ntask_wpts ? track->ntask_wpts : 1) * sizeof(track_binary_wpt_t));
+    for (int i = 0; i < track->ntask_wpts; ++i) {
+        const wpt_t *wpt = track->task_wpts + i;
+        wpts[i].time = wpt->time;
+        wpts[i].lat = wpt->lat;
+        wpts[i].lon = wpt->lon;
+        wpts[i].val = wpt->val;
+        wpts[i].ele = wpt->ele;
+        wpts[i].name = -1;
+        if (wpt->name) {
+            wpts[i].name = strings->length;
+            string_buffer_append(strings, wpt->name, strlen(wpt->name) + 1);
+        }
+    }
+
+    const void *data[TRACK_BINARY_NSECTIONS] = {
+        track->trkpts, track->x, track->y, track->z, track->sigma_delta,
+        track->before, track->after, track->caps, wpts, strings->string, track->igc,
+    };
+    uint64_t sizes[TRACK_BINARY_NSECTIONS] = {
+        n * sizeof(trkpt_t), n * sizeof(double), n * sizeof(double), n * sizeof(double), n * sizeof(double),
+        n * sizeof(limit_t), n * sizeof(limit_t),
+        track_binary_ncaps(n, header.ncap_levels, header.cap_offsets) * sizeof(cap_t),
+        track->ntask_wpts * sizeof(track_binary_wpt_t), strings->length,
+        track->igc ? track->igc_size + 1 : 0,
+    };
+    uint64_t offset = track_binary_align(sizeof header);
+    for (int s = 0; s < TRACK_BINARY_NSECTIONS; ++s) {
+        header.sections[s].offset = offset;
+        header.sections[s].size = sizes[s];
+        offset = track_binary_align(offset + sizes[s]);
+    }
+
+    static const char zeros[TRACK_BINARY_ALIGNMENT];
+    uint64_t position = sizeof header;
+    int ok = fwrite(&header, sizeof header, 1, file) == 1;
+    for (int s = 0; s < TRACK_BINARY_NSECTIONS && ok; ++s) {
+        ok = fwrite(zeros, 1, header.sections[s].offset - position, file) == header.sections[s].offset - position;
+        if (ok && sizes[s] && s == TRACK_BINARY_IGC) {
+            ok = fwrite(data[s], 1, sizes[s] - 1, file) == sizes[s] - 1 && fputc(0, file) != EOF;
+        } else if (ok && sizes[s]) {
+            ok = fwrite(data[s], 1, sizes[s], file) == sizes[s];
+        }
+        position = header.sections[s].offset + sizes[s];
+    }
+    if (!ok)
+        DIE("fwrite", errno);
+    mem_free(wpts);
+    string_buffer_free(strings);
+}
+
+    static int
+track_binary_valid(const track_binary_header_t *header, size_t size)
+{
+    track_binary_header_t expected;
+    track_binary_header_init(&expected);
+    if (size < sizeof *header || memcmp(header, &expected, offsetof(track_binary_header_t, ntrkpts)))
+        return 0;
+    int n = header->ntrkpts;
+    if (n < 0 || header->ntask_wpts < 0)
+        return 0;
+    int cap_offsets[32];
+    if (header->ncap_levels != (n ? track_cap_layout(n, cap_offsets) : 0))
+        return 0;
+    for (int level = 0; level < header->ncap_levels; ++level)
+        if (header->cap_offsets[level] != cap_offsets[level])
+            return 0;
+    uint64_t sizes[TRACK_BINARY_NSECTIONS] = {
+        n * sizeof(trkpt_t), n * sizeof(double), n * sizeof(double), n * sizeof(double), n * sizeof(double),
+        n * sizeof(limit_t), n * sizeof(limit_t),
+        track_binary_ncaps(n, header->ncap_levels, header->cap_offsets) * sizeof(cap_t),
+        header->ntask_wpts * sizeof(track_binary_wpt_t),
+    };
+    for (int s = 0; s < TRACK_BINARY_NSECTIONS; ++s) {
+        const track_binary_section_t *section = header->sections + s;
+        if (section->offset % TRACK_BINARY_ALIGNMENT || section->offset > size || section->size > size - section->offset)
+            return 0;
+        if (s < TRACK_BINARY_STRINGS && section->size != sizes[s])
+            return 0;
+    }
+    const track_binary_section_t *strings = header->sections + TRACK_BINARY_STRINGS;
+    const char *base = (const char *) header;
+    if (strings->size && base[strings->offset + strings->size - 1])
+        return 0;
+    if (header->filename >= 0 && (uint64_t) header->filename >= strings->size)
+        return 0;
+    const track_binary_wpt_t *wpts = (const track_binary_wpt_t *) (base + header->sections[TRACK_BINARY_TASK_WPTS].offset);
+    for (int i = 0; i < header->ntask_wpts; ++i)
+        if (wpts[i].name >= 0 && (uint64_t) wpts[i].name >= strings->size)
+            return 0;
+    const track_binary_section_t *igc = header->sections + TRACK_BINARY_IGC;
+    if (igc->size && (igc->size - 1 >= INT_MAX || base[igc->offset + igc->size - 1]))
+        return 0;
+    const limit_t *before = (const limit_t *) (base + header->sections[TRACK_BINARY_BEFORE].offset);
+    const limit_t *after = (const limit_t *) (base + header->sections[TRACK_BINARY_AFTER].offset);
+    for (int i = 0; i < n; ++i)
+        if (before[i].index < 0 || before[i].index > i || after[i].index < i || after[i].index >= n)
+            return 0;
+    return 1;
+}
+
+/* Maps the precompiled track file open as fd and points the tables of track
+ * into the mapping, keeping the track's own buffers aside until it is reset.
+ * Only the task waypoints are copied.  Returns -1 with errno set to EINVAL
+ * if the file is not a valid precompiled track for this build. */
+    static int
+track_map_binary(track_t *track, const char *filename, int fd, size_t size, int keep_igc)
+{
+    void *binary = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (binary == MAP_FAILED)
+        DIE("mmap", errno);
+    const track_binary_header_t *header = binary;
+    if (!track_binary_valid(header, size)) {
+        munmap(binary, size);
+        errno = EINVAL;
+        return -1;
+    }
+    TRACK_STATS_BEGIN(track, TRACK_STATS_INITIALIZE);
+    const char *base = binary;
+    const track_binary_section_t *sections = header->sections;
+    track->binary = binary;
+    track->binary_mapping_size = size;
+    track->owned.trkpts = track->trkpts;
+    track->owned.x = track->x;
+    track->owned.y = track->y;
+    track->owned.z = track->z;
+    track->owned.sigma_delta = track->sigma_delta;
+    track->owned.before = track->before;
+    track->owned.after = track->after;
+    track->owned.caps = track->caps;
+    track->trkpts = (trkpt_t *) (base + sections[TRACK_BINARY_TRKPTS].offset);
+    track->x = (double *) (base + sections[TRACK_BINARY_X].offset);
+    track->y = (double *) (base + sections[TRACK_BINARY_Y].offset);
+    track->z = (double *) (base + sections[TRACK_BINARY_Z].offset);
+    track->sigma_delta = (double *) (base + sections[TRACK_BINARY_SIGMA_DELTA].offset);
+    track->before = (limit_t *) (base + sections[TRACK_BINARY_BEFORE].offset);
+    track->after = (limit_t *) (base + sections[TRACK_BINARY_AFTER].offset);
+    track->caps = (cap_t *) (base + sections[TRACK_BINARY_CAPS].offset);
+    track->ntrkpts = header->ntrkpts;
+    track->max_delta = header->max_delta;
+    track->ncap_levels = header->ncap_levels;
+    for (int level = 0; level < header->ncap_levels; ++level)
+        track->cap_offsets[level] = header->cap_offsets[level];
+
+    const char *strings = base + sections[TRACK_BINARY_STRINGS].offset;
+    track->filename = header->filename >= 0 ? strings + header->filename : filename;
+    const track_binary_wpt_t *wpts = (const track_binary_wpt_t *) (base + sections[TRACK_BINARY_TASK_WPTS].offset);
+    for (int i = 0; i < header->ntask_wpts; ++i) {
+        wpt_t wpt;
+        wpt.time = wpts[i].time;
+        wpt.lat = wpts[i].lat;
+        wpt.lon = wpts[i].lon;
+        wpt.val = wpts[i].val;
+        wpt.ele = wpts[i].ele;
+        wpt.name = 0;
+        if (wpts[i].name >= 0 && !(wpt.name = mem_strdup(strings + wpts[i].name)))
+            DIE("strdup", errno);
+        track_push_task_wpt(track, &wpt);
+    }
+    if (keep_igc && sections[TRACK_BINARY_IGC].size) {
+        track->igc = base + sections[TRACK_BINARY_IGC].offset;
+        track->igc_size = sections[TRACK_BINARY_IGC].size - 1;
+    }
+
+    if (track->coarse)
+        track->coarse->ntrkpts = 0;
+    track->ncircuit_tables = 0;
+    track_initialize_pyramid(track);
+    TRACK_STATS_END(track);
+    return 0;
+}
+
+/* Parses an IGC file directly from a private read-only mapping, keeping the
+ * mapping for embedding only if keep_igc is set.  Precompiled track files
+ * are recognised by their magic number and mapped instead.  The mapping is placed at
+ * the start of a larger anonymous reservation so that the byte after the end
+ * of the file is always a readable NUL, even when the file size is a multiple
+ * of the page size.  Returns -1 with errno set if path cannot be opened. */
+    int
+track_map_igc(track_t *track, const char *filename, const char *path, int keep_igc)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        int _errno = errno;
+        close(fd);
+        errno = _errno;
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size == 0 || st.st_size >= INT_MAX) {
+        FILE *file = fdopen(fd, "r");
+        if (!file)
+            DIE("fdopen", errno);
+        track_read_igc(track, filename, file);
+        fclose(file);
+        return 0;
+    }
+    track_reset(track);
+    char magic[sizeof TRACK_BINARY_MAGIC - 1];
+    if (pread(fd, magic, sizeof magic, 0) == (ssize_t) sizeof magic && !memcmp(magic, TRACK_BINARY_MAGIC, sizeof magic)) {
+        int result = track_map_binary(track, filename, fd, st.st_size, keep_igc);
+        int _errno = errno;
+        close(fd);
+        errno = _errno;
+        return result;
+    }
+    track->filename = filename;
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t mapping_size = (st.st_size / page_size + 1) * page_size;
+    void *reservation = mmap(0, mapping_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (reservation == MAP_FAILED)
+        DIE("mmap", errno);
+    void *igc = mmap(reservation, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+    if (igc == MAP_FAILED)
+        DIE("mmap", errno);
+    close(fd);
+    madvise(igc, st.st_size, MADV_SEQUENTIAL);
+    track_parse_igc(track, igc, st.st_size);
+    if (keep_igc) {
+        track->igc = igc;
+        track->igc_size = st.st_size;
+        track->igc_mapping_size = mapping_size;
+    } else {
+        munmap(reservation, mapping_size);
+    }
+    return 0;
+}
+
+    track_t *
+track_new_from_igc(const char *filename, FILE *file)
+{
+    track_t *track = track_new();
+    track_read_igc(track, filename, file);
     return track;
 }
 
+/* Frees everything but the options of a track, leaving it as if it were new.
+ * Used to recover a track that an error left half built. */
+    void
+track_clear(track_t *track)
+{
+    track_reset(track);
+#ifdef MAXXC_STATS
+    if (track->coarse)
+        track->coarse->stats = 0;
+    track_stats_t *stats = track->stats;
+#endif
+    track_delete(track->coarse);
+    mem_free(track->trkpts);
+    mem_free(track->task_wpts);
+    mem_aligned_free(track->x);
+    mem_aligned_free(track->y);
+    mem_aligned_free(track->z);
+    mem_free(track->sigma_delta);
+    mem_free(track->before);
+    mem_free(track->after);
+    for (int t = 0; t < TRACK_CIRCUIT_TABLES; ++t) {
+        mem_free(track->circuit_tables[t].best_start);
+        mem_free(track->circuit_tables[t].last_finish);
+    }
+    mem_free(track->filename_buffer);
+    mem_free(track->igc_buffer);
+    mem_free(track->window);
+    mem_free(track->caps);
+    int pyramid = track->pyramid;
+    double deadline = track->deadline;
+    memset(track, 0, sizeof *track);
+    track->pyramid = pyramid;
+    track->deadline = deadline;
+#ifdef MAXXC_STATS
+    track->stats = stats;
+#endif
+}
+
     void
 track_delete(track_t *track)
 {
     if (track) {
-        free(track->trkpts);
-        if (track->task_wpts) {
-            for (int i = 0; i < track->ntask_wpts; ++i)
-                free(track->task_wpts[i].name);
-            free(track->task_wpts);
+        track_clear(track);
+#ifdef MAXXC_STATS
+        track_stats_delete(track->stats);
+#endif
+        mem_free(track);
+    }
+}
+
+/* Returns whether the search should stop, because it was cancelled or its
+ * deadline has passed.  A coarse track is cancelled with the full track that
+ * it was decimated from.  The full track remembers in stopped that a search
+ * stopped early, even one on a coarse track. */
+__attribute__ ((nonnull(1)))
+    static inline int
+track_stopped(const track_t *track)
+{
+    const track_t *full = track;
+    int stopped = 0;
+    for (; full->fine; full = full->fine)
+        stopped |= full->cancelled;
+    stopped |= full->cancelled;
+    if (!stopped && track->deadline != 0.0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        stopped = now.tv_sec + now.tv_nsec / 1e9 >= track->deadline;
+    }
+    if (stopped)
+        ((track_t *) full)->stopped = 1;
+    return stopped;
+}
+
+    void
+track_set_deadline(track_t *track, double seconds)
+{
+    track->deadline = 0.0;
+    if (seconds > 0.0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        track->deadline = now.tv_sec + now.tv_nsec / 1e9 + seconds;
+    }
+}
+
+#define TRACK_BOUND_NODES 128
+
+/* Returns an upper bound on the length of any open route going on through
+ * turnpoints more turnpoints and its finish, for searches that were stopped
+ * before they could prove a better one.  maxima holds the longest route so
+ * far ending in each node of the cap tree, or is null for routes still to
+ * start.  The route is followed from node to node of the first level of the
+ * tree with at most TRACK_BOUND_NODES nodes, each leg no longer than the caps
+ * of its ends allow, and closed with the longest after of its last node. */
+__attribute__ ((nonnull(1)))
+    static double
+track_route_upper_bound(const track_t *track, const double *maxima, int turnpoints)
+{
+    int ncaps = track->cap_offsets[track->ncap_levels - 1] + 1;
+    int level = 0, nnodes = 0;
+    for (; ; ++level) {
+        nnodes = (level + 1 < track->ncap_levels ? track->cap_offsets[level + 1] : ncaps) - track->cap_offsets[level];
+        if (nnodes <= TRACK_BOUND_NODES)
+            break;
+    }
+    const cap_t *caps = track->caps + track->cap_offsets[level];
+    int size = TRACK_CAP_SIZE << level;
+    double current[TRACK_BOUND_NODES], next[TRACK_BOUND_NODES], after[TRACK_BOUND_NODES];
+    for (int a = 0; a < nnodes; ++a) {
+        current[a] = maxima ? maxima[track->cap_offsets[level] + a] : 0.0;
+        after[a] = 0.0;
+        int end = (a + 1) * size < track->ntrkpts ? (a + 1) * size : track->ntrkpts;
+        for (int i = a * size; i < end; ++i)
+            if (track->after[i].distance > after[a])
+                after[a] = track->after[i].distance;
+    }
+    for (int t = 0; t < turnpoints; ++t) {
+        for (int b = 0; b < nnodes; ++b) {
+            next[b] = -INFINITY;
+            for (int a = 0; a <= b; ++a) {
+                double d = current[a] + coord_delta(&caps[a].centre, &caps[b].centre) + caps[a].radius + caps[b].radius;
+                if (d > next[b])
+                    next[b] = d;
+            }
         }
-        free(track->coords);
-        free(track->sigma_delta);
-        free(track->before);
-        free(track->after);
-        free(track->best_start);
-        free(track->last_finish);
-        free(track->igc);
-        free(track);
+        memcpy(current, next, nnodes * sizeof(double));
     }
+    double ub = 0.0;
+    for (int b = 0; b < nnodes; ++b)
+        if (current[b] + after[b] > ub)
+            ub = current[b] + after[b];
+    return ub;
+}
+
+/* The best distance found so far by any thread.  Threads read it without
+ * locking to prune their searches and only ever raise it. */
+__attribute__ ((nonnull(1)))
+    static inline double
+track_bound_load(const double *bound)
+{
+    double value;
+    __atomic_load(bound, &value, __ATOMIC_RELAXED);
+    return value;
+}
+
+__attribute__ ((nonnull(1)))
+    static inline void
+track_bound_raise(double *bound, double value)
+{
+    double current = track_bound_load(bound);
+    while (value > current && !__atomic_compare_exchange(bound, &current, &value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
 }
 
     static double
-track_open_distance(const track_t *track, double bound, int *indexes)
+track_open_distance(const track_t *track, double bound, int *indexes, double *upper_bound)
 {
+    TRACK_STATS_BEGIN(track, TRACK_STATS_OPEN_DISTANCE);
     indexes[0] = indexes[1] = -1;
     for (int start = 0; start < track->ntrkpts - 1; ++start) {
+        if (track_stopped(track)) {
+            *upper_bound = track_route_upper_bound(track, 0, 0);
+            break;
+        }
         int finish = track_furthest_from(track, start, start + 1, track->ntrkpts, bound, &bound);
         if (finish != -1) {
+            TRACK_STATS_ADD(track, improvements, 1);
             indexes[0] = start;
             indexes[1] = finish;
         }
     }
+    TRACK_STATS_END(track);
     return bound;
 }
 
+/* Returns whether the turnpoints of route a come before those of route b in
+ * the order of the serial search, which keeps the first of equally long
+ * routes. */
+__attribute__ ((nonnull(1, 2)))
+    static inline int
+track_route_earlier(const int *a, const int *b, int n)
+{
+    for (int i = 1; i < n - 1; ++i)
+        if (a[i] != b[i])
+            return a[i] < b[i];
+    return 0;
+}
+
+/* Records route in best if it is longer than best, or as long and earlier. */
+__attribute__ ((nonnull(1, 3, 4)))
+    static inline void
+track_route_keep(double *best, double distance, int *best_indexes, const int *route, int n)
+{
+    if (best_indexes[0] == -1 || distance > *best || (distance == *best && track_route_earlier(route, best_indexes, n))) {
+        *best = distance;
+        memcpy(best_indexes, route, n * sizeof(int));
+    }
+}
+
+#define TRACK_DP_CHUNK 256
+
+/* Returns the last fix before the largest node containing fix i in which no
+ * fix i' has value[i'] plus its distance to coord at least bound, or i if
+ * there is none.  maxima holds the greatest value in each node. */
+__attribute__ ((nonnull(1, 2, 3))) __attribute__ ((pure))
+    static inline int
+track_cap_skip_low_backward(const track_t *track, const double *maxima, const coord_t *coord, int i, double bound)
+{
+    int next = i;
+    for (int level = 0; level < track->ncap_levels; ++level) {
+        const cap_t *cap = track_cap(track, level, i);
+        if (maxima[cap - track->caps] + coord_delta(coord, &cap->centre) + cap->radius >= bound)
+            break;
+        next = (i / TRACK_CAP_SIZE >> level) * (TRACK_CAP_SIZE << level) - 1;
+    }
+    return next;
+}
+
+/* Returns the first fix after the largest node containing fix i in which no
+ * fix i' has value[i'] plus its distance to coord greater than bound, or i if
+ * there is none. */
+__attribute__ ((nonnull(1, 2, 3))) __attribute__ ((pure))
+    static inline int
+track_cap_skip_low(const track_t *track, const double *maxima, const coord_t *coord, int i, double bound)
+{
+    int next = i;
+    for (int level = 0; level < track->ncap_levels; ++level) {
+        const cap_t *cap = track_cap(track, level, i);
+        if (maxima[cap - track->caps] + coord_delta(coord, &cap->centre) + cap->radius > bound)
+            break;
+        next = ((i / TRACK_CAP_SIZE >> level) + 1) * (TRACK_CAP_SIZE << level);
+    }
+    return next;
+}
+
+__attribute__ ((nonnull(1, 2, 3)))
+    static void
+track_compute_maxima(const track_t *track, const double *value, double *maxima)
+{
+    int nleaves = track->ncap_levels > 1 ? track->cap_offsets[1] : 1;
+    for (int m = 0; m < nleaves; ++m) {
+        maxima[m] = -INFINITY;
+        int end = (m + 1) * TRACK_CAP_SIZE < track->ntrkpts ? (m + 1) * TRACK_CAP_SIZE : track->ntrkpts;
+        for (int i = m * TRACK_CAP_SIZE; i < end; ++i)
+            if (value[i] > maxima[m])
+                maxima[m] = value[i];
+    }
+    for (int level = 1; level < track->ncap_levels; ++level) {
+        const double *children = maxima + track->cap_offsets[level - 1];
+        int nchildren = track->cap_offsets[level] - track->cap_offsets[level - 1];
+        double *nodes = maxima + track->cap_offsets[level];
+        for (int m = 0; 2 * m < nchildren; ++m)
+            nodes[m] = 2 * m + 1 < nchildren && children[2 * m + 1] > children[2 * m] ? children[2 * m + 1] : children[2 * m];
+    }
+}
+
+/* Finds the longest open distance through k turnpoints by dynamic
+ * programming over the turnpoints.  Layer m holds, for each fix, the longest
+ * route from any start through m turnpoints ending there, and where it came
+ * from.  The first layer is the before table and the last is closed with the
+ * after table.  Each layer is 1-Lipschitz going backwards along the track, so
+ * a backwards scan over the previous layer can skip fixes that are too close
+ * to lift their value to the best found so far, and whole caps whose largest
+ * value is too small.  The last layer is only computed where it can still
+ * beat the best route found so far.  Of equally long routes the one with the
+ * earliest turnpoints, last first, is kept. */
     static double
-track_open_distance1(const track_t *track, double bound, int *indexes)
+track_open_distance_k(const track_t *track, int k, double bound, int *indexes, double *upper_bound)
 {
-    indexes[0] = indexes[1] = indexes[2] = -1;
-    for (int tp1 = 1; tp1 < track->ntrkpts - 1; ) {
-        double total = track->before[tp1].distance + track->after[tp1].distance;
+    for (int m = 0; m < k + 2; ++m)
+        indexes[m] = -1;
+    int n = track->ntrkpts;
+    if (n < k + 2)
+        return bound;
+    int ncaps = track->cap_offsets[track->ncap_levels - 1] + 1;
+    double *value = alloc(k * n * sizeof(double));
+    int *from = alloc(k * n * sizeof(int));
+    double *maxima = alloc(ncaps * sizeof(double));
+    double shared_bound = bound;
+    double skipped = -INFINITY;
+
+    /* Turnpoint m, counting from one, can only be one of the fixes in
+     * [m, n - 2 - k + m]. */
+    for (int j = 0; j < n; ++j) {
+        value[j] = 1 <= j && j <= n - 1 - k && !track_outside_window(track, j) ? track->before[j].distance : -INFINITY;
+        from[j] = track->before[j].index;
+    }
+    for (int m = 2; m <= k; ++m) {
+        const double *previous = value + (m - 2) * n;
+        double *current = value + (m - 1) * n;
+        int *current_from = from + (m - 1) * n;
+        int lo = m - 1, hi = n - 2 - k + m;
+        track_compute_maxima(track, previous, maxima);
+        for (int j = 0; j < n; ++j) {
+            current[j] = -INFINITY;
+            current_from[j] = -1;
+        }
+        int nchunks = (hi - m) / TRACK_DP_CHUNK + 1;
+        int stopped = 0;
+#pragma omp parallel for schedule(dynamic, 1) reduction(|:stopped)
+        for (int c = 0; c < nchunks; ++c) {
+            if (track_stopped(track)) {
+                stopped = 1;
+                continue;
+            }
+            int first = m + c * TRACK_DP_CHUNK;
+            int last = first + TRACK_DP_CHUNK - 1 < hi ? first + TRACK_DP_CHUNK - 1 : hi;
+            for (int j = first; j <= last; ++j) {
+                track_row_t row;
+                track_row_init(track, &row, j);
+                double best = m == k ? nextafter(track_bound_load(&shared_bound) - track->after[j].distance, -INFINITY) : -INFINITY;
+                int arg = -1;
+                if (j > first && current_from[j - 1] >= 0) {
+                    double seed = previous[current_from[j - 1]] + track_delta(track, current_from[j - 1], j);
+                    if (seed > best) {
+                        best = seed;
+                        arg = current_from[j - 1];
+                    }
+                }
+                for (int i = j - 1, leaf = -1; i >= lo; ) {
+                    if (i / TRACK_CAP_SIZE != leaf) {
+                        int next = track_cap_skip_low_backward(track, maxima, &row.coord, i, best);
+                        if (next != i) {
+                            i = next;
+                            continue;
+                        }
+                        leaf = i / TRACK_CAP_SIZE;
+                    }
+                    double d = previous[i] + track_row_backward(track, &row, i, lo);
+                    if (d > best || (d == best && i < arg)) {
+                        best = d;
+                        arg = i;
+                        --i;
+                    } else if (d == best || isinf(d)) {
+                        --i;
+                    } else {
+                        i = track_fast_backward(track, i, 0.5 * (best - d));
+                    }
+                }
+                if (arg == -1)
+                    continue;
+                current[j] = best;
+                current_from[j] = arg;
+                if (m == k) {
+                    TRACK_STATS_ADD(track, improvements, best + track->after[j].distance > track_bound_load(&shared_bound));
+                    track_bound_raise(&shared_bound, best + track->after[j].distance);
+                }
+            }
+        }
+        if (stopped && skipped == -INFINITY)
+            skipped = track_route_upper_bound(track, maxima, k + 1 - m);
+    }
+
+    const double *last = value + (k - 1) * n;
+    int tpk = -1;
+    for (int j = k; j <= n - 2; ++j) {
+        double total = last[j] + track->after[j].distance;
         if (total > bound) {
-            indexes[0] = track->before[tp1].index;
-            indexes[1] = tp1;
-            indexes[2] = track->after[tp1].index;
             bound = total;
-            ++tp1;
-        } else {
-            tp1 = track_fast_forward(track, tp1, 0.5 * (bound - total));
+            tpk = j;
         }
     }
+    if (tpk != -1) {
+        indexes[k] = tpk;
+        indexes[k + 1] = track->after[tpk].index;
+        for (int m = k; m > 1; --m)
+            indexes[m - 1] = from[(m - 1) * n + indexes[m]];
+        indexes[0] = from[indexes[1]];
+    }
+    if (skipped > -INFINITY)
+        *upper_bound = skipped > bound ? skipped : bound;
+    mem_free(maxima);
+    mem_free(from);
+    mem_free(value);
     return bound;
 }
 
     static double
-track_open_distance2(const track_t *track, double bound, int *indexes)
+track_open_distance1(const track_t *track, double bound, int *indexes, double *upper_bound)
 {
-    indexes[0] = indexes[1] = indexes[2] = indexes[3] = -1;
-#pragma omp parallel for schedule(dynamic)
-    for (int tp1 = 1; tp1 < track->ntrkpts - 2; ++tp1) {
-        double leg1 = track->before[tp1].distance;
-        for (int tp2 = tp1 + 1; tp2 < track->ntrkpts - 1; ) {
-            double distance = leg1 + track_delta(track, tp1, tp2) + track->after[tp2].distance;
-            int new_bound = 0;
-#pragma omp critical
-            if (distance > bound) {
-                new_bound = 1;
-                bound = distance;
-                indexes[0] = track->before[tp1].index;
-                indexes[1] = tp1;
-                indexes[2] = tp2;
-                indexes[3] = track->after[tp2].index;
-            }
-            if (new_bound)
-                ++tp2;
-            else
-                tp2 = track_fast_forward(track, tp2, 0.5 * (bound - distance));
-        }
-    }
+    TRACK_STATS_BEGIN(track, TRACK_STATS_OPEN_DISTANCE1);
+    bound = track_open_distance_k(track, 1, bound, indexes, upper_bound);
+    TRACK_STATS_END(track);
     return bound;
 }
 
     static double
-track_open_distance3(const track_t *track, double bound, int *indexes)
+track_open_distance2(const track_t *track, double bound, int *indexes, double *upper_bound)
 {
-    indexes[0] = indexes[1] = indexes[2] = indexes[3] = indexes[4] = -1;
-#pragma omp parallel for schedule(dynamic)
-    for (int tp1 = 1; tp1 < track->ntrkpts - 3; ++tp1) {
-        double leg1 = track->before[tp1].distance;
-        for (int tp2 = tp1 + 1; tp2 < track->ntrkpts - 2; ++tp2) {
-            double leg2 = track_delta(track, tp1, tp2);
-            for (int tp3 = tp2 + 1; tp3 < track->ntrkpts - 1; ) {
-                double distance = leg1 + leg2 + track_delta(track, tp2, tp3) + track->after[tp3].distance;
-                int new_bound = 0;
-#pragma omp critical
-                if (distance > bound) {
-                    new_bound = 1;
-                    bound = distance;
-                    indexes[0] = track->before[tp1].index;
-                    indexes[1] = tp1;
-                    indexes[2] = tp2;
-                    indexes[3] = tp3;
-                    indexes[4] = track->after[tp3].index;
-                }
-                if (new_bound)
-                    ++tp3;
-                else
-                    tp3 = track_fast_forward(track, tp3, 0.5 * (bound - distance));
+    TRACK_STATS_BEGIN(track, TRACK_STATS_OPEN_DISTANCE2);
+    bound = track_open_distance_k(track, 2, bound, indexes, upper_bound);
+    TRACK_STATS_END(track);
+    return bound;
+}
+
+    static double
+track_open_distance3(const track_t *track, double bound, int *indexes, double *upper_bound)
+{
+    TRACK_STATS_BEGIN(track, TRACK_STATS_OPEN_DISTANCE3);
+    bound = track_open_distance_k(track, 3, bound, indexes, upper_bound);
+    TRACK_STATS_END(track);
+    return bound;
+}
+
+/* Returns the greatest value[j] plus the distance from fix i to j over the
+ * fixes j after i, or bound if none is greater.  Caps whose largest value
+ * cannot beat the best so far are skipped, as are fixes too close to it, value
+ * being 1-Lipschitz going forwards along the track.  maxima holds the greatest
+ * value in each node. */
+__attribute__ ((nonnull(1, 2, 3)))
+    static double
+track_longest_after(const track_t *track, const double *value, const double *maxima, int i, double bound)
+{
+    track_row_t row;
+    track_row_init(track, &row, i);
+    for (int j = i + 1, leaf = -1; j < track->ntrkpts; ) {
+        if (j / TRACK_CAP_SIZE != leaf) {
+            int next = track_cap_skip_low(track, maxima, &row.coord, j, bound);
+            if (next != j) {
+                j = next;
+                continue;
             }
+            leaf = j / TRACK_CAP_SIZE;
+        }
+        double d = value[j] + track_row_forward(track, &row, j, track->ntrkpts);
+        if (d > bound) {
+            bound = d;
+            ++j;
+        } else {
+            j = track_fast_forward(track, j, 0.5 * (bound - d));
         }
     }
     return bound;
 }
 
+/* Marks the coarse fixes s from which some route with TP1 at s, allowing
+ * repeated turnpoints, is longer than bound less the error of its four legs.
+ * The longest last two legs from each TP2 are found first, so that each s
+ * needs a single scan over TP2.  No first two legs to TP2 are longer than
+ * before[TP2] plus the longest before up to TP2, so last two legs shorter
+ * than bound less these cannot mark any s and are not looked for. */
+    static void
+track_open_distance3_window(const track_t *coarse, double bound, double error, unsigned char *window)
+{
+    bound -= 8.0 * error;
+    int n = coarse->ntrkpts;
+    int ncaps = coarse->cap_offsets[coarse->ncap_levels - 1] + 1;
+    double *after = alloc(n * sizeof(double));
+    double *tail = alloc(n * sizeof(double));
+    double *maxima = alloc(ncaps * sizeof(double));
+    double max_before = 0.0;
+    for (int i = 0; i < n; ++i) {
+        after[i] = coarse->after[i].distance;
+        if (coarse->before[i].distance > max_before)
+            max_before = coarse->before[i].distance;
+        tail[i] = bound - max_before - coarse->before[i].distance;
+    }
+    track_compute_maxima(coarse, after, maxima);
+#pragma omp parallel for schedule(dynamic)
+    for (int tp2 = 0; tp2 < n; ++tp2)
+        tail[tp2] = track_longest_after(coarse, after, maxima, tp2, after[tp2] > tail[tp2] ? after[tp2] : tail[tp2]);
+    track_compute_maxima(coarse, tail, maxima);
+#pragma omp parallel for schedule(dynamic)
+    for (int s = 0; s < n; ++s) {
+        double target = bound - coarse->before[s].distance;
+        window[s] = tail[s] > target || track_longest_after(coarse, tail, maxima, s, target) > target;
+    }
+    mem_free(maxima);
+    mem_free(tail);
+    mem_free(after);
+}
+
     static double
-track_frcfd_aller_retour(const track_t *track, double bound, int *indexes)
+track_frcfd_aller_retour(const track_t *track, double bound, int *indexes, double *upper_bound)
 {
+    TRACK_STATS_BEGIN(track, TRACK_STATS_ALLER_RETOUR);
     bound /= 2.0;
     indexes[0] = indexes[1] = indexes[2] = indexes[3] = -1;
-#pragma omp parallel for schedule(dynamic)
-    for (int tp1 = 0; tp1 < track->ntrkpts - 2; ++tp1) {
-        int start = track->best_start[tp1];
-        int finish = track->last_finish[start];
-        if (finish < 0)
-            continue;
-        double distance = 0.0;
-        double local_bound;
-#pragma omp critical
-        local_bound = bound;
-        int tp2 = track_furthest_from(track, tp1, tp1 + 1, finish + 1, local_bound, &distance);
-        if (tp2 >= 0) {
-#pragma omp critical
-            if (distance > bound) {
-                bound = distance;
-                indexes[0] = start;
-                indexes[1] = tp1;
-                indexes[2] = tp2;
-                indexes[3] = finish;
+    double shared_bound = bound;
+    double skipped = -INFINITY;
+#pragma omp parallel reduction(max:skipped)
+    {
+        double best = 0.0;
+        int best_indexes[4] = { -1, -1, -1, -1 };
+#pragma omp for schedule(dynamic)
+        for (int tp1 = 0; tp1 < track->ntrkpts - 1; ++tp1) {
+            if (track_stopped(track)) {
+                if (track->after[tp1].distance > skipped)
+                    skipped = track->after[tp1].distance;
+                continue;
+            }
+            int start = track->best_start[tp1];
+            int finish = track->last_finish[start];
+            if (finish < 0)
+                continue;
+            /* Turnpoints as far as the shared bound are still wanted, as they
+             * win ties against those found later by other threads. */
+            double current_bound = track_bound_load(&shared_bound);
+            double local_bound = current_bound > bound ? nextafter(current_bound, -INFINITY) : bound;
+            double distance = 0.0;
+            int tp2 = track_furthest_from(track, tp1, tp1 + 1, finish + 1, local_bound, &distance);
+            if (tp2 >= 0) {
+                int route[4] = { start, tp1, tp2, finish };
+                track_route_keep(&best, distance, best_indexes, route, 4);
+                TRACK_STATS_ADD(track, improvements, 1);
+                track_bound_raise(&shared_bound, distance);
             }
         }
+#pragma omp critical
+        if (best_indexes[0] != -1)
+            track_route_keep(&bound, best, indexes, best_indexes, 4);
     }
+    if (skipped > -INFINITY)
+        *upper_bound = 2.0 * (skipped > bound ? skipped : bound);
+    TRACK_STATS_END(track);
     return 2.0 * bound;
 }
 
+    static int
+track_compare_limits(const void *a, const void *b)
+{
+    const limit_t *limit_a = a, *limit_b = b;
+    if (limit_a->distance != limit_b->distance)
+        return limit_a->distance > limit_b->distance ? -1 : 1;
+    return limit_a->index - limit_b->index;
+}
+
+/* Returns the first n fixes as TP1 of an FAI triangle, each with an upper
+ * bound on the perimeter of its triangles, in decreasing order of that bound
+ * so that good triangles are found early.  No leg is longer than the distance
+ * flown from TP1 to the last possible TP3, and the first leg, which is at
+ * least 0.28 of the perimeter, is no longer than after[TP1]. */
+    static limit_t *
+track_triangle_order(const track_t *track, int n)
+{
+    limit_t *order = alloc((n > 0 ? n : 1) * sizeof(limit_t));
+#pragma omp parallel for schedule(static)
+    for (int tp1 = 0; tp1 < n; ++tp1) {
+        int finish = track->last_finish[track->best_start[tp1]];
+        order[tp1].index = tp1;
+        double flown = 2.0 * (track->sigma_delta[finish] - track->sigma_delta[tp1]);
+        double fai = track->after[tp1].distance / 0.28;
+        order[tp1].distance = flown < fai ? flown : fai;
+    }
+    qsort(order, n, sizeof(limit_t), track_compare_limits);
+    return order;
+}
+
+/* Returns whether the FAI triangle (tp1, tp2, tp3) comes after the triangle
+ * in indexes in the order of the serial search, which visits tp1 upwards, tp3
+ * downwards and tp2 upwards and keeps the last of equally long triangles. */
+__attribute__ ((nonnull(1)))
+    static inline int
+track_frcfd_triangle_fai_later(const int *indexes, int tp1, int tp2, int tp3)
+{
+    if (tp1 != indexes[1])
+        return tp1 > indexes[1];
+    if (tp3 != indexes[3])
+        return tp3 < indexes[3];
+    return tp2 > indexes[2];
+}
+
     static double
-track_frcfd_triangle_fai(const track_t *track, double bound, int *indexes)
+track_frcfd_triangle_fai(const track_t *track, double bound, int *indexes, double *upper_bound)
 {
+    TRACK_STATS_BEGIN(track, TRACK_STATS_TRIANGLE_FAI);
     indexes[0] = indexes[1] = indexes[2] = indexes[3] = indexes[4] = -1;
-    double legbound = 0.28 * bound;
-    int tp1;
-    for (tp1 = 0; tp1 < track->ntrkpts - 2; ++tp1) {
-        int start = track->best_start[tp1];
-        int finish = track->last_finish[start];
-        if (finish < 0)
-            continue;
-        int tp3first = track_first_at_least(track, tp1, tp1 + 2, finish + 1, legbound);
-        if (tp3first < 0)
-            continue;
-        int tp3last = track_last_at_least(track, tp1, tp3first, finish + 1, legbound);
-        if (tp3last < 0)
-            continue;
-        int tp3;
-        for (tp3 = tp3last; tp3 >= tp3first; ) {
-            double leg3 = track_delta(track, tp3, tp1);
-            if (leg3 < legbound) {
-                tp3 = track_fast_backward(track, tp3, legbound - leg3);
+    int norder = track->ntrkpts - 2 > 0 ? track->ntrkpts - 2 : 0;
+    limit_t *order = track_triangle_order(track, norder);
+    double shared_bound = bound;
+    double skipped = -INFINITY;
+#pragma omp parallel reduction(max:skipped)
+    {
+        double best = 0.0;
+        int best_indexes[5] = { -1, -1, -1, -1, -1 };
+#pragma omp for schedule(dynamic)
+        for (int o = 0; o < norder; ++o) {
+            int tp1 = order[o].index;
+            if (order[o].distance < track_bound_load(&shared_bound) || track_outside_window(track, tp1))
                 continue;
-            }
-            double shortestlegbound = 0.28 * leg3 / 0.44;
-            int tp2first = track_first_at_least(track, tp1, tp1 + 1, tp3 - 1, shortestlegbound);
-            if (tp2first < 0) {
-                --tp3;
+            if (track_stopped(track)) {
+                if (order[o].distance > skipped)
+                    skipped = order[o].distance;
                 continue;
             }
-            int tp2last = track_last_at_least(track, tp3, tp2first, tp3, shortestlegbound);
-            if (tp2last < 0) {
-                --tp3;
+            int start = track->best_start[tp1];
+            int finish = track->last_finish[start];
+            if (finish < 0)
                 continue;
-            }
-            double longestlegbound = 0.44 * leg3 / 0.28;
-            int tp2;
-            for (tp2 = tp2first; tp2 <= tp2last; ) {
-                double d = 0.0;
-                double leg1 = track_delta(track, tp1, tp2);
-                if (leg1 < shortestlegbound)
-                    d = shortestlegbound - leg1;
-                if (leg1 > longestlegbound && leg1 - longestlegbound > d)
-                    d = leg1 - longestlegbound;
-                double leg2 = track_delta(track, tp2, tp3);
-                if (leg2 < shortestlegbound && shortestlegbound - leg2 > d)
-                    d = shortestlegbound - leg2;
-                if (leg2 > longestlegbound && leg2 - longestlegbound > d)
-                    d = leg2 - longestlegbound;
-                if (d > 0.0) {
-                    tp2 = track_fast_forward(track, tp2, d);
+            double legbound = 0.28 * track_bound_load(&shared_bound);
+            int tp3first = track_first_at_least(track, tp1, tp1 + 2, finish + 1, legbound);
+            if (tp3first < 0)
+                continue;
+            int tp3last = track_last_at_least(track, tp1, tp3first, finish + 1, legbound);
+            if (tp3last < 0)
+                continue;
+            for (int tp3 = tp3last; tp3 >= tp3first; ) {
+                legbound = 0.28 * track_bound_load(&shared_bound);
+                double leg3 = track_delta(track, tp3, tp1);
+                if (leg3 < legbound) {
+                    tp3 = track_fast_backward(track, tp3, legbound - leg3);
                     continue;
                 }
-                double total = leg1 + leg2 + leg3;
-                double thislegbound = 0.28 * total;
-                if (leg1 < thislegbound)
-                    d = thislegbound - leg1;
-                if (leg2 < thislegbound && thislegbound - leg2 > d)
-                    d = thislegbound - leg2;
-                if (leg3 < thislegbound && thislegbound - leg3 > d)
-                    d = thislegbound - leg3;
-                if (d > 0.0) {
-                    tp2 = track_fast_forward(track, tp2, 0.5 * d);
+                double shortestlegbound = 0.28 * leg3 / 0.44;
+                int tp2first = track_first_at_least(track, tp1, tp1 + 1, tp3 - 1, shortestlegbound);
+                if (tp2first < 0) {
+                    --tp3;
                     continue;
                 }
-                if (total < bound) {
-                    tp2 = track_fast_forward(track, tp2, 0.5 * (bound - total));
+                int tp2last = track_last_at_least(track, tp3, tp2first, tp3, shortestlegbound);
+                if (tp2last < 0) {
+                    --tp3;
                     continue;
                 }
-                bound = total;
-                legbound = thislegbound;
-                indexes[0] = start;
-                indexes[1] = tp1;
-                indexes[2] = tp2;
-                indexes[3] = tp3;
-                indexes[4] = finish;
-                ++tp2;
+                double longestlegbound = 0.44 * leg3 / 0.28;
+                for (int tp2 = tp2first; tp2 <= tp2last; ) {
+                    double d = 0.0;
+                    double leg1 = track_delta(track, tp1, tp2);
+                    if (leg1 < shortestlegbound)
+                        d = shortestlegbound - leg1;
+                    if (leg1 > longestlegbound && leg1 - longestlegbound > d)
+                        d = leg1 - longestlegbound;
+                    double leg2 = track_delta(track, tp2, tp3);
+                    if (leg2 < shortestlegbound && shortestlegbound - leg2 > d)
+                        d = shortestlegbound - leg2;
+                    if (leg2 > longestlegbound && leg2 - longestlegbound > d)
+                        d = leg2 - longestlegbound;
+                    if (d > 0.0) {
+                        tp2 = track_fast_forward(track, tp2, d);
+                        continue;
+                    }
+                    double total = leg1 + leg2 + leg3;
+                    double thislegbound = 0.28 * total;
+                    if (leg1 < thislegbound)
+                        d = thislegbound - leg1;
+                    if (leg2 < thislegbound && thislegbound - leg2 > d)
+                        d = thislegbound - leg2;
+                    if (leg3 < thislegbound && thislegbound - leg3 > d)
+                        d = thislegbound - leg3;
+                    if (d > 0.0) {
+                        tp2 = track_fast_forward(track, tp2, 0.5 * d);
+                        continue;
+                    }
+                    double current_bound = track_bound_load(&shared_bound);
+                    if (total < current_bound) {
+                        tp2 = track_fast_forward(track, tp2, 0.5 * (current_bound - total));
+                        continue;
+                    }
+                    if (best_indexes[0] == -1 || total > best || (total == best && track_frcfd_triangle_fai_later(best_indexes, tp1, tp2, tp3))) {
+                        best = total;
+                        best_indexes[0] = start;
+                        best_indexes[1] = tp1;
+                        best_indexes[2] = tp2;
+                        best_indexes[3] = tp3;
+                        best_indexes[4] = finish;
+                    }
+                    TRACK_STATS_ADD(track, improvements, 1);
+                    track_bound_raise(&shared_bound, total);
+                    ++tp2;
+                }
+                --tp3;
             }
-            --tp3;
+        }
+#pragma omp critical
+        if (best_indexes[0] != -1 && (indexes[0] == -1 || best > bound || (best == bound && track_frcfd_triangle_fai_later(indexes, best_indexes[1], best_indexes[2], best_indexes[3])))) {
+            bound = best;
+            memcpy(indexes, best_indexes, sizeof best_indexes);
         }
     }
+    mem_free(order);
+    if (skipped > -INFINITY)
+        *upper_bound = skipped > bound ? skipped : bound;
+    TRACK_STATS_END(track);
     return bound;
 }
 
+/* Marks the coarse fixes s for which some triangle with TP1 at s, allowing
+ * repeated turnpoints and a closing distance relaxed by the error, is longer
+ * than bound less the error of its three legs.  FAI triangles are a subset of
+ * these, so this also windows the FAI triangle search. */
+    static void
+track_frcfd_triangle_plat_window(const track_t *coarse, double bound, double error, unsigned char *window)
+{
+    bound -= 6.0 * error;
+    double circuit_bound = coarse->circuit_bound + 2.0 * error;
+    int *last_finish = alloc(coarse->ntrkpts * sizeof(int));
+#pragma omp parallel for schedule(dynamic, 64)
+    for (int start = 0; start < coarse->ntrkpts; ++start) {
+        last_finish[start] = start;
+        for (int finish = coarse->ntrkpts - 1; finish > start; ) {
+            double d = track_delta(coarse, start, finish);
+            if (d < circuit_bound) {
+                last_finish[start] = finish;
+                break;
+            }
+            finish = track_fast_backward(coarse, finish, d - circuit_bound);
+        }
+    }
+    for (int s = 1; s < coarse->ntrkpts; ++s)
+        if (last_finish[s - 1] > last_finish[s])
+            last_finish[s] = last_finish[s - 1];
+#pragma omp parallel for schedule(dynamic)
+    for (int s = 0; s < coarse->ntrkpts; ++s) {
+        window[s] = 0;
+        for (int tp3 = last_finish[s]; tp3 >= s && !window[s]; --tp3) {
+            double leg31 = track_delta(coarse, tp3, s);
+            double legs123 = 0.0;
+            if (track_furthest_from2(coarse, s, tp3, s, tp3 + 1, bound - leg31, &legs123) >= 0)
+                window[s] = 1;
+        }
+    }
+    mem_free(last_finish);
+}
+
+#define TRACK_TILE_LEVEL 2
+#define TRACK_TILE_MAX_BLOCKS 1024
+
+/* A tile is the set of flat triangles with TP1 in block p and TP3 in block q
+ * of the cap tree level used for tiling, and ub an upper bound on their
+ * length. */
+typedef struct {
+    int p;
+    int q;
+    double ub;
+} track_tile_t;
+
+    static int
+track_tile_compare(const void *a, const void *b)
+{
+    const track_tile_t *tile_a = a, *tile_b = b;
+    if (tile_a->ub != tile_b->ub)
+        return tile_a->ub > tile_b->ub ? -1 : 1;
+    if (tile_a->p != tile_b->p)
+        return tile_a->p - tile_b->p;
+    return tile_a->q - tile_b->q;
+}
+
+/* Returns whether the triangle tp1, tp2, tp3 comes before the one in indexes
+ * in the order of the serial search, which keeps the first of equally long
+ * triangles. */
+__attribute__ ((nonnull(1))) __attribute__ ((pure))
+    static inline int
+track_frcfd_triangle_plat_earlier(const int *indexes, int tp1, int tp2, int tp3)
+{
+    if (tp1 != indexes[1])
+        return tp1 < indexes[1];
+    if (tp3 != indexes[3])
+        return tp3 > indexes[3];
+    return tp2 < indexes[2];
+}
+
+/* Out-and-return flights make almost every pair of TP1 and TP3 look
+ * promising, so the search is split into tiles of pairs whose fixes lie in
+ * one cap each.  The caps bound every triangle in a tile with a single scan
+ * for TP2, the tiles are searched most promising first so that the shared
+ * bound rises quickly, and the pairs within a tile share the cache lines of
+ * their blocks. */
     static double
-track_frcfd_triangle_plat(const track_t *track, double bound, int *indexes)
+track_frcfd_triangle_plat(const track_t *track, double bound, int *indexes, double *upper_bound)
 {
     indexes[0] = indexes[1] = indexes[2] = indexes[3] = indexes[4] = -1;
-    for (int tp1 = 0; tp1 < track->ntrkpts - 1; ++tp1) {
-        if (track->sigma_delta[track->ntrkpts - 1] - track->sigma_delta[tp1] < bound)
+    int n = track->ntrkpts;
+    if (n < 3)
+        return bound;
+    TRACK_STATS_BEGIN(track, TRACK_STATS_TRIANGLE_PLAT);
+    int level = TRACK_TILE_LEVEL < track->ncap_levels - 1 ? TRACK_TILE_LEVEL : track->ncap_levels - 1;
+    while (level < track->ncap_levels - 1 && (n - 1) / (TRACK_CAP_SIZE << level) + 1 > TRACK_TILE_MAX_BLOCKS)
+        ++level;
+    int size = TRACK_CAP_SIZE << level;
+    int nblocks = (n - 1) / size + 1;
+    const cap_t *caps = track->caps + track->cap_offsets[level];
+
+    track_tile_t *tiles = alloc(nblocks * (nblocks + 1) / 2 * sizeof(track_tile_t));
+    int ntiles = 0;
+    for (int p = 0; p < nblocks; ++p) {
+        int a1 = p * size, b1 = a1 + size < n - 2 ? a1 + size : n - 2;
+        if (a1 >= b1)
             break;
-        int start = track->best_start[tp1];
-        int finish = track->last_finish[start];
-        if (finish < 0 || track->sigma_delta[finish] - track->sigma_delta[tp1] < bound)
-            continue;
-        for (int tp3 = finish; tp3 > tp1 + 1; --tp3) {
-            double leg31 = track_delta(track, tp3, tp1);
-            double bound123 = bound - leg31;
+        int finish = track->last_finish[track->best_start[b1 - 1]];
+        double leg12 = 0.0;
+        for (int tp1 = a1; tp1 < b1; ++tp1)
+            if (track->after[tp1].distance > leg12)
+                leg12 = track->after[tp1].distance;
+        for (int q = p; q < nblocks; ++q) {
+            int a3 = q * size > a1 + 2 ? q * size : a1 + 2;
+            int b3 = (q + 1) * size - 1 < finish ? (q + 1) * size - 1 : finish;
+            if (a3 > b3)
+                break;
+            double sigma = track->sigma_delta[b3] - track->sigma_delta[a1];
+            double leg31 = coord_delta(&caps[p].centre, &caps[q].centre) + caps[p].radius + caps[q].radius;
+            tiles[ntiles].p = p;
+            tiles[ntiles].q = q;
+            /* The middle leg is no longer than the other two together. */
+            double flown = sigma + (leg31 < sigma ? leg31 : sigma);
+            double legs = 2.0 * (leg12 + leg31);
+            tiles[ntiles].ub = flown < legs ? flown : legs;
+            if (tiles[ntiles].ub >= bound)
+                ++ntiles;
+        }
+    }
+    qsort(tiles, ntiles, sizeof(track_tile_t), track_tile_compare);
+
+    double shared_bound = bound;
+    double skipped = -INFINITY;
+#pragma omp parallel reduction(max:skipped)
+    {
+        double best = 0.0;
+        int best_indexes[5] = { -1, -1, -1, -1, -1 };
+#pragma omp for schedule(dynamic, 1)
+        for (int t = 0; t < ntiles; ++t) {
+            if (tiles[t].ub < track_bound_load(&shared_bound))
+                continue;
+            if (track_stopped(track)) {
+                if (tiles[t].ub > skipped)
+                    skipped = tiles[t].ub;
+                continue;
+            }
+            const cap_t *cap1 = caps + tiles[t].p, *cap3 = caps + tiles[t].q;
+            int a1 = tiles[t].p * size, b1 = a1 + size < n - 2 ? a1 + size : n - 2;
+            int a3 = tiles[t].q * size, b3 = a3 + size < n ? a3 + size : n;
+            double radii = cap1->radius + cap3->radius;
+            double slack = coord_delta(&cap1->centre, &cap3->centre) + 2.0 * radii;
             double legs123 = 0.0;
-            int tp2 = track_furthest_from2(track, tp1, tp3, tp1 + 1, tp3, bound123, &legs123);
-            if (tp2 > 0) {
-                bound = leg31 + legs123;
-                indexes[0] = start;
-                indexes[1] = tp1;
-                indexes[2] = tp2;
-                indexes[3] = tp3;
-                indexes[4] = finish;
+            if (track_coords_furthest_from2(track, &cap1->centre, &cap3->centre, a1 + 1, b3 - 1, nextafter(track_bound_load(&shared_bound) - slack, -INFINITY), &legs123) < 0)
+                continue;
+            for (int tp1 = a1; tp1 < b1; ++tp1) {
+                if (track_outside_window(track, tp1))
+                    continue;
+                int start = track->best_start[tp1];
+                int finish = track->last_finish[start];
+                int last = finish < b3 - 1 ? finish : b3 - 1;
+                int first = a3 > tp1 + 2 ? a3 : tp1 + 2;
+                if (last < first)
+                    continue;
+                /* The closing leg is not flown, so the perimeter can exceed
+                 * the distance flown from TP1 by up to the length of TP3-TP1. */
+                double sigma = track->sigma_delta[last] - track->sigma_delta[tp1];
+                double leg31_max = track_coord_delta(track, &cap3->centre, tp1) + cap3->radius;
+                if (sigma + (leg31_max < sigma ? leg31_max : sigma) < track_bound_load(&shared_bound))
+                    continue;
+                for (int tp3 = last; tp3 >= first; --tp3) {
+                    double leg31 = track_delta(track, tp3, tp1);
+                    double current_bound = track_bound_load(&shared_bound);
+                    double bound123 = current_bound > bound ? nextafter(current_bound - leg31, -INFINITY) : bound - leg31;
+                    int tp2 = track_furthest_from2(track, tp1, tp3, tp1 + 1, tp3, bound123, &legs123);
+                    if (tp2 < 0)
+                        continue;
+                    double total = leg31 + legs123;
+                    if (!(total > bound) || total < track_bound_load(&shared_bound))
+                        continue;
+                    if (best_indexes[0] == -1 || total > best || (total == best && track_frcfd_triangle_plat_earlier(best_indexes, tp1, tp2, tp3))) {
+                        best = total;
+                        best_indexes[0] = start;
+                        best_indexes[1] = tp1;
+                        best_indexes[2] = tp2;
+                        best_indexes[3] = tp3;
+                        best_indexes[4] = finish;
+                    }
+                    TRACK_STATS_ADD(track, improvements, 1);
+                    track_bound_raise(&shared_bound, total);
+                }
+            }
+        }
+#pragma omp critical
+        if (best_indexes[0] != -1 && (indexes[0] == -1 || best > bound || (best == bound && track_frcfd_triangle_plat_earlier(indexes, best_indexes[1], best_indexes[2], best_indexes[3])))) {
+            bound = best;
+            memcpy(indexes, best_indexes, sizeof best_indexes);
+        }
+    }
+    mem_free(tiles);
+    if (skipped > -INFINITY)
+        *upper_bound = skipped > bound ? skipped : bound;
+    TRACK_STATS_END(track);
+    return bound;
+}
+
+#define TRACK_QUADRILATERE_LEVEL 4
+#define TRACK_QUADRILATERE_TARGET_GAP (0.1 / R)
+
+/* The quadrilaterals with TP1 in cap p and TP3 in cap q of a level of the cap
+ * tree, and ub an upper bound on their length. */
+typedef struct {
+    int level;
+    int p;
+    int q;
+    double ub;
+} track_block_t;
+
+    static int
+track_block_compare(const void *a, const void *b)
+{
+    const track_block_t *block_a = a, *block_b = b;
+    if (block_a->ub != block_b->ub)
+        return block_a->ub > block_b->ub ? -1 : 1;
+    if (block_a->p != block_b->p)
+        return block_a->p - block_b->p;
+    return block_a->q - block_b->q;
+}
+
+/* Returns whether the quadrilateral tp1, tp2, tp3, tp4 comes before the one
+ * in indexes in the order of the serial search, which keeps the first of
+ * equally long quadrilaterals. */
+__attribute__ ((nonnull(1))) __attribute__ ((pure))
+    static inline int
+track_frcfd_quadrilatere_earlier(const int *indexes, int tp1, int tp2, int tp3, int tp4)
+{
+    if (tp1 != indexes[1])
+        return tp1 < indexes[1];
+    if (tp3 != indexes[3])
+        return tp3 > indexes[3];
+    if (tp2 != indexes[2])
+        return tp2 < indexes[2];
+    return tp4 < indexes[4];
+}
+
+/* Returns an upper bound on the quadrilaterals of block, or -INFINITY if none
+ * of them can reach bound.  Every leg from TP1 or TP3 is at most the distance
+ * from the centre of its cap plus the radius, so one scan bounds TP4 and one
+ * TP2, the second using the result of the first. */
+__attribute__ ((nonnull(1, 2)))
+    static double
+track_frcfd_quadrilatere_bound(const track_t *track, const track_block_t *block, double bound)
+{
+    int n = track->ntrkpts;
+    int size = TRACK_CAP_SIZE << block->level;
+    int a1 = block->p * size, b1 = a1 + size < n - 3 ? a1 + size : n - 3;
+    int a3 = block->q * size, b3 = a3 + size < n - 1 ? a3 + size : n - 1;
+    if (a1 >= b1 || (a3 > a1 + 2 ? a3 : a1 + 2) >= b3)
+        return -INFINITY;
+    int finish = track->last_finish[track->best_start[b1 - 1]];
+    if (a3 >= finish)
+        return -INFINITY;
+    const cap_t *cap1 = track->caps + track->cap_offsets[block->level] + block->p;
+    const cap_t *cap3 = track->caps + track->cap_offsets[block->level] + block->q;
+    double radii = cap1->radius + cap3->radius;
+    double sigma123 = track->sigma_delta[b3 - 1] - track->sigma_delta[a1];
+    double legs341 = 0.0, legs123 = 0.0;
+    if (track_coords_furthest_from2(track, &cap3->centre, &cap1->centre, a3 + 1, finish + 1, nextafter(bound - sigma123 - radii, -INFINITY), &legs341) < 0)
+        return -INFINITY;
+    if (track_coords_furthest_from2(track, &cap1->centre, &cap3->centre, a1 + 1, b3 - 1, nextafter(bound - legs341 - 2.0 * radii, -INFINITY), &legs123) < 0)
+        return -INFINITY;
+    return legs123 + legs341 + 2.0 * radii;
+}
+
+/* Searches blocks for the longest quadrilateral longer than bound, pruning
+ * with target until one at least as long as target is found, and raises
+ * skipped_bound to the bound of any block left unsearched at the deadline. */
+    static double
+track_frcfd_quadrilatere_search(const track_t *track, const track_block_t *blocks, int nblocks, double bound, double target, int *indexes, double *skipped_bound)
+{
+    int n = track->ntrkpts;
+    for (int i = 0; i < 6; ++i)
+        indexes[i] = -1;
+    double shared_bound = target;
+    double skipped = -INFINITY;
+#pragma omp parallel reduction(max:skipped)
+    {
+        double best = 0.0;
+        int best_indexes[6] = { -1, -1, -1, -1, -1, -1 };
+#pragma omp for schedule(dynamic, 1)
+        for (int b = 0; b < nblocks; ++b) {
+            if (blocks[b].ub < track_bound_load(&shared_bound))
+                continue;
+            if (track_stopped(track)) {
+                if (blocks[b].ub > skipped)
+                    skipped = blocks[b].ub;
+                continue;
+            }
+            track_block_t stack[3 * 32 + 1];
+            int nstack = 0;
+            stack[nstack++] = blocks[b];
+            while (nstack) {
+                track_block_t block = stack[--nstack];
+                if (block.ub < track_bound_load(&shared_bound))
+                    continue;
+                if (block.level > 0) {
+                    track_block_t children[4];
+                    int nchildren = 0;
+                    for (int i = 0; i < 2; ++i) {
+                        for (int j = 0; j < 2; ++j) {
+                            track_block_t *child = children + nchildren;
+                            child->level = block.level - 1;
+                            child->p = 2 * block.p + i;
+                            child->q = 2 * block.q + j;
+                            if (child->q < child->p)
+                                continue;
+                            child->ub = track_frcfd_quadrilatere_bound(track, child, track_bound_load(&shared_bound));
+                            if (child->ub > -INFINITY)
+                                ++nchildren;
+                        }
+                    }
+                    qsort(children, nchildren, sizeof(track_block_t), track_block_compare);
+                    while (nchildren)
+                        stack[nstack++] = children[--nchildren];
+                    continue;
+                }
+                const cap_t *cap3 = track->caps + track->cap_offsets[0] + block.q;
+                int a1 = block.p * TRACK_CAP_SIZE, b1 = a1 + TRACK_CAP_SIZE < n - 3 ? a1 + TRACK_CAP_SIZE : n - 3;
+                int a3 = block.q * TRACK_CAP_SIZE, b3 = a3 + TRACK_CAP_SIZE < n - 1 ? a3 + TRACK_CAP_SIZE : n - 1;
+                double sigma123 = track->sigma_delta[b3 - 1] - track->sigma_delta[a1];
+                for (int tp1 = a1; tp1 < b1; ++tp1) {
+                    int start = track->best_start[tp1];
+                    int finish = track->last_finish[start];
+                    int last = finish - 1 < b3 - 1 ? finish - 1 : b3 - 1;
+                    int first = a3 > tp1 + 2 ? a3 : tp1 + 2;
+                    if (last < first)
+                        continue;
+                    if (2.0 * (track->sigma_delta[finish] - track->sigma_delta[tp1]) < track_bound_load(&shared_bound))
+                        continue;
+                    /* The cap of TP3 bounds both halves for this TP1. */
+                    coord_t coord1 = { track->x[tp1], track->y[tp1], track->z[tp1] };
+                    double legs123 = 0.0, legs341 = 0.0;
+                    if (track_coords_furthest_from2(track, &cap3->centre, &coord1, first + 1, finish + 1, nextafter(track_bound_load(&shared_bound) - sigma123 - cap3->radius, -INFINITY), &legs341) < 0)
+                        continue;
+                    double legs341_max = legs341 + cap3->radius;
+                    if (track_coords_furthest_from2(track, &coord1, &cap3->centre, tp1 + 1, last, nextafter(track_bound_load(&shared_bound) - legs341_max - cap3->radius, -INFINITY), &legs123) < 0)
+                        continue;
+                    for (int tp3 = last; tp3 >= first; --tp3) {
+                        double current_bound = track_bound_load(&shared_bound);
+                        double bound123 = current_bound > bound ? nextafter(current_bound - legs341_max, -INFINITY) : bound - legs341_max;
+                        int tp2 = track_furthest_from2(track, tp1, tp3, tp1 + 1, tp3, bound123, &legs123);
+                        if (tp2 < 0)
+                            continue;
+                        current_bound = track_bound_load(&shared_bound);
+                        double bound341 = current_bound > bound ? nextafter(current_bound - legs123, -INFINITY) : bound - legs123;
+                        int tp4 = track_furthest_from2(track, tp3, tp1, tp3 + 1, finish + 1, bound341, &legs341);
+                        if (tp4 < 0)
+                            continue;
+                        double total = legs123 + legs341;
+                        if (!(total > bound) || total < track_bound_load(&shared_bound))
+                            continue;
+                        if (best_indexes[0] == -1 || total > best || (total == best && track_frcfd_quadrilatere_earlier(best_indexes, tp1, tp2, tp3, tp4))) {
+                            best = total;
+                            best_indexes[0] = start;
+                            best_indexes[1] = tp1;
+                            best_indexes[2] = tp2;
+                            best_indexes[3] = tp3;
+                            best_indexes[4] = tp4;
+                            best_indexes[5] = finish;
+                        }
+                        TRACK_STATS_ADD(track, improvements, 1);
+                        track_bound_raise(&shared_bound, total);
+                    }
+                }
+            }
+        }
+#pragma omp critical
+        if (best_indexes[0] != -1 && (indexes[0] == -1 || best > bound || (best == bound && track_frcfd_quadrilatere_earlier(indexes, best_indexes[1], best_indexes[2], best_indexes[3], best_indexes[4])))) {
+            bound = best;
+            memcpy(indexes, best_indexes, sizeof best_indexes);
+        }
+    }
+    if (skipped > *skipped_bound)
+        *skipped_bound = skipped;
+    return bound;
+}
+
+/* Splits each quadrilateral along its diagonal TP1-TP3.  Given the diagonal,
+ * TP2 lies between TP1 and TP3 and TP4 between TP3 and the last finish, so
+ * the best of each is found by its own scan.  The pairs of TP1 and TP3 are
+ * split into blocks by the caps that contain them, starting from a coarse
+ * level of the cap tree and halving the blocks that the caps cannot rule out
+ * down to the leaves, descending into the most promising half first.
+ *
+ * A quadrilateral may repeat a turnpoint, so it is never shorter than the
+ * flat triangle, whose length seeds the bound.  The longest quadrilateral is
+ * usually only a little longer, and the search is far quicker when its bound
+ * starts close to it than when it has to raise the bound itself.  So the
+ * blocks are searched in rounds, each pruning with a target halfway between
+ * the bound and the target of the round before, starting from the largest
+ * bound of any block.  A quadrilateral at least as long as its target is the
+ * longest, and the last round prunes with the bound itself. */
+    static double
+track_frcfd_quadrilatere(const track_t *track, double bound, int *indexes, double *upper_bound)
+{
+    for (int i = 0; i < 6; ++i)
+        indexes[i] = -1;
+    int n = track->ntrkpts;
+    if (n < 4)
+        return bound;
+    TRACK_STATS_BEGIN(track, TRACK_STATS_QUADRILATERE);
+    int level = TRACK_QUADRILATERE_LEVEL < track->ncap_levels - 1 ? TRACK_QUADRILATERE_LEVEL : track->ncap_levels - 1;
+    while (level < track->ncap_levels - 1 && (n - 1) / (TRACK_CAP_SIZE << level) + 1 > TRACK_TILE_MAX_BLOCKS)
+        ++level;
+    int size = TRACK_CAP_SIZE << level;
+    int nblocks = (n - 1) / size + 1;
+
+    /* The perimeter is at most twice the distance flown from TP1 to TP4, and
+     * TP3-TP4-TP1 at most twice the distance flown from TP3 to TP4 plus the
+     * diagonal.  The caps then tighten the bound of each block where they
+     * can, and drop the blocks that cannot reach the bound at all. */
+    track_block_t *blocks = alloc(nblocks * (nblocks + 1) / 2 * sizeof(track_block_t));
+    int nblocks_searched = 0;
+    for (int p = 0; p < nblocks; ++p) {
+        int a1 = p * size, b1 = a1 + size < n - 3 ? a1 + size : n - 3;
+        if (a1 >= b1)
+            break;
+        int finish = track->last_finish[track->best_start[b1 - 1]];
+        for (int q = p; q < nblocks; ++q) {
+            int a3 = q * size > a1 + 2 ? q * size : a1 + 2;
+            int b3 = (q + 1) * size - 1 < finish - 1 ? (q + 1) * size - 1 : finish - 1;
+            if (a3 > b3)
+                break;
+            const cap_t *cap1 = track->caps + track->cap_offsets[level] + p;
+            const cap_t *cap3 = track->caps + track->cap_offsets[level] + q;
+            double sigma = 2.0 * (track->sigma_delta[finish] - track->sigma_delta[a1]);
+            double leg31 = coord_delta(&cap1->centre, &cap3->centre) + cap1->radius + cap3->radius;
+            double halves = track->sigma_delta[b3] - track->sigma_delta[a1] + 2.0 * (track->sigma_delta[finish] - track->sigma_delta[a3]) + leg31;
+            blocks[nblocks_searched].level = level;
+            blocks[nblocks_searched].p = p;
+            blocks[nblocks_searched].q = q;
+            blocks[nblocks_searched].ub = halves < sigma ? halves : sigma;
+            if (blocks[nblocks_searched].ub >= bound)
+                ++nblocks_searched;
+        }
+    }
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int b = 0; b < nblocks_searched; ++b) {
+        double ub = track_frcfd_quadrilatere_bound(track, blocks + b, bound);
+        if (ub < blocks[b].ub)
+            blocks[b].ub = ub;
+    }
+    int nblocks_kept = 0;
+    for (int b = 0; b < nblocks_searched; ++b)
+        if (blocks[b].ub > -INFINITY)
+            blocks[nblocks_kept++] = blocks[b];
+    qsort(blocks, nblocks_kept, sizeof(track_block_t), track_block_compare);
+
+    double skipped = -INFINITY;
+    double target = nblocks_kept ? blocks[0].ub : bound;
+    double searched = INFINITY;
+    for (;;) {
+        target = target - bound > TRACK_QUADRILATERE_TARGET_GAP ? bound + 0.5 * (target - bound) : bound;
+        double best = track_frcfd_quadrilatere_search(track, blocks, nblocks_kept, bound, target, indexes, &skipped);
+        if (indexes[0] != -1 || target == bound || skipped > -INFINITY) {
+            if (skipped > -INFINITY) {
+                double ub = skipped > target ? skipped : target;
+                *upper_bound = ub < searched ? ub : searched;
+                if (*upper_bound < best)
+                    *upper_bound = best;
             }
+            bound = best;
+            break;
         }
+        searched = target;
     }
+    mem_free(blocks);
+    TRACK_STATS_END(track);
     return bound;
 }
 
+typedef double (*track_phase_t)(const track_t *, double, int *, double *);
+typedef void (*track_window_t)(const track_t *, double, double, unsigned char *);
+
+/* Runs phase on the coarser levels of the pyramid first.  Every coarse fix is
+ * also a fix of the full track, so the best coarse route is a valid route of
+ * the full track and its distance is a lower bound for the full resolution
+ * search.  Moving the points of a route to their coarse fixes shortens each
+ * leg by at most twice pyramid_error, so where a window function is given the
+ * full resolution search only starts from the coarse segments in which it
+ * finds a coarse route that could still beat the bound.  The full resolution
+ * search also looks for routes only as long as the coarse one, so that of
+ * equally long routes it keeps the same one as a search without the pyramid,
+ * down to the start and finish of circuits. */
+    static double
+track_refine(track_t *track, track_phase_t phase, track_window_t window, int n, double bound, int *indexes, double *upper_bound)
+{
+    *upper_bound = INFINITY;
+    if (!track->coarse || !track->coarse->ntrkpts)
+        return phase(track, bound, indexes, upper_bound);
+    track->coarse->deadline = track->deadline;
+    double coarse_upper_bound;
+    double coarse_bound = track_refine(track->coarse, phase, window, n, bound, indexes, &coarse_upper_bound);
+    if (indexes[0] == -1)
+        return phase(track, bound, indexes, upper_bound);
+    int coarse_indexes[n];
+    for (int i = 0; i < n; ++i)
+        coarse_indexes[i] = TRACK_PYRAMID_FACTOR * indexes[i];
+    if (window) {
+        window(track->coarse, coarse_bound, track->pyramid_error, track->window);
+        track->windowed = 1;
+    }
+    double fine_bound = phase(track, nextafter(coarse_bound, -INFINITY), indexes, upper_bound);
+    track->windowed = 0;
+    if (indexes[0] == -1) {
+        memcpy(indexes, coarse_indexes, n * sizeof(int));
+        return coarse_bound;
+    }
+    return fine_bound;
+}
+
+    static double
+track_route_distance(const track_t *track, int n, int *indexes)
+{
+    double distance = 0.0;
+    for (int i = 0; i < n - 1; ++i)
+        distance += track_exact_delta(track, indexes[i], indexes[i + 1]);
+    return R * distance;
+}
+
     static double
 track_frcfd_circuit_distance(const track_t *track, int n, int *indexes)
 {
-    double distance = track_delta(track, indexes[n - 2], indexes[1]);
+    double distance = track_exact_delta(track, indexes[n - 2], indexes[1]);
     for (int i = 1; i < n - 2; ++i)
-        distance += track_delta(track, indexes[i], indexes[i + 1]);
+        distance += track_exact_delta(track, indexes[i], indexes[i + 1]);
     return R * distance;
 }
 
-    result_t *
-track_optimize_frcfd(track_t *track, int complexity, const declaration_t *declaration)
+/* Marks route as provisional if the search for it was stopped before it
+ * could prove it the best, recording the proven bound on its distance.  The
+ * series used by the searches is short by a centimetre for a leg of a
+ * thousand kilometres, and by under the metre a leg added here for legs of up
+ * to 1900 km. */
+__attribute__ ((nonnull(1)))
+    static void
+track_route_provisional(route_t *route, double upper_bound, int legs)
+{
+    if (upper_bound == INFINITY)
+        return;
+    route->provisional = 1;
+    route->upper_bound = R * upper_bound + 0.001 * legs;
+    if (route->upper_bound < route->distance)
+        route->upper_bound = route->distance;
+}
+
+    static void
+track_frcfd_routes(track_t *track, int complexity, const declaration_t *declaration, result_t *result)
 {
     static const char *league = "Coupe F\303\251d\303\251rale de Distance (France)";
-    result_t *result = result_new();
 
     int indexes[6];
-    double bound;
+    double bound, upper_bound;
 
-    bound = track_open_distance(track, 0.0, indexes);
+    bound = track_refine(track, track_open_distance, 0, 2, 0.0, indexes, &upper_bound);
     if (indexes[0] != -1) {
-        route_t *route = result_push_new_route(result, league, "distance libre sans point de contournement", R * bound, 1.0, 0, 0);
+        route_t *route = result_push_new_route(result, league, "distance libre sans point de contournement", track_route_distance(track, 2, indexes), 1.0, 0, 0);
         const char *names[] = { "BD", "BA" };
         route_push_trkpts(route, track->trkpts, 2, indexes, names);
+        track_route_provisional(route, upper_bound, 1);
     }
 
-    if (complexity != -1 && complexity < 1)
-        return result;
+    if (track_stopped(track) || (complexity != -1 && complexity < 1))
+        return;
 
-    bound = track_open_distance1(track, bound, indexes);
+    bound = track_refine(track, track_open_distance1, 0, 3, bound, indexes, &upper_bound);
     if (indexes[0] != -1) {
-        route_t *route = result_push_new_route(result, league, "distance libre avec un point de contournement", R * bound, 1.0, 0, 0);
+        route_t *route = result_push_new_route(result, league, "distance libre avec un point de contournement", track_route_distance(track, 3, indexes), 1.0, 0, 0);
         const char *names[] = { "BD", "B1", "BA" };
         route_push_trkpts(route, track->trkpts, 3, indexes, names);
+        track_route_provisional(route, upper_bound, 2);
     }
 
-    if (complexity != -1 && complexity < 2)
-        return result;
+    if (track_stopped(track) || (complexity != -1 && complexity < 2))
+        return;
 
-    bound = track_open_distance2(track, bound, indexes);
+    bound = track_refine(track, track_open_distance2, 0, 4, bound, indexes, &upper_bound);
     if (indexes[0] != -1) {
-        route_t *route = result_push_new_route(result, league, "distance libre avec deux points de contournement", R * bound, 1.0, 0, 0);
+        route_t *route = result_push_new_route(result, league, "distance libre avec deux points de contournement", track_route_distance(track, 4, indexes), 1.0, 0, 0);
         const char *names[] = { "BD", "B1", "B2", "BA" };
         route_push_trkpts(route, track->trkpts, 4, indexes, names);
+        track_route_provisional(route, upper_bound, 3);
     }
 
-    track_compute_circuit_tables(track, 3.0 / R);
+    track_select_circuit_tables(track, 3.0 / R);
 
-    bound = track_frcfd_aller_retour(track, 15.0 / R, indexes);
+    bound = track_refine(track, track_frcfd_aller_retour, 0, 4, 15.0 / R, indexes, &upper_bound);
     if (indexes[0] != -1) {
         double distance = track_frcfd_circuit_distance(track, 4, indexes);
         route_t *route = result_push_new_route(result, league, "parcours en aller-retour", distance, 1.2, 1, 0);
         static const char *names[] = { "BD", "B1", "B2", "BA" };
         route_push_trkpts(route, track->trkpts, 4, indexes, names);
+        track_route_provisional(route, upper_bound, 2);
     }
 
-    if (complexity != -1 && complexity < 3)
-        return result;
+    if (track_stopped(track) || (complexity != -1 && complexity < 3))
+        return;
 
-    bound = track_frcfd_triangle_fai(track, bound, indexes);
+    bound = track_refine(track, track_frcfd_triangle_fai, track_frcfd_triangle_plat_window, 5, bound, indexes, &upper_bound);
     if (indexes[0] != -1) {
         double distance = track_frcfd_circuit_distance(track, 5, indexes);
         route_t *route = result_push_new_route(result, league, "triangle FAI", distance, 1.4, 1, 0);
         static const char *names[] = { "BD", "B1", "B2", "B3", "BA" };
         route_push_trkpts(route, track->trkpts, 5, indexes, names);
+        track_route_provisional(route, upper_bound, 3);
     }
 
-    bound = track_frcfd_triangle_plat(track, bound, indexes);
+    bound = track_refine(track, track_frcfd_triangle_plat, track_frcfd_triangle_plat_window, 5, bound, indexes, &upper_bound);
     if (indexes[0] != -1) {
         double distance = track_frcfd_circuit_distance(track, 5, indexes);
         route_t *route = result_push_new_route(result, league, "triangle plat", distance, 1.2, 1, 0);
         static const char *names[] = { "BD", "B1", "B2", "B3", "BA" };
         route_push_trkpts(route, track->trkpts, 5, indexes, names);
+        track_route_provisional(route, upper_bound, 3);
     }
 
-    /* TODO track_frcfd_quadrilatere */
+    if (track_stopped(track) || (complexity != -1 && complexity < 4))
+        return;
 
-    return result;
+    bound = track_refine(track, track_frcfd_quadrilatere, 0, 6, bound, indexes, &upper_bound);
+    if (indexes[0] != -1) {
+        double distance = track_frcfd_circuit_distance(track, 6, indexes);
+        route_t *route = result_push_new_route(result, league, "quadrilat\303\250re", distance, 1.2, 1, 0);
+        static const char *names[] = { "BD", "B1", "B2", "B3", "B4", "BA" };
+        route_push_trkpts(route, track->trkpts, 6, indexes, names);
+        track_route_provisional(route, upper_bound, 4);
+    }
 }
 
-    result_t *
-track_optimize_uknxcl(track_t *track, int complexity, const declaration_t *declaration)
+    static void
+track_uknxcl_routes(track_t *track, int complexity, const declaration_t *declaration, result_t *result)
 {
     static const char *league = "UK National XC League";
-    result_t *result = result_new();
 
     int indexes[6];
-    double bound;
+    double bound, upper_bound;
 
-    bound = track_open_distance(track, 0.0, indexes);
+    bound = track_refine(track, track_open_distance, 0, 2, 0.0, indexes, &upper_bound);
     if (indexes[0] != -1) {
-        route_t *route = result_push_new_route(result, league, "open distance", R * bound, 1.0, 0, 0);
+        route_t *route = result_push_new_route(result, league, "open distance", track_route_distance(track, 2, indexes), 1.0, 0, 0);
         const char *names[] = { "Start", "Finish" };
         route_push_trkpts(route, track->trkpts, 2, indexes, names);
+        track_route_provisional(route, upper_bound, 1);
     }
 
-    if (complexity != -1 && complexity < 1)
-        return result;
+    if (track_stopped(track) || (complexity != -1 && complexity < 1))
+        return;
 
-    bound = track_open_distance1(track, bound, indexes);
+    bound = track_refine(track, track_open_distance1, 0, 3, bound, indexes, &upper_bound);
     if (indexes[0] != -1) {
-        route_t *route = result_push_new_route(result, league, "open distance via a turnpoint", R * bound, 1.0, 0, 0);
+        route_t *route = result_push_new_route(result, league, "open distance via a turnpoint", track_route_distance(track, 3, indexes), 1.0, 0, 0);
         const char *names[] = { "Start", "TP1", "Finish" };
         route_push_trkpts(route, track->trkpts, 3, indexes, names);
+        track_route_provisional(route, upper_bound, 2);
     }
 
-    if (complexity != -1 && complexity < 2)
-        return result;
+    if (track_stopped(track) || (complexity != -1 && complexity < 2))
+        return;
 
-    bound = track_open_distance2(track, bound, indexes);
+    bound = track_refine(track, track_open_distance2, 0, 4, bound, indexes, &upper_bound);
     if (indexes[0] != -1) {
-        route_t *route = result_push_new_route(result, league, "open distance via two turnpoints", R * bound, 1.0, 0, 0);
+        route_t *route = result_push_new_route(result, league, "open distance via two turnpoints", track_route_distance(track, 4, indexes), 1.0, 0, 0);
         const char *names[] = { "Start", "TP1", "TP2", "Finish" };
         route_push_trkpts(route, track->trkpts, 4, indexes, names);
+        track_route_provisional(route, upper_bound, 3);
     }
 
-    track_compute_circuit_tables(track, 0.4 / R);
+    track_select_circuit_tables(track, 0.4 / R);
 
-    bound = track_frcfd_aller_retour(track, 15.0 / R, indexes);
+    bound = track_refine(track, track_frcfd_aller_retour, 0, 4, 15.0 / R, indexes, &upper_bound);
     if (indexes[0] != -1) {
         double distance = track_frcfd_circuit_distance(track, 4, indexes);
         route_t *route = result_push_new_route(result, league, "out and return via a turnpoint", distance, 2.0, 1, 0);
         static const char *names[] = { "Start", "TP1", "TP2", "Finish" };
         route_push_trkpts(route, track->trkpts, 4, indexes, names);
+        track_route_provisional(route, upper_bound, 2);
     }
 
-    if (complexity != -1 && complexity < 3)
-        return result;
+    if (track_stopped(track) || (complexity != -1 && complexity < 3))
+        return;
 
-    bound = track_frcfd_triangle_fai(track, bound, indexes);
+    bound = track_refine(track, track_frcfd_triangle_fai, track_frcfd_triangle_plat_window, 5, bound, indexes, &upper_bound);
     if (indexes[0] != -1) {
         double distance = track_frcfd_circuit_distance(track, 5, indexes);
         route_t *route = result_push_new_route(result, league, "FAI triangle", distance, 2.5, 1, 0);
         static const char *names[] = { "Start", "TP1", "TP2", "TP3", "Finish" };
         route_push_trkpts(route, track->trkpts, 5, indexes, names);
+        track_route_provisional(route, upper_bound, 3);
     }
 
-    bound = track_frcfd_triangle_plat(track, bound, indexes);
+    bound = track_refine(track, track_frcfd_triangle_plat, track_frcfd_triangle_plat_window, 5, bound, indexes, &upper_bound);
     if (indexes[0] != -1) {
         double distance = track_frcfd_circuit_distance(track, 5, indexes);
         route_t *route = result_push_new_route(result, league, "out and return via two turnpoints", distance, 2.0, 1, 0);
         static const char *names[] = { "Start", "TP1", "TP2", "TP3", "Finish" };
         route_push_trkpts(route, track->trkpts, 5, indexes, names);
+        track_route_provisional(route, upper_bound, 3);
     }
+}
 
-    return result;
+typedef struct {
+    int begin;
+    int end;
+} track_interval_t;
+
+/* The intervals of fixes, in order, that the track spends inside a declared
+ * cylinder. */
+typedef struct {
+    const coord_t *centre;
+    int nintervals;
+    int intervals_capacity;
+    track_interval_t *intervals;
+} track_cylinder_t;
+
+    static void
+track_cylinder_push_interval(track_cylinder_t *cylinder, int begin, int end)
+{
+    if (cylinder->nintervals == cylinder->intervals_capacity) {
+        int capacity = cylinder->intervals_capacity ? 2 * cylinder->intervals_capacity : 16;
+        track_interval_t *intervals = mem_realloc(cylinder->intervals, capacity * sizeof(track_interval_t));
+        if (!intervals)
+            DIE("realloc", errno);
+        cylinder->intervals = intervals;
+        cylinder->intervals_capacity = capacity;
+    }
+    cylinder->intervals[cylinder->nintervals].begin = begin;
+    cylinder->intervals[cylinder->nintervals].end = end;
+    ++cylinder->nintervals;
+}
+
+/* Finds the intervals in a single pass that alternately skips to the next
+ * fix inside and the next fix outside the cylinder. */
+    static void
+track_cylinder_init(const track_t *track, track_cylinder_t *cylinder, const turnpoint_t *turnpoint)
+{
+    memset(cylinder, 0, sizeof *cylinder);
+    cylinder->centre = &turnpoint->coord;
+    double radius = turnpoint->radius / (1000.0 * R);
+    int n = track->ntrkpts;
+    for (int i = track_first_inside(track, cylinder->centre, radius, 0, n); i != -1; ) {
+        int j = track_first_outside(track, cylinder->centre, radius, i + 1, n);
+        track_cylinder_push_interval(cylinder, i, j == -1 ? n : j);
+        if (j == -1)
+            break;
+        i = track_first_inside(track, cylinder->centre, radius, j + 1, n);
+    }
+}
+
+/* Returns the first fix at or after i inside the cylinder, or -1. */
+__attribute__ ((nonnull(1))) __attribute__ ((pure))
+    static int
+track_cylinder_next(const track_cylinder_t *cylinder, int i)
+{
+    int lo = 0, hi = cylinder->nintervals;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cylinder->intervals[mid].end <= i)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == cylinder->nintervals)
+        return -1;
+    return cylinder->intervals[lo].begin > i ? cylinder->intervals[lo].begin : i;
+}
+
+/* Returns the last fix at or before i inside the cylinder, or -1. */
+__attribute__ ((nonnull(1))) __attribute__ ((pure))
+    static int
+track_cylinder_previous(const track_cylinder_t *cylinder, int i)
+{
+    int lo = 0, hi = cylinder->nintervals;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cylinder->intervals[mid].begin <= i)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return -1;
+    return cylinder->intervals[lo - 1].end - 1 < i ? cylinder->intervals[lo - 1].end - 1 : i;
+}
+
+/* Returns the fix inside the cylinder from begin to end inclusive that is
+ * nearest its centre, or -1 if there is none. */
+__attribute__ ((nonnull(1, 2))) __attribute__ ((pure))
+    static int
+track_cylinder_nearest(const track_t *track, const track_cylinder_t *cylinder, int begin, int end)
+{
+    int best = -1;
+    double best_chord2 = INFINITY;
+    for (int i = track_cylinder_next(cylinder, begin); i != -1 && i <= end; i = track_cylinder_next(cylinder, i + 1)) {
+        double chord2 = track_coord_chord2(track, cylinder->centre, i);
+        if (chord2 < best_chord2) {
+            best = i;
+            best_chord2 = chord2;
+        }
+    }
+    return best;
+}
+
+/* Finds a fix inside each cylinder of the declaration in order, or sets
+ * indexes[0] to -1 if the track does not complete it.  The earliest and
+ * latest fixes at which each turnpoint can be reached by a completed flight
+ * bound the search for the fix nearest its centre. */
+    static void
+track_declared(const track_t *track, const declaration_t *declaration, int *indexes)
+{
+    TRACK_STATS_BEGIN(track, TRACK_STATS_DECLARED);
+    int n = declaration->nturnpoints;
+    track_cylinder_t cylinders[n];
+    int earliest[n], latest[n];
+    for (int i = 0; i < n; ++i)
+        track_cylinder_init(track, cylinders + i, declaration->turnpoints + i);
+    indexes[0] = -1;
+    int ok = track->ntrkpts > 0;
+    for (int i = 0; i < n && ok; ++i)
+        ok = (earliest[i] = track_cylinder_next(cylinders + i, i ? earliest[i - 1] : 0)) != -1;
+    for (int i = n - 1; i >= 0 && ok; --i)
+        latest[i] = track_cylinder_previous(cylinders + i, i < n - 1 ? latest[i + 1] : track->ntrkpts - 1);
+    for (int i = 0; i < n && ok; ++i)
+        indexes[i] = track_cylinder_nearest(track, cylinders + i, i && indexes[i - 1] > earliest[i] ? indexes[i - 1] : earliest[i], latest[i]);
+    for (int i = 0; i < n; ++i)
+        mem_free(cylinders[i].intervals);
+    TRACK_STATS_END(track);
+}
+
+/* The distance of a declared task is measured between the centres of its
+ * turnpoints, whichever fixes inside them the flight used. */
+    static double
+track_declaration_distance(const declaration_t *declaration, int begin, int end)
+{
+    double distance = 0.0;
+    for (int i = begin; i < end - 1; ++i) {
+        const coord_t *a = &declaration->turnpoints[i].coord, *b = &declaration->turnpoints[i + 1].coord;
+        double dx = a->x - b->x, dy = a->y - b->y, dz = a->z - b->z;
+        distance += coord_exact_delta(dx * dx + dy * dy + dz * dz);
+    }
+    return R * distance;
+}
+
+#define TRACK_UKXCL_MAX_DECLARED 7
+
+/* Scores the declared goal, out-and-return or triangle of the declaration.
+ * A task is closed if it finishes within the start cylinder. */
+    static void
+track_ukxcl_declared(track_t *track, int complexity, const declaration_t *declaration, result_t *result, const char *league)
+{
+    static const char *goal_names[TRACK_UKXCL_MAX_DECLARED - 1][TRACK_UKXCL_MAX_DECLARED] = {
+        { "Start", "Goal" },
+        { "Start", "TP1", "Goal" },
+        { "Start", "TP1", "TP2", "Goal" },
+        { "Start", "TP1", "TP2", "TP3", "Goal" },
+        { "Start", "TP1", "TP2", "TP3", "TP4", "Goal" },
+        { "Start", "TP1", "TP2", "TP3", "TP4", "TP5", "Goal" },
+    };
+    static const char *circuit_names[][TRACK_UKXCL_MAX_DECLARED] = {
+        { "Start", "TP1", "Finish" },
+        { "Start", "TP1", "TP2", "Finish" },
+    };
+
+    int n = declaration ? declaration->nturnpoints : 0;
+    if (n < 2 || n > TRACK_UKXCL_MAX_DECLARED)
+        return;
+    const turnpoint_t *start = declaration->turnpoints, *finish = declaration->turnpoints + n - 1;
+    int closed = 1000.0 * R * coord_delta(&start->coord, &finish->coord) <= start->radius;
+    const char *name;
+    double multiplier;
+    if (!closed) {
+        name = "declared goal";
+        multiplier = 1.5;
+    } else if (n == 3) {
+        name = "declared out and return";
+        multiplier = 2.0;
+    } else if (n == 4) {
+        double distance = track_declaration_distance(declaration, 0, n);
+        int fai = 1;
+        for (int i = 0; i < 3; ++i)
+            if (track_declaration_distance(declaration, i, i + 2) < 0.28 * distance)
+                fai = 0;
+        name = fai ? "declared FAI triangle" : "declared flat triangle";
+        multiplier = fai ? 2.5 : 2.0;
+    } else {
+        return;
+    }
+    if (complexity != -1 && complexity < (closed ? n - 1 : n - 2))
+        return;
+
+    int indexes[n];
+    track_declared(track, declaration, indexes);
+    if (indexes[0] == -1)
+        return;
+    route_t *route = result_push_new_route(result, league, name, track_declaration_distance(declaration, 0, n), multiplier, 0, 1);
+    route_push_trkpts(route, track->trkpts, n, indexes, closed ? circuit_names[n - 3] : goal_names[n - 2]);
 }
 
-    result_t *
-track_optimize_ukxcl(track_t *track, int complexity, const declaration_t *declaration)
+    static void
+track_ukxcl_routes(track_t *track, int complexity, const declaration_t *declaration, result_t *result)
 {
     static const char *league = "Cross Country League (United Kingdom)";
-    result_t *result = result_new();
 
     int indexes[6];
-    double bound;
+    double bound, upper_bound;
 
-    bound = track_open_distance(track, 10.0 / R, indexes);
+    bound = track_refine(track, track_open_distance, 0, 2, 10.0 / R, indexes, &upper_bound);
     if (indexes[0] != -1) {
-        route_t *route = result_push_new_route(result, league, "open distance", R * bound, 1.0, 0, 0);
+        route_t *route = result_push_new_route(result, league, "open distance", track_route_distance(track, 2, indexes), 1.0, 0, 0);
         const char *names[] = { "Start", "Finish" };
         route_push_trkpts(route, track->trkpts, 2, indexes, names);
+        track_route_provisional(route, upper_bound, 1);
     }
 
-    if (complexity != -1 && complexity < 3)
-        return result;
+    track_ukxcl_declared(track, complexity, declaration, result, league);
+
+    if (track_stopped(track) || (complexity != -1 && complexity < 3))
+        return;
 
     if (bound < 15.0 / R)
         bound = 15.0 / R;
-    bound = track_open_distance3(track, bound, indexes);
+    bound = track_refine(track, track_open_distance3, track_open_distance3_window, 5, bound, indexes, &upper_bound);
     if (indexes[0] != -1) {
-        route_t *route = result_push_new_route(result, league, "turnpoint flight", R * bound, 1.0, 0, 0);
+        route_t *route = result_push_new_route(result, league, "turnpoint flight", track_route_distance(track, 5, indexes), 1.0, 0, 0);
         const char *names[] = { "Start", "TP1", "TP2", "TP3", "Finish" };
         route_push_trkpts(route, track->trkpts, 5, indexes, names);
+        track_route_provisional(route, upper_bound, 4);
     }
 
 #if 0
-    track_compute_circuit_tables(track, 0.4 / R);
+    track_select_circuit_tables(track, 0.4 / R);
 #endif
+}
 
-    return result;
+/* Returns the closing distance of the circuits of league, or zero if it has
+ * none. */
+    double
+track_circuit_bound_for_league(const char *league)
+{
+    if (!strcmp(league, "frcfd"))
+        return 3.0 / R;
+    else if (!strcmp(league, "uknxcl"))
+        return 0.4 / R;
+    else
+        return 0.0;
+}
+
+/* Runs the searches of one league, marking the result incomplete if any of
+ * them was stopped before it finished.  A kind of flight whose search was
+ * stopped before it found a route is left out of the result. */
+__attribute__ ((nonnull(1, 2, 5)))
+    static void
+track_optimize(track_t *track, track_optimize_t optimize, int complexity, const declaration_t *declaration, result_t *result)
+{
+    track->stopped = 0;
+    optimize(track, complexity, declaration, result);
+    if (track->stopped)
+        result->incomplete = 1;
+}
+
+    void
+track_optimize_frcfd(track_t *track, int complexity, const declaration_t *declaration, result_t *result)
+{
+    track_optimize(track, track_frcfd_routes, complexity, declaration, result);
+}
+
+    void
+track_optimize_uknxcl(track_t *track, int complexity, const declaration_t *declaration, result_t *result)
+{
+    track_optimize(track, track_uknxcl_routes, complexity, declaration, result);
+}
+
+    void
+track_optimize_ukxcl(track_t *track, int complexity, const declaration_t *declaration, result_t *result)
+{
+    track_optimize(track, track_ukxcl_routes, complexity, declaration, result);
+}
+
+    track_optimize_t
+track_optimize_for_league(const char *league)
+{
+    if (!strcmp(league, "frcfd"))
+        return track_optimize_frcfd;
+    else if (!strcmp(league, "uknxcl"))
+        return track_optimize_uknxcl;
+    else if (!strcmp(league, "ukxcl"))
+        return track_optimize_ukxcl;
+    else
+        return 0;
 }